@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2024 Alejandro Cadarso
+ *
+ * This file is part of Memtrace.
+ *
+ * Memtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Memtrace.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * File: callsite.h
+ * Author: Alejandro Cadarso
+ * Date: 17-10-2026
+ *
+ * This header file provides the interface for the call-site table, a
+ * deduplicated store of allocation stack traces kept in shared memory.
+ * Allocations only carry a small site id, the stack trace itself is
+ * stored once per distinct call site as raw return addresses, together
+ * with the module map needed to make sense of them in the parent process.
+ *
+ */
+
+#ifndef CALLSITE_H
+#define CALLSITE_H
+
+// Max number of return addresses stored per call site
+#define ST_MAX_DEPTH 64
+
+// Max number of distinct call sites, ids are always below it
+#define ST_MAX_SITES (1 << 18)
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "modmap.h"
+#include "symbolize.h"
+
+typedef uint32_t siteId;
+
+// Site id used when the stack could not be interned (empty trace or full table)
+#define ST_UNKNOWN_SITE 0
+
+/**
+ * Frames are stored in a pool shared by all sites since the depth is chosen
+ * at runtime, use st_frames to get them
+ */
+typedef struct callSite {
+    uint64_t hash;
+    uint32_t depth;
+    uint32_t frames;
+} callSite;
+
+/**
+ * Allocation activity of a call site. When sampling, every sampled block
+ * counts for the blocks and bytes it stands for.
+ * Cache line sized so hot sites don't false share
+ */
+typedef struct siteCounters {
+    uint64_t allocs;
+    uint64_t alloc_bytes;
+    uint64_t frees;
+    uint64_t free_bytes;
+    uint64_t live_bytes;
+    uint64_t peak_live_bytes;
+} __attribute__((aligned(64))) siteCounters;
+
+/**
+ * Lifetimes of the blocks freed from a call site, in ts_now() ticks.
+ * Bucket i counts lifetimes in [2^i, 2^(i+1)), the last one everything longer
+ */
+#define ST_LIFETIME_BUCKETS 48
+
+typedef struct siteLifetimes {
+    uint64_t buckets[ST_LIFETIME_BUCKETS];
+} siteLifetimes;
+
+// Live bytes of a site when the peak heap snapshot was taken
+typedef struct sitePeak {
+    siteId id;
+    uint64_t live_bytes;
+} sitePeak;
+
+typedef struct siteTable siteTable;
+
+
+// Creates a call-site table and returns a pointer
+siteTable* st_create();
+
+// Attaches the call-site table created by the parent process
+siteTable* st_load();
+
+// Destroys a call-site table, no return
+void st_destroy(siteTable* st);
+
+// Returns the id of the site for the given frames, creating it if needed
+siteId st_intern(siteTable* st, void* const* frames, uint32_t depth);
+
+// Retrieves a call site by id, returns NULL for unknown ids
+const callSite* st_get(siteTable* st, siteId id);
+
+// Retrieves the return addresses of a call site, site->depth of them
+void* const* st_frames(siteTable* st, const callSite* site);
+
+// Counts count allocations of bytes in total from a site
+void st_count_alloc(siteTable* st, siteId id, uint64_t count, uint64_t bytes);
+
+// Counts count frees of bytes in total of blocks allocated from a site that lived lifetime ticks
+void st_count_free(siteTable* st, siteId id, uint64_t count, uint64_t bytes, uint64_t lifetime);
+
+// Retrieves the counters of a site, NULL for ids never handed out
+const siteCounters* st_counters(siteTable* st, siteId id);
+
+// Retrieves the lifetime histogram of a site, NULL for ids never handed out
+const siteLifetimes* st_lifetimes(siteTable* st, siteId id);
+
+// Returns the highest number of live bytes seen, the snapshot may be slightly below it
+uint64_t st_peak_live_bytes(siteTable* st);
+
+/**
+ * Retrieves the per-site breakdown of the heap at its last snapshot, which may
+ * trail the true peak, sets length to the number of sites and live_bytes to their sum
+ */
+const sitePeak* st_peak_snapshot(siteTable* st, uint32_t* length, uint64_t* live_bytes);
+
+// Prints the peak heap snapshot, the top sites by live bytes near the peak with their stack traces
+void st_print_peak(siteTable* st, uint32_t top);
+
+// Prints the stack trace of a site to out, one frame per line with its function, file and line when known
+void st_print_frames(siteTable* st, siteId id, FILE* out);
+
+/**
+ * Resolves the frames of every site stored so far that were not resolved yet,
+ * across several threads when there are many. Reports do it on demand,
+ * calling it up front only moves the work
+ */
+void st_symbolize(siteTable* st);
+
+// Retrieves the symbol of frame i of a site, NULL if nothing is known about it
+const symbolInfo* st_symbol(siteTable* st, const callSite* site, uint32_t i);
+
+// Formats frame i of a site as function at file:line, or module(+file offset) when unknown
+int st_format_frame(siteTable* st, const callSite* site, uint32_t i, char* buffer, size_t size);
+
+/**
+ * Prints the top sites by number of allocations with their counters and stack traces.
+ * If ticks_per_ns is not 0 their lifetime histograms are printed too
+ */
+void st_print_hottest(siteTable* st, uint32_t top, double ticks_per_ns);
+
+// Returns the number of distinct call sites stored
+uint32_t st_length(siteTable* st);
+
+// Returns the module map covering the frames of every stored site
+const moduleMap* st_modules(siteTable* st);
+
+// Replaces the module map with mm and stops taking snapshots, for tables rebuilt from a recording
+void st_load_modules(siteTable* st, const moduleMap* mm);
+
+#endif
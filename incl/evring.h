@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2024 Alejandro Cadarso
+ *
+ * This file is part of Memtrace.
+ *
+ * Memtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Memtrace.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * File: evring.h
+ * Author: Alejandro Cadarso
+ * Date: 17-10-2026
+ *
+ * This header file provides the interface for the event rings used in
+ * asynchronous mode. Each thread of the traced process appends its
+ * allocation and free events to its own single producer ring in shared
+ * memory, memtrace drains them and maintains the hashtable itself.
+ *
+ */
+
+#ifndef EVRING_H
+#define EVRING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "hashtable.h"
+
+typedef struct eventRings eventRings;
+
+
+// Creates the event rings and returns a pointer
+eventRings* er_create();
+
+// Attaches the event rings created by the parent process, NULL if not in async mode
+eventRings* er_load();
+
+// Destroys the event rings, no return
+void er_destroy(eventRings* er);
+
+// Appends an allocation event to the calling thread's ring
+void er_push_alloc(eventRings* er, size_t address, allocInfo info);
+
+// Appends a free event to the calling thread's ring
+void er_push_free(eventRings* er, size_t address, uint64_t timestamp);
+
+// Applies every published event to ht and the site counters of st, returns the number of events consumed
+size_t er_drain(eventRings* er, hashTable* ht, siteTable* st);
+
+#endif
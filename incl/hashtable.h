@@ -21,8 +21,8 @@
  * Date: 28-05-2024
  *
  * This header file provides the interface for a custom hash table
- * implementation in C, featuring dynamic resizing, double hashing for
- * collision resolution, and the FNV-1 hash function. It includes function
+ * implementation in C, featuring sharding, incremental resizing and a
+ * Swiss table layout with SIMD group probing. It includes function
  * prototypes for creating, inserting, deleting, retrieving, and debugging
  * hash table operations.
  *
@@ -31,24 +31,57 @@
 #ifndef HASHTABLE_H
 #define HASHTABLE_H
 
-// Max sizes for storing backtrace symbols
-#define MAX_STRINGS 10
-#define MAX_CHAR 256
-
 #include <stdbool.h>
 #include <semaphore.h>
 #include <stdint.h>
+#include "callsite.h"
 
 typedef struct allocInfo {
-    uint32_t block_size;
-    char stack_trace[MAX_STRINGS][MAX_CHAR];
+    uint64_t block_size;
+    siteId site_id;
+    // ts_now() at allocation time
+    uint64_t timestamp;
 } allocInfo;
 
+// A live block as copied out by ht_collect
+typedef struct htBlock {
+    uint64_t address;
+    uint64_t block_size;
+    siteId site_id;
+} htBlock;
+
 typedef struct hashTable hashTable;
 
+// Probe lengths, in groups, are bucketed from 1 to HT_PROBE_BUCKETS or more
+#define HT_PROBE_BUCKETS 8
+
+typedef struct htStats {
+    uint64_t length;
+    uint64_t capacity;
+    uint64_t tombstones;
+    // Longest probe, in groups, any current entry was placed at
+    uint64_t max_probe;
+    uint64_t lookups;
+    uint64_t probed_groups;
+    uint64_t probe_histogram[HT_PROBE_BUCKETS];
+} htStats;
+
+
+/**
+ * Creates a hashtable and returns a pointer. It is sized up front to hold
+ * capacity_hint entries without resizing, huge_pages asks for big segments
+ * to be backed by transparent huge pages
+ */
+hashTable* ht_create(uint64_t capacity_hint, bool huge_pages);
+
+// Records the mean sampling interval of the session so reports can extrapolate, 0 if not sampling
+void ht_set_sample_interval(hashTable* ht, uint64_t sample_interval);
 
-// Creates a hashtable and returns a pointer
-hashTable* ht_create();
+// Mean sampling interval of the session, 0 if not sampling
+uint64_t ht_sample_interval(hashTable* ht);
+
+// Attaches the hashtable of the session the process runs in, NULL if there is none
+hashTable* ht_load();
 
 // Destroys a hashtable, no return
 void ht_destroy(hashTable* ht);
@@ -59,10 +92,28 @@ bool ht_insert(hashTable* ht, const size_t key, allocInfo value);
 // Deletes entry from a hashtable, true is success false if failure
 bool ht_delete(hashTable* ht, const size_t key);
 
+// Deletes entry from a hashtable and copies it to removed, true only if it existed
+bool ht_remove(hashTable* ht, const size_t key, allocInfo* removed);
+
 // Retrieves allocationInfo from a hashtable, returns a const pointer
 const allocInfo* ht_get(hashTable* ht, const size_t key);
 
-// Prints hashtable contents for dbg purposes
-void ht_print_debug(hashTable* ht, bool s_flag);
+// Fills stats with the occupancy and lookup probe lengths of every shard
+void ht_stats(hashTable* ht, htStats* stats);
+
+/**
+ * Copies up to capacity live blocks to blocks, in no particular order, and
+ * returns how many were copied. Shards are locked one at a time
+ */
+size_t ht_collect(hashTable* ht, htBlock* blocks, size_t capacity);
+
+// Prints ht_stats for tuning purposes
+void ht_print_stats(hashTable* ht);
+
+/**
+ * Prints the leaked totals. With s_flag, also the top call sites by leaked
+ * bytes with their stack traces, looked up in st
+ */
+void ht_print_debug(hashTable* ht, siteTable* st, bool s_flag, uint32_t top);
 
 #endif
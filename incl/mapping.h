@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2024 Alejandro Cadarso
+ *
+ * This file is part of Memtrace.
+ *
+ * Memtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Memtrace.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * File: mapping.h
+ * Author: Alejandro Cadarso
+ * Date: 17-10-2026
+ *
+ * This header file provides the interface for the mapping table, which
+ * tracks the regions the traced program maps itself with mmap, mremap,
+ * brk and sbrk. Each region remembers the call site that mapped it, so
+ * memory that never goes through malloc can be attributed too.
+ *
+ */
+
+#ifndef MAPPING_H
+#define MAPPING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "callsite.h"
+
+typedef enum regionKind {
+    MP_ANONYMOUS,
+    MP_FILE,
+    MP_BRK
+} regionKind;
+
+// A mapped range of addresses, [start, end)
+typedef struct mappedRegion {
+    uint64_t start;
+    uint64_t end;
+    siteId site_id;
+    uint32_t kind;
+} mappedRegion;
+
+// Mapping activity of a call site
+typedef struct mappingCounters {
+    uint64_t maps;
+    uint64_t mapped_bytes;
+    uint64_t live_bytes;
+    uint64_t peak_live_bytes;
+} mappingCounters;
+
+typedef struct mappingTable mappingTable;
+
+
+// Creates the mapping table and returns a pointer
+mappingTable* mp_create();
+
+// Attaches the mapping table created by the parent process
+mappingTable* mp_load();
+
+// Destroys the mapping table, no return
+void mp_destroy(mappingTable* mp);
+
+/**
+ * Records that a site mapped [start, start + length). Whatever was mapped
+ * there before is gone, as with MAP_FIXED. False if the table is full
+ */
+bool mp_map(mappingTable* mp, uint64_t start, uint64_t length, siteId site_id, regionKind kind);
+
+// Records that [start, start + length) was unmapped, regions partly in it are split or trimmed
+void mp_unmap(mappingTable* mp, uint64_t start, uint64_t length);
+
+// Copies the region holding address to region, false if it is not mapped
+bool mp_region_at(mappingTable* mp, uint64_t address, mappedRegion* region);
+
+// Retrieves the regions mapped right now, sorted by address. The table must not change while they are used
+const mappedRegion* mp_regions(mappingTable* mp, uint32_t* length);
+
+// Retrieves the mapping counters of a site, NULL for ids out of range
+const mappingCounters* mp_counters(mappingTable* mp, siteId id);
+
+// Bytes mapped right now and at most at any time
+uint64_t mp_live_bytes(mappingTable* mp);
+uint64_t mp_peak_live_bytes(mappingTable* mp);
+
+/**
+ * Prints the top sites by mapped bytes at their peak, with the bytes they
+ * still have mapped and their stack traces
+ */
+void mp_print(mappingTable* mp, siteTable* st, uint32_t top);
+
+// Prints a line with the bytes still mapped, if any
+void mp_print_summary(mappingTable* mp);
+
+#endif
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2024 Alejandro Cadarso
+ *
+ * This file is part of Memtrace.
+ *
+ * Memtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Memtrace.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * File: modmap.h
+ * Author: Alejandro Cadarso
+ * Date: 17-10-2026
+ *
+ * This header file provides the interface for the module map, a snapshot
+ * of the executable mappings of the traced process. Raw return addresses
+ * recorded by the interposer are resolved against it in the parent process
+ * when the report is printed.
+ *
+ */
+
+#ifndef MODMAP_H
+#define MODMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define MM_MAX_MODULES 512
+#define MM_MAX_PATH 256
+
+typedef struct moduleInfo {
+    uintptr_t start;
+    uintptr_t end;
+    uintptr_t offset;
+    char path[MM_MAX_PATH];
+} moduleInfo;
+
+/**
+ * Plain data so it can be embedded in shared memory segments,
+ * snapshots only ever append modules
+ */
+typedef struct moduleMap {
+    uint32_t length;
+    moduleInfo modules[MM_MAX_MODULES];
+} moduleMap;
+
+
+// Initializes an empty module map
+void mm_init(moduleMap* mm);
+
+// Adds the executable mappings of the current process, does not allocate
+bool mm_snapshot(moduleMap* mm);
+
+// Finds the bounds of the mapping containing address, does not allocate
+bool mm_mapping_of(uintptr_t address, uintptr_t* start, uintptr_t* end);
+
+// Returns true if every frame falls inside a known module
+bool mm_covers(const moduleMap* mm, void* const* frames, uint32_t depth);
+
+// Retrieves the module containing pc, returns NULL if there is none
+const moduleInfo* mm_find(const moduleMap* mm, uintptr_t pc);
+
+// Formats pc as module(+file offset) [pc], returns the written length
+int mm_format(const moduleMap* mm, uintptr_t pc, char* buffer, size_t size);
+
+#endif
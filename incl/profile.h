@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2024 Alejandro Cadarso
+ *
+ * This file is part of Memtrace.
+ *
+ * Memtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Memtrace.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * File: profile.h
+ * Author: Alejandro Cadarso
+ * Date: 17-10-2026
+ *
+ * This header file provides the interface for the profile writers. They
+ * export the call-site counters as a pprof protobuf profile or as folded
+ * stacks for flamegraph tools, one record per site as the table is walked.
+ *
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "callsite.h"
+
+// Value written per stack in folded output
+typedef enum profileWeight {
+    PF_INUSE,
+    PF_PEAK,
+    PF_ALLOC
+} profileWeight;
+
+
+// Parses a folded stack weight ("inuse", "peak" or "alloc"), false if unknown
+bool pf_parse_weight(const char* name, profileWeight* weight);
+
+/**
+ * Writes an uncompressed pprof profile of st to out, with the allocated,
+ * in use and peak objects and bytes of every site. Returns false on write errors
+ */
+bool pf_write_pprof(siteTable* st, FILE* out, uint64_t duration_ns, uint64_t sample_interval);
+
+// Writes one "frame;frame;... bytes" line per site, outermost frame first. Returns false on write errors
+bool pf_write_folded(siteTable* st, FILE* out, profileWeight weight);
+
+// pf_write_pprof to a new file at path, false if it can't be created or written
+bool pf_save_pprof(siteTable* st, const char* path, uint64_t duration_ns, uint64_t sample_interval);
+
+// pf_write_folded to a new file at path, false if it can't be created or written
+bool pf_save_folded(siteTable* st, const char* path, profileWeight weight);
+
+#endif
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2024 Alejandro Cadarso
+ *
+ * This file is part of Memtrace.
+ *
+ * Memtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Memtrace.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * File: resident.h
+ * Author: Alejandro Cadarso
+ * Date: 17-10-2026
+ *
+ * This header file provides the interface for resident memory attribution.
+ * The traced process measures which pages of its live blocks and mapped
+ * regions are resident when it exits and charges them to the call sites
+ * that allocated them, memtrace reports the result.
+ *
+ */
+
+#ifndef RESIDENT_H
+#define RESIDENT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "hashtable.h"
+#include "callsite.h"
+#include "mapping.h"
+
+// Live and resident bytes of a site, heap blocks and mapped regions apart
+typedef struct residentCounters {
+    uint64_t heap_bytes;
+    uint64_t heap_resident_bytes;
+    uint64_t mapped_bytes;
+    uint64_t mapped_resident_bytes;
+} residentCounters;
+
+typedef struct residentTable residentTable;
+
+
+// Creates the resident table, the traced process measures into it at exit
+residentTable* rs_create();
+
+// Attaches the resident table created by the parent process, NULL if not asked to measure
+residentTable* rs_load();
+
+// Destroys the resident table, no return
+void rs_destroy(residentTable* rs);
+
+/**
+ * Measures the resident pages of every live block of ht and region of mp,
+ * which must belong to the calling process, and charges them to their
+ * sites. A page shared by several blocks is split by the bytes each one
+ * covers. False if there was not enough memory to sort the blocks
+ */
+bool rs_measure(residentTable* rs, hashTable* ht, mappingTable* mp, uint64_t sample_interval);
+
+// Retrieves the counters of a site, NULL for ids out of range
+const residentCounters* rs_counters(residentTable* rs, siteId id);
+
+// Prints the totals and the top sites by resident bytes with their stack traces
+void rs_print(residentTable* rs, siteTable* st, uint32_t top);
+
+#endif
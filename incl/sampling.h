@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2024 Alejandro Cadarso
+ *
+ * This file is part of Memtrace.
+ *
+ * Memtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Memtrace.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * File: sampling.h
+ * Author: Alejandro Cadarso
+ * Date: 17-10-2026
+ *
+ * This header file provides the byte based Poisson sampling used when
+ * memtrace runs with a sampling interval. Sample points fall on allocated
+ * bytes at exponentially distributed distances with the configured mean,
+ * an allocation is recorded when at least one lands on it. The chance of
+ * that depends only on its size, which is what lets the reports weigh
+ * every sample back into an unbiased estimate.
+ *
+ */
+
+#ifndef SAMPLING_H
+#define SAMPLING_H
+
+#include <math.h>
+#include <stdint.h>
+
+// Suggested mean interval, low enough for per-site estimates at a small overhead
+#define SP_DEFAULT_INTERVAL (512 * 1024)
+
+// xorshift64*, state must not be 0
+static inline uint64_t sp_random(uint64_t* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+// Distance in bytes to the next sample point
+static inline int64_t sp_next_interval(uint64_t* state, uint64_t mean_interval) {
+    // 53 random bits, uniform in (0, 1]
+    double uniform = ((sp_random(state) >> 11) + 1) * (1.0 / 9007199254740992.0);
+    return (int64_t)(-log(uniform) * mean_interval) + 1;
+}
+
+// Allocations a sample of size bytes stands for, the inverse of its sampling probability
+static inline double sp_weight(uint64_t size, uint64_t mean_interval) {
+    if (!mean_interval || !size) {
+        return 1.0;
+    }
+    return 1.0 / -expm1(-(double)size / mean_interval);
+}
+
+// value scaled by the weight of a sample of size bytes, rounded
+static inline uint64_t sp_scale(uint64_t value, uint64_t size, uint64_t mean_interval) {
+    if (!mean_interval) {
+        return value;
+    }
+    return (uint64_t)(value * sp_weight(size, mean_interval) + 0.5);
+}
+
+#endif
@@ -20,11 +20,11 @@
  * Author: Alejandro Cadarso
  * Date: 28-05-2024
  *
- * This header file provides the interface for managing shared memory segments
- * in C, including functions for allocating, loading, and freeing shared memory.
- * These functions facilitate the creation and management of shared memory
- * resources, essential for inter-process communication and data sharing across
- * different processes within the same system.
+ * This header file provides the interface for managing the shared memory
+ * region of a memtrace session. The region is a memfd mapped with a large
+ * MAP_NORESERVE reservation, inherited by the traced process through its
+ * file descriptor, so sessions never collide with each other and blocks
+ * are handed out by offset without ever remapping.
  *
  */
 
@@ -32,16 +32,58 @@
 #define SHMWRAP_H
 
 #include <stdbool.h>
-#include <sys/shm.h>
+#include <stddef.h>
+#include <stdint.h>
 
+// Offset of a block inside the session region, 0 is never a valid block
+typedef uint64_t shmOffset;
 
-// Allocates space on shared memory and returns it's shmid
-int shmalloc(key_t key, size_t size );
+// Well known blocks, found by the traced process through the region header
+typedef enum shmRoot {
+    SHM_ROOT_HT,
+    SHM_ROOT_ST,
+    SHM_ROOT_ER,
+    SHM_ROOT_MP,
+    SHM_ROOT_RS,
+    SHM_ROOTS
+} shmRoot;
 
-// Loads shared memory segment into current context
-void* shmload(int shmid);
+// Base of the region in the current process, NULL if not attached
+extern char* shm_base;
 
-// Frees shared memory (needs to be loaded in current context)
-bool shmfree(void* ptr, int shmid);
+
+// Creates the session region and exports it to child processes, true is success
+bool shm_create(void);
+
+// Attaches the region of the session this process runs in, false if there is none
+bool shm_attach(void);
+
+// Unmaps and releases the session region
+void shm_destroy(void);
+
+// Allocates a zero filled, page aligned block and returns its offset, 0 if failure
+shmOffset shmalloc(size_t size);
+
+// Returns a block to the region, its pages are released right away
+void shmfree(shmOffset offset, size_t size);
+
+// Advises the kernel to back a block with transparent huge pages
+void shmadvise_huge(shmOffset offset, size_t size);
+
+// Publishes a well known block for the traced process
+void shm_set_root(shmRoot root, shmOffset offset);
+
+// Offset of a well known block, 0 if it was never published
+shmOffset shm_root(shmRoot root);
+
+// Pointer to a block in the current process
+static inline void* shmload(shmOffset offset) {
+    return offset? shm_base + offset : NULL;
+}
+
+// Offset of a pointer into the region
+static inline shmOffset shmoffset(const void* ptr) {
+    return ptr? (shmOffset)((const char*)ptr - shm_base) : 0;
+}
 
 #endif
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2024 Alejandro Cadarso
+ *
+ * This file is part of Memtrace.
+ *
+ * Memtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Memtrace.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * File: symbolize.h
+ * Author: Alejandro Cadarso
+ * Date: 17-10-2026
+ *
+ * This header file provides the interface for the symbolizer. It resolves
+ * the addresses of a module map to function, file and line by reading the
+ * ELF symbol tables and DWARF line tables of the modules themselves.
+ *
+ */
+
+#ifndef SYMBOLIZE_H
+#define SYMBOLIZE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "modmap.h"
+
+/**
+ * Strings point into the mapped module files and stay valid until the
+ * symbolizer is destroyed. Any of them may be NULL when unknown
+ */
+typedef struct symbolInfo {
+    const char* function;
+    const char* directory;
+    const char* file;
+    uint32_t line;
+} symbolInfo;
+
+typedef struct symbolizer symbolizer;
+
+
+// Creates a symbolizer for the modules of mm, which may keep growing, and returns a pointer
+symbolizer* sy_create(const moduleMap* mm);
+
+// Destroys a symbolizer and unmaps every module it loaded, no return
+void sy_destroy(symbolizer* sy);
+
+/**
+ * Resolves a return address to the call it returns from, false if nothing
+ * is known about it. Modules are loaded on first use, safe to call from many threads
+ */
+bool sy_resolve(symbolizer* sy, uintptr_t pc, symbolInfo* info);
+
+// Formats info as function at file:line, returns the written length, 0 if info is empty
+int sy_format(const symbolInfo* info, char* buffer, size_t size);
+
+#endif
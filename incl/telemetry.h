@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2024 Alejandro Cadarso
+ *
+ * This file is part of Memtrace.
+ *
+ * Memtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Memtrace.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * File: telemetry.h
+ * Author: Alejandro Cadarso
+ * Date: 17-10-2026
+ *
+ * This header file provides the interface for live heap telemetry. While
+ * the traced process runs, memtrace periodically reads the call-site
+ * counters and emits a time series of live bytes, live blocks, allocation
+ * rate and the sites allocating the most since the previous sample. It
+ * also reports heap diffs, the per-site growth of live bytes between two
+ * points in time.
+ *
+ */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "callsite.h"
+
+typedef struct telemetry telemetry;
+
+
+// Creates a telemetry sampler reporting the top sites of st to out, times are relative to start_ns
+telemetry* tm_create(siteTable* st, uint32_t top, FILE* out, uint64_t start_ns);
+
+// Destroys a telemetry sampler, no return
+void tm_destroy(telemetry* tm);
+
+// Emits one sample, now_ns is CLOCK_MONOTONIC in nanoseconds
+void tm_sample(telemetry* tm, uint64_t now_ns);
+
+// Emits the sites whose live bytes changed the most since the previous diff, or since the start
+void tm_diff(telemetry* tm, uint64_t now_ns);
+
+#endif
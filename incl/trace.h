@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2024 Alejandro Cadarso
+ *
+ * This file is part of Memtrace.
+ *
+ * Memtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Memtrace.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * File: trace.h
+ * Author: Alejandro Cadarso
+ * Date: 17-10-2026
+ *
+ * This header file provides the interface for allocation traces. In
+ * recording mode the interposer appends every allocation and free to a
+ * memory mapped trace file instead of maintaining the hashtable, memtrace
+ * completes the file with the call sites once the traced process exits
+ * and memtrace-analyze rebuilds the reports from it afterwards.
+ *
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "hashtable.h"
+#include "callsite.h"
+
+#define TR_EVENT_ALLOC 1
+#define TR_EVENT_FREE 2
+
+typedef struct trace trace;
+
+// A decoded event, frees carry no size or site
+typedef struct traceEvent {
+    uint64_t timestamp;
+    uint64_t address;
+    uint64_t block_size;
+    siteId site_id;
+    uint32_t kind;
+    // Thread that recorded the event
+    uint32_t tid;
+} traceEvent;
+
+
+// Creates the trace file at path for the traced process to record into, NULL on failure
+trace* tr_create(const char* path, uint64_t sample_interval);
+
+// Attaches the trace created by the parent process, NULL if not in recording mode
+trace* tr_load();
+
+// Appends an allocation event to the calling thread's chunk of the trace
+void tr_push_alloc(trace* tr, size_t address, allocInfo info);
+
+// Appends a free event to the calling thread's chunk of the trace
+void tr_push_free(trace* tr, size_t address, uint64_t timestamp);
+
+/**
+ * Completes a recorded trace with the call sites and modules of st once the
+ * traced process is done, ticks_per_ns converts its timestamps. False on write errors
+ */
+bool tr_finish(trace* tr, siteTable* st, double ticks_per_ns, uint64_t duration_ns);
+
+// Maps a completed trace file for reading, NULL if it can't be read
+trace* tr_open(const char* path);
+
+/**
+ * Decodes every event of a trace opened with tr_open and puts them back in
+ * time order using up to nthreads threads. Returns an array the caller
+ * frees with its length in nevents, NULL if out of memory
+ */
+traceEvent* tr_sorted_events(trace* tr, int nthreads, size_t* nevents);
+
+/**
+ * Rebuilds ht and st from a trace opened with tr_open. Events are decoded
+ * and put back in time order by up to nthreads threads, then applied in order
+ */
+bool tr_replay(trace* tr, hashTable* ht, siteTable* st, int nthreads);
+
+// Sampling interval the trace was recorded with, 0 if every allocation was recorded
+uint64_t tr_sample_interval(trace* tr);
+
+// Timestamp ticks per nanosecond of the recording
+double tr_ticks_per_ns(trace* tr);
+
+// Wall time the traced process ran for
+uint64_t tr_duration_ns(trace* tr);
+
+// Events recorded, and lost because the trace file could not grow
+uint64_t tr_events(trace* tr);
+uint64_t tr_dropped(trace* tr);
+
+// Unmaps and closes a trace, no return
+void tr_destroy(trace* tr);
+
+#endif
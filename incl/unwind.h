@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2024 Alejandro Cadarso
+ *
+ * This file is part of Memtrace.
+ *
+ * Memtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Memtrace.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * File: unwind.h
+ * Author: Alejandro Cadarso
+ * Date: 17-10-2026
+ *
+ * This header file provides the interface for the stack unwinders used by
+ * the interposer. The unwinder and the capture depth are selected at
+ * runtime through the environment set up by memtrace.
+ *
+ */
+
+#ifndef UNWIND_H
+#define UNWIND_H
+
+#include <stdbool.h>
+
+// Capture depth used when none is configured
+#define UW_DEFAULT_DEPTH 8
+
+typedef enum unwindMode {
+    UW_DWARF,
+    UW_FRAME_POINTER
+} unwindMode;
+
+
+// Reads MEMTRACE_UNWIND and MEMTRACE_DEPTH, capped to max_depth, and warms up the unwinder
+void uw_init(int max_depth);
+
+// Parses an unwinder name ("dwarf" or "fp"), false if unknown
+bool uw_parse_mode(const char* name, unwindMode* mode);
+
+/**
+ * Captures up to the configured depth of return addresses into frames,
+ * dropping the first skip frames above the caller. Returns the number captured
+ */
+int uw_capture(void** frames, int skip);
+
+#if defined(UW_TEST) && defined(__x86_64__)
+// Same as uw_capture through the cached DWARF walk alone, -1 where it would fall back to backtrace()
+int uw_capture_cached(void** frames, int skip);
+#endif
+
+#endif
@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2024 Alejandro Cadarso
+ *
+ * This file is part of Memtrace.
+ *
+ * Memtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Memtrace.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * File: analyze.c
+ * Author: Alejandro Cadarso
+ * Date: 17-10-2026
+ *
+ * This file implements memtrace-analyze, which builds the memtrace reports
+ * from a trace recorded with memtrace -r. The recording is replayed into a
+ * fresh hashtable and call-site table, so a single run of the traced
+ * program can be looked at in as many ways as needed afterwards.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "hashtable.h"
+#include "callsite.h"
+#include "shmwrap.h"
+#include "profile.h"
+#include "trace.h"
+
+// Sites shown with -s, -l or -m when -t does not say how many
+#define DEFAULT_HOTTEST 10
+
+void print_usage(void);
+
+int main(int argc, char* argv[]) {
+    bool h_opt = false;
+    bool s_opt = false;
+    bool p_opt = false;
+    bool l_opt = false;
+    bool m_opt = false;
+    uint32_t hottest = 0;
+    bool invalid_opt = false;
+    char* pprof_path = NULL;
+    char* folded_path = NULL;
+    profileWeight folded_weight = PF_INUSE;
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    char* end;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "splmht:P:F:w:j:")) != -1) {
+        switch (opt) {
+            case 's':
+                s_opt = true;
+                break;
+            case 'p':
+                p_opt = true;
+                break;
+            case 'l':
+                l_opt = true;
+                break;
+            case 'm':
+                m_opt = true;
+                break;
+            case 't':
+                hottest = strtoul(optarg, &end, 10);
+                if (hottest == 0 || *end != '\0') {
+                    invalid_opt = true;
+                }
+                break;
+            case 'P':
+                pprof_path = optarg;
+                break;
+            case 'F':
+                folded_path = optarg;
+                break;
+            case 'w':
+                if (!pf_parse_weight(optarg, &folded_weight)) {
+                    invalid_opt = true;
+                }
+                break;
+            case 'j':
+                nthreads = strtol(optarg, &end, 10);
+                if (nthreads < 1 || *end != '\0') {
+                    invalid_opt = true;
+                }
+                break;
+            case 'h':
+                h_opt = true;
+                break;
+            default:
+                invalid_opt = true;
+                break;
+        }
+    }
+
+    if (invalid_opt || h_opt || !(optind < argc)) {
+        print_usage();
+        exit(0);
+    }
+
+    trace* tr = tr_open(argv[optind]);
+
+    if (!tr) {
+        printf("Could not read trace file %s\n", argv[optind]);
+        exit(1);
+    }
+
+    if (!shm_create()) {
+        printf("Could not create shared memory region");
+        tr_destroy(tr);
+        exit(1);
+    }
+
+    hashTable* ht = ht_create(0, false);
+    siteTable* st = st_create();
+
+    if (!ht || !st) {
+        printf("Could not start tables");
+        ht_destroy(ht);
+        st_destroy(st);
+        tr_destroy(tr);
+        shm_destroy();
+        exit(1);
+    }
+
+    ht_set_sample_interval(ht, tr_sample_interval(tr));
+
+    if (!tr_replay(tr, ht, st, nthreads)) {
+        printf("Could not replay trace file %s\n", argv[optind]);
+    } else {
+        printf("Replayed %lu events recorded over %.3fs", tr_events(tr), tr_duration_ns(tr) / 1e9);
+        if (tr_dropped(tr)) {
+            printf(", %lu more were dropped while recording", tr_dropped(tr));
+        }
+        printf("\n\n");
+
+        ht_print_debug(ht, st, s_opt, hottest? hottest : DEFAULT_HOTTEST);
+        if (hottest || l_opt) {
+            st_print_hottest(st, hottest? hottest : DEFAULT_HOTTEST, l_opt? tr_ticks_per_ns(tr) : 0);
+        }
+        if (m_opt) {
+            st_print_peak(st, hottest? hottest : DEFAULT_HOTTEST);
+        }
+        if (p_opt) {
+            ht_print_stats(ht);
+        }
+        if (pprof_path && !pf_save_pprof(st, pprof_path, tr_duration_ns(tr), tr_sample_interval(tr))) {
+            printf("Could not write pprof profile to %s\n", pprof_path);
+        }
+        if (folded_path && !pf_save_folded(st, folded_path, folded_weight)) {
+            printf("Could not write folded stacks to %s\n", folded_path);
+        }
+    }
+
+    ht_destroy(ht);
+    st_destroy(st);
+    tr_destroy(tr);
+    shm_destroy();
+
+    return 0;
+}
+
+
+void print_usage(void) {
+    printf("Usage: memtrace-analyze <trace> <option(s)>\n");
+    printf("  Report on a trace recorded with memtrace -r <trace>\n");
+    printf("  -s, Display the call sites leaking the most bytes with their stack traces (default %d sites)\n", DEFAULT_HOTTEST);
+    printf("  -t <n>, Display the <n> call sites allocating most often, also sets the sites shown by -s, -l and -m\n");
+    printf("  -l, Display allocation lifetime histograms of the hottest call sites (default %d sites)\n", DEFAULT_HOTTEST);
+    printf("  -m, Display the call sites holding the heap at its peak (default %d sites)\n", DEFAULT_HOTTEST);
+    printf("  -P <file>, Write a pprof profile of allocated, in use and peak memory per call site to <file>\n");
+    printf("  -F <file>, Write folded stacks for flamegraphs to <file>\n");
+    printf("  -w <inuse|peak|alloc>, Bytes the folded stacks are weighted by (default inuse)\n");
+    printf("  -p, Display hashtable probe length statistics\n");
+    printf("  -j <threads>, Threads decoding the trace (default one per CPU)\n");
+    printf("  -h, Display this information\n");
+}
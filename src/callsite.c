@@ -0,0 +1,647 @@
+/*
+ * Copyright (C) 2024 Alejandro Cadarso
+ *
+ * This file is part of Memtrace.
+ *
+ * Memtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Memtrace.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * File: callsite.c
+ * Author: Alejandro Cadarso
+ * Date: 17-10-2026
+ *
+ * This file provides the implementation of the call-site table. Distinct
+ * stack traces are stored once in a single shared memory segment and
+ * indexed by a hash of their return addresses, so lookups of known sites
+ * never take the lock. Sites are never removed, which keeps the index
+ * append only. New sites whose frames fall outside the known modules
+ * trigger a fresh module map snapshot, nothing is symbolized here.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "callsite.h"
+#include "shmwrap.h"
+
+// Power of two, at least twice the sites so probing stays short
+#define ST_INDEX_CAPACITY (ST_MAX_SITES * 2)
+// Room for every site at twice the default capture depth
+#define ST_MAX_POOL_FRAMES (ST_MAX_SITES * 16)
+
+/**
+ * The whole table lives in one fixed size segment, it never gets resized
+ * so the child can attach it once and keep the pointer.
+ * Index slots hold site ids, 0 marks an empty slot since site 0 is reserved
+ * for unknown call sites.
+ */
+struct siteTable {
+    uint32_t length;
+    uint32_t pool_length;
+    pthread_mutex_t mutex;
+    // Bytes live across all sites, on their own line since every allocation touches them
+    uint64_t live_bytes __attribute__((aligned(64)));
+    uint64_t peak_live_bytes;
+    // Live bytes the next snapshot waits for, read on every allocation
+    uint64_t snapshot_threshold __attribute__((aligned(64)));
+    pthread_mutex_t snapshot_mutex;
+    uint32_t snapshot_length;
+    uint64_t snapshot_live_bytes;
+    // Set when the modules come from a recording, the current process maps are unrelated
+    bool modules_loaded;
+    moduleMap modules;
+    siteId index[ST_INDEX_CAPACITY];
+    callSite sites[ST_MAX_SITES];
+    siteCounters counters[ST_MAX_SITES];
+    siteLifetimes lifetimes[ST_MAX_SITES];
+    void* pool[ST_MAX_POOL_FRAMES];
+    sitePeak snapshot[ST_MAX_SITES];
+};
+
+// Lifetime ranges of the report, upper bounds in nanoseconds
+static const struct {
+    const char* label;
+    double limit_ns;
+} lifetime_ranges[] = {
+    { "<1us", 1e3 },
+    { "<1ms", 1e6 },
+    { "<1s", 1e9 },
+    { "<1min", 60e9 },
+    { ">=1min", 0 },
+};
+
+#define ST_LIFETIME_RANGES (sizeof(lifetime_ranges) / sizeof(lifetime_ranges[0]))
+
+/**
+ * A new peak is only snapshotted once live bytes grow past the last snapshot
+ * by 1/ST_SNAPSHOT_GROWTH, so a heap growing steadily takes a logarithmic
+ * number of snapshots. Heaps below ST_SNAPSHOT_MIN_BYTES are not worth one
+ */
+#define ST_SNAPSHOT_GROWTH 16
+#define ST_SNAPSHOT_MIN_BYTES (1 << 20)
+
+// Frames left to resolve below which st_symbolize stays on a single thread
+#define ST_PARALLEL_SYMBOLS 4096
+
+#define FNV_OFFSET_BASIS 0xCBF29CE484222325ULL
+#define FNV_PRIME 0x100000001B3ULL
+
+
+static uint64_t _hash_frames(void* const* frames, uint32_t depth);
+static siteId _st_find(siteTable* st, uint64_t hash, void* const* frames, uint32_t depth, size_t* slot);
+static int _st_compare_allocs(const void* a, const void* b);
+static int _st_compare_peak_bytes(const void* a, const void* b);
+static void _st_snapshot(siteTable* st, uint64_t live_bytes) __attribute__((noinline));
+static void _st_print_lifetimes(const siteLifetimes* lifetimes, double ticks_per_ns);
+
+// Sites being sorted by st_print_hottest, qsort takes no context
+static siteTable* sorting_table;
+
+/**
+ * Symbols of the frame pool, indexed like it. They only exist in memtrace,
+ * outside the shared table, since they point into files mapped by this process
+ */
+static symbolizer* symbols;
+static symbolInfo* frame_symbols;
+static uint32_t symbolized_length;
+
+// Range of the frame pool resolved by one st_symbolize thread
+typedef struct symbolWorker {
+    siteTable* st;
+    uint32_t begin;
+    uint32_t end;
+    pthread_t thread;
+    bool started;
+} symbolWorker;
+
+static void* _st_symbolize_range(void* arg);
+static bool _st_symbolized(siteTable* st, const callSite* site);
+
+
+/************************************************************************************************************
+ *                                          PUBLIC FUNCTIONS                                                *
+ ***********************************************************************************************************/
+
+
+siteTable* st_create() {
+    siteTable* st = shmload(shmalloc(sizeof(siteTable)));
+    if (!st) {
+        return NULL;
+    }
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    if (pthread_mutex_init(&st->mutex, &attr) != 0 || pthread_mutex_init(&st->snapshot_mutex, &attr) != 0) {
+        pthread_mutexattr_destroy(&attr);
+        shmfree(shmoffset(st), sizeof(siteTable));
+        return NULL;
+    }
+    pthread_mutexattr_destroy(&attr);
+
+    mm_init(&st->modules);
+    memset(st->index, 0, sizeof(st->index));
+    memset(&st->sites[ST_UNKNOWN_SITE], 0, sizeof(callSite));
+    st->length = 1;
+    st->pool_length = 0;
+    st->snapshot_threshold = ST_SNAPSHOT_MIN_BYTES;
+
+    shm_set_root(SHM_ROOT_ST, shmoffset(st));
+
+    return st;
+}
+
+
+siteTable* st_load() {
+    return shmload(shm_root(SHM_ROOT_ST));
+}
+
+
+void st_destroy(siteTable* st) {
+    if (!st) { return; }
+
+    if (pthread_mutex_destroy(&st->mutex) != 0 || pthread_mutex_destroy(&st->snapshot_mutex) != 0) {
+        fputs("Mutex destruction failure\n", stderr);
+    }
+
+    sy_destroy(symbols);
+    free(frame_symbols);
+    symbols = NULL;
+    frame_symbols = NULL;
+    symbolized_length = 0;
+
+    shm_set_root(SHM_ROOT_ST, 0);
+    shmfree(shmoffset(st), sizeof(siteTable));
+}
+
+
+siteId st_intern(siteTable* st, void* const* frames, uint32_t depth) {
+    if (!st || !depth) { return ST_UNKNOWN_SITE; }
+    if (depth > ST_MAX_DEPTH) { depth = ST_MAX_DEPTH; }
+
+    const uint64_t hash = _hash_frames(frames, depth);
+
+    size_t slot;
+    siteId id = _st_find(st, hash, frames, depth, &slot);
+    if (id != ST_UNKNOWN_SITE) {
+        return id;
+    }
+
+    pthread_mutex_lock(&st->mutex);
+
+    // Another thread may have added the site while we waited for the lock
+    id = _st_find(st, hash, frames, depth, &slot);
+    if (id == ST_UNKNOWN_SITE && st->length < ST_MAX_SITES && st->pool_length + depth <= ST_MAX_POOL_FRAMES) {
+        id = st->length;
+
+        callSite* site = &st->sites[id];
+        site->hash = hash;
+        site->depth = depth;
+        site->frames = st->pool_length;
+        memcpy(&st->pool[site->frames], frames, depth * sizeof(void*));
+        st->pool_length += depth;
+
+        // Modules loaded after the last snapshot, e.g. through dlopen
+        if (!st->modules_loaded && !mm_covers(&st->modules, frames, depth)) {
+            mm_snapshot(&st->modules);
+        }
+
+        __atomic_store_n(&st->length, id + 1, __ATOMIC_RELEASE);
+        // Publishing the index slot makes the site visible to lock free readers
+        __atomic_store_n(&st->index[slot], id, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&st->mutex);
+
+    return id;
+}
+
+
+const callSite* st_get(siteTable* st, siteId id) {
+    if (!st || id == ST_UNKNOWN_SITE || id >= __atomic_load_n(&st->length, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    return &st->sites[id];
+}
+
+
+void* const* st_frames(siteTable* st, const callSite* site) {
+    return &st->pool[site->frames];
+}
+
+
+void st_count_alloc(siteTable* st, siteId id, uint64_t count, uint64_t bytes) {
+    siteCounters* counters = &st->counters[id];
+
+    __atomic_fetch_add(&counters->allocs, count, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counters->alloc_bytes, bytes, __ATOMIC_RELAXED);
+    uint64_t live = __atomic_add_fetch(&counters->live_bytes, bytes, __ATOMIC_RELAXED);
+
+    // Only the allocations setting a new peak pay for the CAS
+    uint64_t peak = __atomic_load_n(&counters->peak_live_bytes, __ATOMIC_RELAXED);
+    while (live > peak && !__atomic_compare_exchange_n(&counters->peak_live_bytes, &peak, live, true,
+                                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    uint64_t total = __atomic_add_fetch(&st->live_bytes, bytes, __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&st->peak_live_bytes, __ATOMIC_RELAXED);
+    while (total > peak && !__atomic_compare_exchange_n(&st->peak_live_bytes, &peak, total, true,
+                                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    if (total > __atomic_load_n(&st->snapshot_threshold, __ATOMIC_RELAXED)) {
+        _st_snapshot(st, total);
+    }
+}
+
+
+void st_count_free(siteTable* st, siteId id, uint64_t count, uint64_t bytes, uint64_t lifetime) {
+    siteCounters* counters = &st->counters[id];
+
+    __atomic_fetch_add(&counters->frees, count, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counters->free_bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&counters->live_bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&st->live_bytes, bytes, __ATOMIC_RELAXED);
+
+    uint32_t bucket = 63 - __builtin_clzll(lifetime | 1);
+    if (bucket >= ST_LIFETIME_BUCKETS) {
+        bucket = ST_LIFETIME_BUCKETS - 1;
+    }
+    __atomic_fetch_add(&st->lifetimes[id].buckets[bucket], count, __ATOMIC_RELAXED);
+}
+
+
+const siteCounters* st_counters(siteTable* st, siteId id) {
+    if (!st || id >= __atomic_load_n(&st->length, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    return &st->counters[id];
+}
+
+
+const siteLifetimes* st_lifetimes(siteTable* st, siteId id) {
+    if (!st || id >= __atomic_load_n(&st->length, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    return &st->lifetimes[id];
+}
+
+
+uint64_t st_peak_live_bytes(siteTable* st) {
+    if (!st) { return 0; }
+
+    return __atomic_load_n(&st->peak_live_bytes, __ATOMIC_RELAXED);
+}
+
+
+const sitePeak* st_peak_snapshot(siteTable* st, uint32_t* length, uint64_t* live_bytes) {
+    *length = 0;
+    *live_bytes = 0;
+    if (!st) { return NULL; }
+
+    pthread_mutex_lock(&st->snapshot_mutex);
+    *length = st->snapshot_length;
+    *live_bytes = st->snapshot_live_bytes;
+    pthread_mutex_unlock(&st->snapshot_mutex);
+
+    return st->snapshot;
+}
+
+
+void st_print_peak(siteTable* st, uint32_t top) {
+    if (!st) { return; }
+
+    uint32_t length;
+    uint64_t snapshot_bytes;
+    st_peak_snapshot(st, &length, &snapshot_bytes);
+
+    printf("Peak heap\n");
+    printf("--------------------------------------------------------------\n");
+    printf("\n%lu bytes live at the peak\n", st_peak_live_bytes(st));
+    if (!length) {
+        printf("\nThe heap never reached %d bytes, no snapshot was taken\n", ST_SNAPSHOT_MIN_BYTES);
+        printf("--------------------------------------------------------------\n\n");
+        return;
+    }
+    // Snapshots are skipped under contention and until the heap grows by 1/ST_SNAPSHOT_GROWTH
+    printf("Approximate breakdown from the largest snapshot taken, %lu bytes (%.1f%% of the peak) over %u call sites\n",
+           snapshot_bytes, 100.0 * snapshot_bytes / st_peak_live_bytes(st), length);
+
+    sitePeak* sites = malloc(length * sizeof(sitePeak));
+    if (!sites) {
+        fputs("Call-site report allocation failure\n", stderr);
+        return;
+    }
+    memcpy(sites, st->snapshot, length * sizeof(sitePeak));
+    qsort(sites, length, sizeof(sitePeak), _st_compare_peak_bytes);
+
+    for (uint32_t i = 0; i < length && i < top; i++) {
+        printf("\n#%u: %lu bytes live (%.1f%%)\n\n", i + 1, sites[i].live_bytes,
+               100.0 * sites[i].live_bytes / snapshot_bytes);
+        st_print_frames(st, sites[i].id, stdout);
+    }
+    printf("--------------------------------------------------------------\n\n");
+
+    free(sites);
+}
+
+
+void st_print_frames(siteTable* st, siteId id, FILE* out) {
+    const callSite* site = st_get(st, id);
+    if (!site) {
+        fprintf(out, "# <unknown call site>\n");
+        return;
+    }
+
+    void* const* frames = st_frames(st, site);
+    char frame[MM_MAX_PATH + 64];
+    char symbol[2 * MM_MAX_PATH];
+    for (uint32_t i = 0; i < site->depth; i++) {
+        mm_format(&st->modules, (uintptr_t)frames[i], frame, sizeof(frame));
+        const symbolInfo* info = st_symbol(st, site, i);
+        if (info && sy_format(info, symbol, sizeof(symbol))) {
+            fprintf(out, "# %s %s\n", frame, symbol);
+        } else {
+            fprintf(out, "# %s\n", frame);
+        }
+    }
+}
+
+
+void st_symbolize(siteTable* st) {
+    const uint32_t length = st_length(st);
+    const callSite* last = &st->sites[length - 1];
+    const uint32_t end = last->frames + last->depth;
+    if (length <= 1 || end <= symbolized_length) {
+        return;
+    }
+
+    if (!symbols) {
+        symbols = sy_create(&st->modules);
+    }
+    symbolInfo* resized = realloc(frame_symbols, end * sizeof(symbolInfo));
+    if (!symbols || !resized) {
+        return;
+    }
+    frame_symbols = resized;
+
+    // Threads split the new frames evenly, module files are indexed by the first one to need them
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t nworkers = end - symbolized_length < ST_PARALLEL_SYMBOLS || ncpus < 1? 1 : ncpus;
+    symbolWorker workers[nworkers];
+    for (uint32_t i = 0; i < nworkers; i++) {
+        workers[i] = (symbolWorker){
+            .st = st,
+            .begin = symbolized_length + (uint64_t)(end - symbolized_length) * i / nworkers,
+            .end = symbolized_length + (uint64_t)(end - symbolized_length) * (i + 1) / nworkers
+        };
+    }
+    for (uint32_t i = 1; i < nworkers; i++) {
+        workers[i].started = pthread_create(&workers[i].thread, NULL, _st_symbolize_range, &workers[i]) == 0;
+        if (!workers[i].started) {
+            _st_symbolize_range(&workers[i]);
+        }
+    }
+    _st_symbolize_range(&workers[0]);
+    for (uint32_t i = 1; i < nworkers; i++) {
+        if (workers[i].started) {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+
+    symbolized_length = end;
+}
+
+
+const symbolInfo* st_symbol(siteTable* st, const callSite* site, uint32_t i) {
+    if (!_st_symbolized(st, site)) {
+        return NULL;
+    }
+
+    const symbolInfo* info = &frame_symbols[site->frames + i];
+    return info->function || info->file? info : NULL;
+}
+
+
+int st_format_frame(siteTable* st, const callSite* site, uint32_t i, char* buffer, size_t size) {
+    const symbolInfo* info = st_symbol(st, site, i);
+    if (info) {
+        return sy_format(info, buffer, size);
+    }
+
+    return mm_format(&st->modules, (uintptr_t)st_frames(st, site)[i], buffer, size);
+}
+
+
+void st_print_hottest(siteTable* st, uint32_t top, double ticks_per_ns) {
+    if (!st) { return; }
+
+    const uint32_t length = st_length(st);
+    siteId* ids = malloc(length * sizeof(siteId));
+    if (!ids) {
+        fputs("Call-site report allocation failure\n", stderr);
+        return;
+    }
+
+    uint32_t active = 0;
+    for (siteId id = 0; id < length; id++) {
+        if (st->counters[id].allocs) {
+            ids[active++] = id;
+        }
+    }
+
+    sorting_table = st;
+    qsort(ids, active, sizeof(siteId), _st_compare_allocs);
+
+    printf("Hottest allocation sites\n");
+    printf("--------------------------------------------------------------\n");
+    for (uint32_t i = 0; i < active && i < top; i++) {
+        const siteCounters* counters = &st->counters[ids[i]];
+        printf("\n#%u: %lu allocs (%lu bytes), %lu frees (%lu bytes), peak %lu bytes live\n\n",
+               i + 1, counters->allocs, counters->alloc_bytes, counters->frees, counters->free_bytes,
+               counters->peak_live_bytes);
+        if (ticks_per_ns) {
+            _st_print_lifetimes(&st->lifetimes[ids[i]], ticks_per_ns);
+        }
+        st_print_frames(st, ids[i], stdout);
+    }
+    if (!active) {
+        printf("\nNo allocations recorded\n");
+    }
+    printf("--------------------------------------------------------------\n\n");
+
+    free(ids);
+}
+
+
+uint32_t st_length(siteTable* st) {
+    if (!st) { return 0; }
+
+    return __atomic_load_n(&st->length, __ATOMIC_ACQUIRE);
+}
+
+
+const moduleMap* st_modules(siteTable* st) {
+    if (!st) { return NULL; }
+
+    return &st->modules;
+}
+
+
+void st_load_modules(siteTable* st, const moduleMap* mm) {
+    memcpy(&st->modules, mm, offsetof(moduleMap, modules) + mm->length * sizeof(moduleInfo));
+    st->modules_loaded = true;
+}
+
+
+/************************************************************************************************************
+ *                                          PRIVATE FUNCTIONS                                               *
+ ***********************************************************************************************************/
+
+
+static void* _st_symbolize_range(void* arg) {
+    symbolWorker* worker = arg;
+
+    for (uint32_t i = worker->begin; i < worker->end; i++) {
+        sy_resolve(symbols, (uintptr_t)worker->st->pool[i], &frame_symbols[i]);
+    }
+
+    return NULL;
+}
+
+
+static bool _st_symbolized(siteTable* st, const callSite* site) {
+    if (site->frames + site->depth > symbolized_length) {
+        st_symbolize(st);
+    }
+
+    return site->frames + site->depth <= symbolized_length;
+}
+
+
+static uint64_t _hash_frames(void* const* frames, uint32_t depth) {
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (uint32_t i = 0; i < depth; i++) {
+        hash ^= (uint64_t)(uintptr_t)frames[i];
+        hash *= FNV_PRIME;
+    }
+    hash ^= depth;
+
+    return hash;
+}
+
+
+static int _st_compare_allocs(const void* a, const void* b) {
+    const uint64_t allocs_a = sorting_table->counters[*(const siteId*)a].allocs;
+    const uint64_t allocs_b = sorting_table->counters[*(const siteId*)b].allocs;
+
+    return (allocs_a < allocs_b) - (allocs_a > allocs_b);
+}
+
+
+static void _st_print_lifetimes(const siteLifetimes* lifetimes, double ticks_per_ns) {
+    /**
+     * Buckets are powers of two of ticks, each one is put in the range its
+     * geometric middle falls in, so counts are off by at most a factor of sqrt(2)
+     */
+    uint64_t ranges[ST_LIFETIME_RANGES] = {0};
+
+    for (int bucket = 0; bucket < ST_LIFETIME_BUCKETS; bucket++) {
+        double middle_ns = ldexp(M_SQRT2, bucket) / ticks_per_ns;
+        size_t range = 0;
+        while (range < ST_LIFETIME_RANGES - 1 && middle_ns >= lifetime_ranges[range].limit_ns) {
+            range++;
+        }
+        ranges[range] += lifetimes->buckets[bucket];
+    }
+
+    printf("Lifetimes:");
+    for (size_t range = 0; range < ST_LIFETIME_RANGES; range++) {
+        printf(" %s %lu%s", lifetime_ranges[range].label, ranges[range], range < ST_LIFETIME_RANGES - 1? "," : "\n\n");
+    }
+}
+
+
+static int _st_compare_peak_bytes(const void* a, const void* b) {
+    const uint64_t bytes_a = ((const sitePeak*)a)->live_bytes;
+    const uint64_t bytes_b = ((const sitePeak*)b)->live_bytes;
+
+    return (bytes_a < bytes_b) - (bytes_a > bytes_b);
+}
+
+
+static void _st_snapshot(siteTable* st, uint64_t live_bytes) {
+    /**
+     * Whoever finds a snapshot in progress just carries on allocating, the
+     * next threshold is far enough that losing the race is harmless.
+     * Sites keep changing while they are copied, the snapshot is as fuzzy as
+     * the time it takes to walk them
+     */
+    if (pthread_mutex_trylock(&st->snapshot_mutex) != 0) {
+        return;
+    }
+
+    if (live_bytes > st->snapshot_threshold) {
+        const uint32_t length = __atomic_load_n(&st->length, __ATOMIC_ACQUIRE);
+        uint32_t snapshot_length = 0;
+        uint64_t snapshot_bytes = 0;
+
+        for (siteId id = 0; id < length; id++) {
+            uint64_t site_bytes = __atomic_load_n(&st->counters[id].live_bytes, __ATOMIC_RELAXED);
+            // Counters of sites racing with a free may briefly wrap below zero
+            if (site_bytes && (int64_t)site_bytes > 0) {
+                st->snapshot[snapshot_length].id = id;
+                st->snapshot[snapshot_length].live_bytes = site_bytes;
+                snapshot_length++;
+                snapshot_bytes += site_bytes;
+            }
+        }
+
+        st->snapshot_length = snapshot_length;
+        st->snapshot_live_bytes = snapshot_bytes;
+        __atomic_store_n(&st->snapshot_threshold, live_bytes + live_bytes / ST_SNAPSHOT_GROWTH, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&st->snapshot_mutex);
+}
+
+
+static siteId _st_find(siteTable* st, uint64_t hash, void* const* frames, uint32_t depth, size_t* slot) {
+    /**
+     * Linear probing over an append only index, the first empty slot
+     * ends the probe and is where the site would be inserted
+     */
+    size_t index = hash & (ST_INDEX_CAPACITY - 1);
+    for (;;) {
+        siteId id = __atomic_load_n(&st->index[index], __ATOMIC_ACQUIRE);
+        if (id == ST_UNKNOWN_SITE) {
+            *slot = index;
+            return ST_UNKNOWN_SITE;
+        }
+
+        const callSite* site = &st->sites[id];
+        if (site->hash == hash && site->depth == depth &&
+            memcmp(&st->pool[site->frames], frames, depth * sizeof(void*)) == 0) {
+            return id;
+        }
+
+        index = (index + 1) & (ST_INDEX_CAPACITY - 1);
+    }
+}
@@ -0,0 +1,514 @@
+/*
+ * Copyright (C) 2024 Alejandro Cadarso
+ *
+ * This file is part of Memtrace.
+ *
+ * Memtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Memtrace.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * File: evring.c
+ * Author: Alejandro Cadarso
+ * Date: 17-10-2026
+ *
+ * This file provides the implementation of the event rings. Producers
+ * claim a ring the first time a thread allocates and release it when the
+ * thread exits, pushing an event is a couple of stores and a release.
+ * When every ring is taken the remaining threads share an overflow ring
+ * behind a lock.
+ *
+ * Rings are drained one after the other, round-robin, so an event can be
+ * seen one drain after an event from another thread that happened later. Each
+ * drain is sorted by timestamp, and frees that don't match a live entry
+ * are kept pending for a few drains in case their allocation shows up late.
+ * An allocation over an older live entry charges that entry's free, its
+ * own free event turns up later and finds nothing left to do.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "evring.h"
+#include "shmwrap.h"
+#include "sampling.h"
+
+// Power of two
+#define ER_RING_EVENTS (1 << 13)
+#define ER_MAX_RINGS 256
+// Shared by producers that could not get a ring of their own
+#define ER_OVERFLOW_RING 0
+
+#define ER_RING_FREE 0
+#define ER_RING_OWNED 1
+#define ER_RING_CLOSED 2
+
+// Free events carry no site, mark them with an id no site can have
+#define ER_FREE_EVENT UINT32_MAX
+
+#define ER_BATCH_EVENTS (1 << 16)
+// Complete drains a pending free survives before it is considered a free of untracked memory
+#define ER_PENDING_GENERATIONS 4
+#define ER_PENDING_INITIAL_CAPACITY 1024
+
+typedef struct ringEvent {
+    uint64_t timestamp;
+    size_t address;
+    uint64_t block_size;
+    siteId site_id;
+} ringEvent;
+
+/**
+ * head is only written by the consumer, tail and cached_head only by the
+ * producer, they live on separate cache lines
+ */
+typedef struct eventRing {
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t tail __attribute__((aligned(64)));
+    uint64_t cached_head;
+    uint32_t state __attribute__((aligned(64)));
+    ringEvent events[ER_RING_EVENTS] __attribute__((aligned(64)));
+} eventRing;
+
+struct eventRings {
+    pthread_mutex_t overflow_mutex;
+    eventRing rings[ER_MAX_RINGS];
+};
+
+typedef struct pendingFree {
+    size_t address;
+    uint64_t timestamp;
+    uint64_t generation;
+} pendingFree;
+
+// Consumer state, only used by memtrace
+static ringEvent* batch = NULL;
+static pendingFree* pending = NULL;
+static size_t pending_capacity = 0;
+static size_t pending_length = 0;
+static uint64_t generation = 0;
+// Ring the next drain starts from, where the last one ran out of batch
+static int next_ring = 0;
+
+// Producer state, the ring owned by the calling thread
+static __thread eventRing* thread_ring __attribute__((tls_model("initial-exec")));
+static pthread_key_t ring_key;
+
+#define ER_PTR_HASH(address) \
+    (((address) >> 4) * 0x9E3779B97F4A7C15ULL)
+
+
+static void _er_push(eventRings* er, const ringEvent* event);
+static eventRing* _er_claim(eventRings* er);
+static void _er_release(void* ring);
+static void _er_forget_ring(void);
+static size_t _er_collect(eventRing* ring, ringEvent* events, size_t max_events);
+static int _er_compare_events(const void* a, const void* b);
+static void _er_apply(const ringEvent* event, hashTable* ht, siteTable* st);
+static pendingFree* _pending_find(size_t address);
+static void _pending_add(size_t address, uint64_t timestamp);
+static void _pending_remove(pendingFree* entry);
+static void _pending_purge(void);
+
+
+/************************************************************************************************************
+ *                                          PUBLIC FUNCTIONS                                                *
+ ***********************************************************************************************************/
+
+
+eventRings* er_create() {
+    eventRings* er = shmload(shmalloc(sizeof(eventRings)));
+    if (!er) {
+        return NULL;
+    }
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    if (pthread_mutex_init(&er->overflow_mutex, &attr) != 0) {
+        pthread_mutexattr_destroy(&attr);
+        shmfree(shmoffset(er), sizeof(eventRings));
+        return NULL;
+    }
+    pthread_mutexattr_destroy(&attr);
+
+    for (int i = 0; i < ER_MAX_RINGS; i++) {
+        er->rings[i].head = 0;
+        er->rings[i].tail = 0;
+        er->rings[i].cached_head = 0;
+        er->rings[i].state = ER_RING_FREE;
+    }
+    er->rings[ER_OVERFLOW_RING].state = ER_RING_OWNED;
+
+    batch = malloc(ER_BATCH_EVENTS * sizeof(ringEvent));
+    if (!batch) {
+        pthread_mutex_destroy(&er->overflow_mutex);
+        shmfree(shmoffset(er), sizeof(eventRings));
+        return NULL;
+    }
+
+    shm_set_root(SHM_ROOT_ER, shmoffset(er));
+
+    return er;
+}
+
+
+eventRings* er_load() {
+    eventRings* er = shmload(shm_root(SHM_ROOT_ER));
+    if (!er) {
+        return NULL;
+    }
+
+    // Rings are released when their thread exits, a forked child must claim its own
+    pthread_key_create(&ring_key, _er_release);
+    pthread_atfork(NULL, NULL, _er_forget_ring);
+
+    return er;
+}
+
+
+void er_destroy(eventRings* er) {
+    if (!er) { return; }
+
+    free(batch);
+    free(pending);
+    batch = NULL;
+    pending = NULL;
+    pending_capacity = pending_length = 0;
+    next_ring = 0;
+
+    if (pthread_mutex_destroy(&er->overflow_mutex) != 0) {
+        fputs("Mutex destruction failure\n", stderr);
+    }
+
+    shm_set_root(SHM_ROOT_ER, 0);
+    shmfree(shmoffset(er), sizeof(eventRings));
+}
+
+
+void er_push_alloc(eventRings* er, size_t address, allocInfo info) {
+    ringEvent event = {
+        .timestamp = info.timestamp,
+        .address = address,
+        .block_size = info.block_size,
+        .site_id = info.site_id
+    };
+
+    _er_push(er, &event);
+}
+
+
+void er_push_free(eventRings* er, size_t address, uint64_t timestamp) {
+    ringEvent event = {
+        .timestamp = timestamp,
+        .address = address,
+        .block_size = 0,
+        .site_id = ER_FREE_EVENT
+    };
+
+    _er_push(er, &event);
+}
+
+
+size_t er_drain(eventRings* er, hashTable* ht, siteTable* st) {
+    if (!er || !batch) { return 0; }
+
+    /**
+     * Rings are read round-robin so busy rings at low indexes can't starve
+     * the others when there are more events than fit in a batch
+     */
+    size_t nevents = 0;
+    int last_ring = next_ring;
+    for (int visited = 0; visited < ER_MAX_RINGS && nevents < ER_BATCH_EVENTS; visited++) {
+        const int i = (next_ring + visited) % ER_MAX_RINGS;
+        eventRing* ring = &er->rings[i];
+        if (__atomic_load_n(&ring->state, __ATOMIC_ACQUIRE) == ER_RING_FREE) {
+            continue;
+        }
+
+        last_ring = i;
+        nevents += _er_collect(ring, &batch[nevents], ER_BATCH_EVENTS - nevents);
+
+        // Rings of exited threads can be claimed again once empty
+        if (__atomic_load_n(&ring->state, __ATOMIC_ACQUIRE) == ER_RING_CLOSED &&
+            ring->head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&ring->state, ER_RING_FREE, __ATOMIC_RELEASE);
+        }
+    }
+
+    qsort(batch, nevents, sizeof(ringEvent), _er_compare_events);
+
+    for (size_t i = 0; i < nevents; i++) {
+        _er_apply(&batch[i], ht, st);
+    }
+
+    /**
+     * A full batch may have left rings unread, their allocations could still
+     * match pending frees. Those only age on drains that emptied every ring
+     */
+    if (nevents == ER_BATCH_EVENTS) {
+        next_ring = last_ring;
+        return nevents;
+    }
+
+    generation++;
+    if (pending_length) {
+        _pending_purge();
+    }
+
+    return nevents;
+}
+
+
+/************************************************************************************************************
+ *                                          PRIVATE FUNCTIONS                                               *
+ ***********************************************************************************************************/
+
+
+static void _er_push(eventRings* er, const ringEvent* event) {
+    eventRing* ring = thread_ring;
+    if (!ring) {
+        ring = thread_ring = _er_claim(er);
+    }
+
+    bool overflow = ring == &er->rings[ER_OVERFLOW_RING];
+    if (overflow) {
+        pthread_mutex_lock(&er->overflow_mutex);
+    }
+
+    const uint64_t tail = ring->tail;
+
+    // Full ring, wait for memtrace to catch up
+    while (tail - ring->cached_head >= ER_RING_EVENTS) {
+        ring->cached_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (tail - ring->cached_head >= ER_RING_EVENTS) {
+            sched_yield();
+        }
+    }
+
+    ring->events[tail & (ER_RING_EVENTS - 1)] = *event;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+    if (overflow) {
+        pthread_mutex_unlock(&er->overflow_mutex);
+    }
+}
+
+
+static eventRing* _er_claim(eventRings* er) {
+    for (int i = 0; i < ER_MAX_RINGS; i++) {
+        if (i == ER_OVERFLOW_RING) { continue; }
+
+        eventRing* ring = &er->rings[i];
+        uint32_t expected = ER_RING_FREE;
+        if (__atomic_compare_exchange_n(&ring->state, &expected, ER_RING_OWNED, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            ring->cached_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            pthread_setspecific(ring_key, ring);
+            return ring;
+        }
+    }
+
+    return &er->rings[ER_OVERFLOW_RING];
+}
+
+
+static void _er_release(void* ring) {
+    // Allocations made by later TLS destructors claim a new ring
+    thread_ring = NULL;
+    __atomic_store_n(&((eventRing*)ring)->state, ER_RING_CLOSED, __ATOMIC_RELEASE);
+}
+
+
+static void _er_forget_ring(void) {
+    thread_ring = NULL;
+}
+
+
+static size_t _er_collect(eventRing* ring, ringEvent* events, size_t max_events) {
+    const uint64_t head = ring->head;
+    const uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    size_t nevents = tail - head;
+    if (nevents > max_events) {
+        nevents = max_events;
+    }
+
+    for (size_t i = 0; i < nevents; i++) {
+        events[i] = ring->events[(head + i) & (ER_RING_EVENTS - 1)];
+    }
+
+    // Slots are only handed back to the producer once copied
+    __atomic_store_n(&ring->head, head + nevents, __ATOMIC_RELEASE);
+
+    return nevents;
+}
+
+
+static int _er_compare_events(const void* a, const void* b) {
+    const uint64_t stamp_a = ((const ringEvent*)a)->timestamp;
+    const uint64_t stamp_b = ((const ringEvent*)b)->timestamp;
+
+    return (stamp_a > stamp_b) - (stamp_a < stamp_b);
+}
+
+
+static void _er_apply(const ringEvent* event, hashTable* ht, siteTable* st) {
+    /**
+     * Site counters are kept here rather than by the producers so they see
+     * events in timestamp order, which keeps peak live bytes meaningful
+     */
+    const uint64_t sample_interval = ht_sample_interval(ht);
+    const allocInfo* live = ht_get(ht, event->address);
+
+    if (event->site_id == ER_FREE_EVENT) {
+        if (live && live->timestamp < event->timestamp) {
+            allocInfo removed;
+            if (ht_remove(ht, event->address, &removed)) {
+                st_count_free(st, removed.site_id, sp_scale(1, removed.block_size, sample_interval),
+                              sp_scale(removed.block_size, removed.block_size, sample_interval),
+                              event->timestamp - removed.timestamp);
+            }
+        } else {
+            // Its allocation has not been drained yet, or the address was never tracked
+            _pending_add(event->address, event->timestamp);
+        }
+        return;
+    }
+
+    const uint64_t count = sp_scale(1, event->block_size, sample_interval);
+    const uint64_t bytes = sp_scale(event->block_size, event->block_size, sample_interval);
+    st_count_alloc(st, event->site_id, count, bytes);
+
+    pendingFree* pending_free = _pending_find(event->address);
+    if (pending_free && pending_free->timestamp > event->timestamp) {
+        // Allocated and freed already, the free was just drained first
+        st_count_free(st, event->site_id, count, bytes, pending_free->timestamp - event->timestamp);
+        _pending_remove(pending_free);
+        return;
+    }
+
+    // A later block at the same address means this one is long gone, it lived at most until then
+    if (live && live->timestamp > event->timestamp) {
+        st_count_free(st, event->site_id, count, bytes, live->timestamp - event->timestamp);
+        return;
+    }
+
+    // An earlier block at the same address is gone by now, its free is in a ring not drained yet
+    if (live && live->timestamp < event->timestamp) {
+        st_count_free(st, live->site_id, sp_scale(1, live->block_size, sample_interval),
+                      sp_scale(live->block_size, live->block_size, sample_interval),
+                      event->timestamp - live->timestamp);
+    }
+
+    allocInfo info = {
+        .block_size = event->block_size,
+        .site_id = event->site_id,
+        .timestamp = event->timestamp
+    };
+
+    if (!ht_insert(ht, event->address, info)) {
+        fputs("HashTable insertion failure\n", stderr);
+    }
+}
+
+
+/**
+ * Pending frees live in a small open addressing table local to memtrace,
+ * linear probing with backward shift deletion
+ */
+static pendingFree* _pending_find(size_t address) {
+    if (!pending_length) { return NULL; }
+
+    size_t index = ER_PTR_HASH(address) & (pending_capacity - 1);
+    while (pending[index].address) {
+        if (pending[index].address == address) {
+            return &pending[index];
+        }
+        index = (index + 1) & (pending_capacity - 1);
+    }
+
+    return NULL;
+}
+
+
+static void _pending_add(size_t address, uint64_t timestamp) {
+    if ((pending_length + 1) * 2 > pending_capacity) {
+        pendingFree* old = pending;
+        size_t old_capacity = pending_capacity;
+
+        pending_capacity = old_capacity? old_capacity * 2 : ER_PENDING_INITIAL_CAPACITY;
+        pending = calloc(pending_capacity, sizeof(pendingFree));
+        if (!pending) {
+            fputs("Pending frees allocation failure\n", stderr);
+            exit(1);
+        }
+
+        pending_length = 0;
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old[i].address) {
+                _pending_add(old[i].address, old[i].timestamp);
+                _pending_find(old[i].address)->generation = old[i].generation;
+            }
+        }
+        free(old);
+    }
+
+    size_t index = ER_PTR_HASH(address) & (pending_capacity - 1);
+    while (pending[index].address && pending[index].address != address) {
+        index = (index + 1) & (pending_capacity - 1);
+    }
+
+    if (!pending[index].address) {
+        pending_length++;
+    }
+    pending[index].address = address;
+    pending[index].timestamp = timestamp;
+    pending[index].generation = generation;
+}
+
+
+static void _pending_remove(pendingFree* entry) {
+    size_t hole = entry - pending;
+    size_t index = hole;
+
+    for (;;) {
+        index = (index + 1) & (pending_capacity - 1);
+        if (!pending[index].address) {
+            break;
+        }
+
+        // Entries whose home slot is not between the hole and them move back
+        size_t home = ER_PTR_HASH(pending[index].address) & (pending_capacity - 1);
+        if (((index - home) & (pending_capacity - 1)) >= ((index - hole) & (pending_capacity - 1))) {
+            pending[hole] = pending[index];
+            hole = index;
+        }
+    }
+
+    pending[hole].address = 0;
+    pending_length--;
+}
+
+
+static void _pending_purge(void) {
+    for (size_t i = 0; i < pending_capacity; i++) {
+        while (pending[i].address && generation - pending[i].generation > ER_PENDING_GENERATIONS) {
+            // Removing shifts the next entry into this slot, check it again
+            _pending_remove(&pending[i]);
+        }
+    }
+}
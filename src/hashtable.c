@@ -21,10 +21,12 @@
  * Date: 28-05-2024
  *
  * This file provides implementation for managing a hash table with shared
- * memory segments in C. The hash table supports dynamic resizing and
- * double hashing for collision resolution. The implementation includes functions
- * for creating, destroying, inserting, deleting, and retrieving entries, as well as
- * printing debug information.
+ * memory segments in C. The hash table is a Swiss table: control bytes, keys
+ * and values are kept in separate dense arrays, capacity is a power of two
+ * and probing compares a whole group of control bytes at once with SSE2 or
+ * AVX2. The implementation includes functions for creating, destroying,
+ * inserting, deleting, and retrieving entries, as well as printing debug
+ * information.
  *
  */
 
@@ -38,110 +40,198 @@
 #include <semaphore.h>
 #include "hashtable.h"
 #include "shmwrap.h"
+#include "sampling.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 /**
  * HashTable data structures.
- * Capacity is not stored direcly, it can be retrieved with the HT_GET_CAPACITY macro.
- * Shared memory ids are stored to be able to get correct pointers in any given virtual
- * address space
+ * The table is split in HT_SHARDS shards selected by the key hash, each with its own
+ * process shared lock and entries segment, so threads touching different shards never
+ * contend.
+ * A segment holds, in this order, one control byte per slot, the keys and the values.
+ * A probe first matches the 7 hash bits kept in the control bytes of a group, and only
+ * then touches the keys it matched.
+ * Resizing is incremental, a resize only allocates the new entries segment and every
+ * following operation on the shard moves HT_MIGRATE_SLOTS slots from the old one,
+ * lookups check both segments until the migration is done.
+ * Segments are referenced by their offset in the session region, which is valid in
+ * every process attached to it
  */
-typedef struct hashTableEntry {
-    size_t key;
-    allocInfo value;
-} hashTableEntry;
+typedef struct htSegment {
+    shmOffset offset;
+    uint32_t capacity_bits;
+    uint64_t length;
+    uint64_t tombstones;
+    // Longest probe, in groups, any key in the segment was placed at
+    uint32_t max_probe;
+} htSegment;
+
+// Cache line aligned so shard locks don't false share
+typedef struct hashTableShard {
+    pthread_mutex_t mutex;
+    uint64_t migrate_cursor;
+    // Segments never shrink below the capacity the table was created with
+    uint32_t min_capacity_bits;
+    bool huge_pages;
+    // Probe lengths of the lookups done on the shard, for ht_stats
+    uint64_t lookups;
+    uint64_t probed_groups;
+    uint64_t probe_histogram[HT_PROBE_BUCKETS];
+    htSegment current;
+    // Segment being migrated from, old.offset is 0 when there is none
+    htSegment old;
+} __attribute__((aligned(64))) hashTableShard;
+
+// Power of two, shards are selected with the top bits of the hash
+#define HT_SHARDS_BITS 6
+#define HT_SHARDS (1 << HT_SHARDS_BITS)
 
 struct hashTable {
-    uint32_t capacity_index;
-    uint32_t length;
-    pid_t context;
-    int entries_shmid;
-    hashTableEntry* entries;
-    int mutex_shmid;
-    pthread_mutex_t* mutex;
+    // Mean bytes between sampled allocations, 0 if every allocation is recorded
+    uint64_t sample_interval;
+    hashTableShard shards[HT_SHARDS];
 };
 
+
 /**
- * The primes array is used both for both hashtable capacity values (odd indexes) and
- * double hashing prime values (even indexes)
+ * Control bytes. Empty is zero so fresh segments, which the kernel zero fills,
+ * need no initialization. Full slots have the top bit set and 7 bits of the hash
  */
-const static uint32_t primes[] = {
-    101,    103,     199,     211,     419,     421,     829,      839,      1637,
-    1657,   3301,    3307,    6559,    6607,    13217,   13219,    26437,    26449,
-    53003,  53017,   109987,  110017,  220009,  220013,  440009,   440023,   880001,
-    880007, 1900009, 1900037, 3800021, 3800051, 7600013, 7600031,  15200011, 15200021
-};
+#define CTRL_EMPTY 0x00
+#define CTRL_DELETED 0x01
+#define CTRL_FULL 0x80
 
-const static hashTableEntry clear_entry = {
-    .key = 0,
-    .value = {
-        .block_size = 0,
-        .stack_trace = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0}
-    }
-};
+#define CTRL_IS_FULL(ctrl) \
+    ((ctrl) & CTRL_FULL)
 
+#if defined(__AVX2__)
+#define HT_GROUP_WIDTH 32
+#else
+#define HT_GROUP_WIDTH 16
+#endif
 
-#define HT_GET_CAPACITY(ht) \
-    primes[ht->capacity_index]
-// Next odd index
-#define HT_GET_NEXT_CAPACITY(ht) \
-    primes[ht->capacity_index+2]
-// Prev odd index
-#define HT_GET_PREV_CAPACITY(ht) \
-    primes[ht->capacity_index-2]
-
-#define HT_GET_HASH_PRIME(ht) \
-    primes[ht->capacity_index-1]
-// Next even index
-#define HT_GET_NEXT_HASH_PRIME(ht) \
-    primes[ht->capacity_index+2-1]
-// Prev even index
-#define HT_GET_PREV_HASH_PRIME(ht) \
-    primes[ht->capacity_index-2-1]
-
-// Refer to primes array
-#define HT_INITIAL_CAPACITY_INDEX 1
-#define HT_LAST_CAPACITY_INDEX 35
-
-#define SIZE_UP_LOAD_FACTOR 0.7
+typedef uint32_t groupMask;
+
+#define SEG_CAPACITY(seg) \
+    ((size_t)1 << (seg)->capacity_bits)
+#define SEG_GROUPS(seg) \
+    (SEG_CAPACITY(seg) / HT_GROUP_WIDTH)
+#define SEG_CTRL(seg) \
+    ((uint8_t*)shmload((seg)->offset))
+#define SEG_KEYS(seg) \
+    ((size_t*)(SEG_CTRL(seg) + SEG_CAPACITY(seg)))
+#define SEG_VALUES(seg) \
+    ((allocInfo*)(SEG_KEYS(seg) + SEG_CAPACITY(seg)))
+#define SEG_BYTES(capacity_bits) \
+    (((size_t)1 << (capacity_bits)) * (1 + sizeof(size_t) + sizeof(allocInfo)))
+
+// One group per shard to start with
+#define HT_INITIAL_CAPACITY_BITS 5
+// 2^46 slots across all shards, growth is bounded by memory rather than by the table
+#define HT_MAX_CAPACITY_BITS 40
+
+// Segments smaller than a huge page are not worth backing with one
+#define HT_HUGE_PAGE_SIZE (2UL << 20)
+
+// Tombstones count towards the load, they lengthen probes just like entries
+#define HT_SEG_LOAD_FACTOR(seg) \
+    ((float)((seg)->length + (seg)->tombstones) / SEG_CAPACITY(seg))
+
+#define SIZE_UP_LOAD_FACTOR 0.875
 #define SIZE_DOWN_LOAD_FACTOR 0.2
 
+/**
+ * A full segment that is at most half entries is mostly tombstones,
+ * it is rebuilt at the same capacity instead of grown
+ */
+#define HT_SEG_MOSTLY_TOMBSTONES(seg) \
+    ((seg)->length * 2 <= SEG_CAPACITY(seg))
+
+/**
+ * Probes are bounded, an insert placed further than this many groups
+ * from its home group rebuilds the segment
+ */
+#define HT_PROBE_LIMIT 8
+
+// Capacity bits added to the shard segment on resize
 #define RESIZE_UP 1
-#define RESIZE_DOWN 0
+#define RESIZE_DOWN -1
+#define RESIZE_REHASH 0
 
-#define HT_LOAD_FACTOR(ht) \
-    (float)ht->length / HT_GET_CAPACITY(ht)
+// Slots moved out of the old segment by every operation on a migrating shard
+#define HT_MIGRATE_SLOTS 64
 
+#define HT_MIGRATING(shard) \
+    ((shard)->old.offset != 0)
 
-/**
- * The shared memory id for the hashtable is stored as an env variable
- * when the parent process (memtrace) forks to run the child (executable to analyze)
- * the env variable is cloned to the new process
- */
-#define GET_HT_SHMID atoi(getenv("HT_SHMID"))
 
-// Default keys to obtain shmids
-#define HT_SHM_KEY_GEN \
-    ftok("/tmp", 'A')
-#define HT_ENTRIES_SHM_KEY_GEN \
-    ftok("/tmp", 'B')
-#define HT_MUTEX_SHM_KEY_GEN \
-    ftok("/tmp", 'C')
+// 64 bit finalizer, a single multiply spreads the aligned pointer bits
+#define HT_HASH_MULTIPLIER 0xFF51AFD7ED558CCDULL
 
+// Leaks found by ht_print_debug, estimates weigh each sampled block by its sampling probability
+typedef struct leakTotals {
+    uint64_t blocks;
+    uint64_t bytes;
+    double estimated_blocks;
+    double estimated_bytes;
+} leakTotals;
 
-#define FNV_OFFSET_BASIS 0xCBF29CE484222325ULL
-#define FNV_PRIME 0x100000001B3ULL
+// Tables with fewer entries than this are aggregated by a single thread
+#define HT_PARALLEL_REPORT_ENTRIES (1 << 16)
 
-#define DOUBLE_HASH(address, prime, i, capacity) \
-    (_hash_fnv1(address) + i * (prime - (address % prime))) % capacity
+/**
+ * Aggregates the leaks of a range of shards by call site. Every worker
+ * has its own per-site totals, merged once they are all done
+ */
+typedef struct leakWorker {
+    hashTable* ht;
+    int first_shard;
+    int end_shard;
+    uint32_t nsites;
+    leakTotals* sites;
+    leakTotals totals;
+    pthread_t thread;
+} leakWorker;
+
+// Per-site leaks being sorted by ht_print_debug, qsort takes no context
+static const leakTotals* sorting_leaks;
+
+#define HT_SHARD_OF(hash) \
+    ((hash) >> (64 - HT_SHARDS_BITS))
+#define HT_H1(hash) \
+    ((hash) >> 7)
+#define HT_H2(hash) \
+    (CTRL_FULL | ((hash) & 0x7F))
 
 
 /**
- * ht_load_context locks the ht mutex,
+ * ht_load_shard locks the shard the key belongs to and returns it,
  * it's the callers responsibility to unlock it
  */
-static void _ht_load_context(hashTable* ht);
-static bool _ht_resize(hashTable* ht, int resize_direction);
-static size_t _hash_fnv1(size_t address);
+static hashTableShard* _ht_load_shard(hashTable* ht, size_t hash);
+static bool _ht_delete(hashTable* ht, const size_t key, allocInfo* removed, bool* found);
+static bool _ht_resize(hashTableShard* shard, int resize_direction);
+static bool _ht_maybe_grow(hashTableShard* shard);
+static void _ht_migrate(hashTableShard* shard, uint32_t nslots);
+static uint32_t _ht_capacity_bits_for(uint64_t entries);
+static bool _seg_alloc(htSegment* seg, uint32_t capacity_bits, bool huge_pages);
+static void _seg_free(htSegment* seg);
+static long _seg_find(const htSegment* seg, size_t hash, size_t key, hashTableShard* stats);
+static size_t _seg_slot_for_insert(htSegment* seg, size_t hash);
+static void _seg_place(htSegment* seg, size_t index, size_t hash, size_t key, const allocInfo* value);
+static void _seg_erase(htSegment* seg, size_t index);
+static groupMask _group_match(const uint8_t* group, uint8_t ctrl);
+static groupMask _group_match_full(const uint8_t* group);
+static size_t _hash_ptr(size_t address);
+static void* _ht_aggregate_leaks(void* arg);
+static void _ht_aggregate_segment(const htSegment* seg, leakWorker* worker);
+static int _ht_compare_leaks(const void* a, const void* b);
+static void _ht_print_leak(siteTable* st, siteId id, const leakTotals* leak, const leakTotals* totals, uint64_t sample_interval);
 
 
 /************************************************************************************************************
@@ -149,216 +239,347 @@ static size_t _hash_fnv1(size_t address);
  ***********************************************************************************************************/
 
 
-hashTable* ht_create() {
-    const int shmid_ht = shmalloc(HT_SHM_KEY_GEN, sizeof(hashTable));
-    if (shmid_ht < 1) {
+hashTable* ht_create(uint64_t capacity_hint, bool huge_pages) {
+    hashTable* ht = shmload(shmalloc(sizeof(hashTable)));
+    if (!ht) {
         return NULL;
     }
-    hashTable* ht = shmload(shmid_ht);
 
-    // Set the ht shmid as an envoiroment variable to pass to child process
-    char shmid_ht_str[256];
-    sprintf(shmid_ht_str, "%d", shmid_ht);
-    setenv("HT_SHMID", shmid_ht_str, 1);
+    // Locks are taken by both the traced process and memtrace
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
 
-    ht->length = 0;
-    ht->capacity_index = HT_INITIAL_CAPACITY_INDEX;
+    // Keys spread evenly over the shards, leave some room for the unlucky ones
+    const uint64_t shard_hint = capacity_hint / HT_SHARDS;
+    const uint32_t capacity_bits = _ht_capacity_bits_for(shard_hint + shard_hint / 8);
 
-    const int shmid_ht_mutex = shmalloc(HT_MUTEX_SHM_KEY_GEN, sizeof(pthread_mutex_t));
-    if (shmid_ht_mutex < 1) {
-        shmfree(ht, shmid_ht);
-        return NULL;
-    }
-    pthread_mutex_t* ht_mutex = shmload(shmid_ht_mutex);
+    for (int i = 0; i < HT_SHARDS; i++) {
+        hashTableShard* shard = &ht->shards[i];
 
-    if (pthread_mutex_init(ht_mutex, NULL)!= 0) {
-        shmfree(ht, shmid_ht);
-        shmfree(ht_mutex, shmid_ht_mutex);
-        return NULL;
-    }
+        shard->old.offset = 0;
+        shard->migrate_cursor = 0;
+        shard->min_capacity_bits = capacity_bits;
+        shard->huge_pages = huge_pages;
 
-    const int shmid_ht_entries = shmalloc(HT_ENTRIES_SHM_KEY_GEN, sizeof(hashTableEntry) * HT_GET_CAPACITY(ht));
-    if (shmid_ht_entries < 1) {
-        pthread_mutex_destroy(ht_mutex);
-        shmfree(ht, shmid_ht);
-        shmfree(ht->mutex, shmid_ht_mutex);
-        return NULL;
+        if (!_seg_alloc(&shard->current, capacity_bits, huge_pages) || pthread_mutex_init(&shard->mutex, &attr) != 0) {
+            if (shard->current.offset) {
+                _seg_free(&shard->current);
+            }
+            for (int j = 0; j < i; j++) {
+                pthread_mutex_destroy(&ht->shards[j].mutex);
+                _seg_free(&ht->shards[j].current);
+            }
+            pthread_mutexattr_destroy(&attr);
+            shmfree(shmoffset(ht), sizeof(hashTable));
+            return NULL;
+        }
     }
-    hashTableEntry* ht_entries = shmload(shmid_ht_entries);
 
-    ht->entries_shmid = shmid_ht_entries;
-    ht->entries = ht_entries;
+    pthread_mutexattr_destroy(&attr);
 
-    for (int i = 0; i < HT_GET_CAPACITY(ht); i++) {
-        ht->entries[i] = clear_entry;
-    }
+    // The traced process finds the table through the region header
+    shm_set_root(SHM_ROOT_HT, shmoffset(ht));
 
-    ht->mutex_shmid = shmid_ht_mutex;
-    ht->mutex = ht_mutex;
+    return ht;
+}
 
-    ht->context = getpid();
 
-    return ht;
+void ht_set_sample_interval(hashTable* ht, uint64_t sample_interval) {
+    ht->sample_interval = sample_interval;
+}
+
+
+uint64_t ht_sample_interval(hashTable* ht) {
+    return ht->sample_interval;
+}
+
+
+hashTable* ht_load() {
+    return shmload(shm_root(SHM_ROOT_HT));
 }
 
 
 void ht_destroy(hashTable* ht) {
     if (!ht) { return; }
 
-    if (pthread_mutex_destroy(ht->mutex)!= 0) {
-        fputs("Mutex destruction failure\n", stderr);
-    }
+    for (int i = 0; i < HT_SHARDS; i++) {
+        hashTableShard* shard = &ht->shards[i];
 
-    if (!shmfree(ht->mutex, ht->mutex_shmid) || !shmfree(ht->entries, ht->entries_shmid) || !shmfree(ht, GET_HT_SHMID)) {
-        fputs("HashTable deallocation failure\n", stderr);
+        if (pthread_mutex_destroy(&shard->mutex)!= 0) {
+            fputs("Mutex destruction failure\n", stderr);
+        }
+
+        _seg_free(&shard->current);
+        if (HT_MIGRATING(shard)) {
+            _seg_free(&shard->old);
+        }
     }
+
+    shm_set_root(SHM_ROOT_HT, 0);
+    shmfree(shmoffset(ht), sizeof(hashTable));
 }
 
 
 bool ht_insert(hashTable* ht, const size_t key, const allocInfo value) {
     if (!ht) { return false; }
 
-    _ht_load_context(ht);
+    const size_t hash = _hash_ptr(key);
+    hashTableShard* shard = _ht_load_shard(ht, hash);
 
-    int i = 0;
-    size_t index;
-    do {
-        index = DOUBLE_HASH(key, HT_GET_HASH_PRIME(ht), i, HT_GET_CAPACITY(ht));
-        i++;
-    } while (ht->entries[index].key && ht->entries[index].key != key);
+    if (HT_MIGRATING(shard)) {
+        _ht_migrate(shard, HT_MIGRATE_SLOTS);
+    }
 
-    hashTableEntry entry = {
-        .key = key,
-        .value = value
-    };
+    // Overwrites of keys not migrated yet move them to the new segment
+    if (HT_MIGRATING(shard) && shard->old.length) {
+        long old_index = _seg_find(&shard->old, hash, key, NULL);
+        if (old_index >= 0) {
+            _seg_erase(&shard->old, old_index);
+        }
+    }
 
-    if (ht->entries[index].key != key) { ht->length++; }
-    ht->entries[index] = entry;
+    htSegment* seg = &shard->current;
 
-    if (HT_LOAD_FACTOR(ht) > SIZE_UP_LOAD_FACTOR && (ht->capacity_index < HT_LAST_CAPACITY_INDEX)) {
-        if (!_ht_resize(ht, RESIZE_UP)) {
-            pthread_mutex_unlock(ht->mutex);
+    long index = _seg_find(seg, hash, key, NULL);
+    if (index >= 0) {
+        SEG_VALUES(seg)[index] = value;
+    } else {
+        // Only a segment at its maximum capacity can run out of slots
+        if (seg->length + seg->tombstones >= SEG_CAPACITY(seg)) {
+            pthread_mutex_unlock(&shard->mutex);
             return false;
         }
+        _seg_place(seg, _seg_slot_for_insert(seg, hash), hash, key, &value);
     }
 
-    pthread_mutex_unlock(ht->mutex);
+    if (!_ht_maybe_grow(shard)) {
+        pthread_mutex_unlock(&shard->mutex);
+        return false;
+    }
+
+    pthread_mutex_unlock(&shard->mutex);
 
     return true;
 }
 
 
 bool ht_delete(hashTable* ht, const size_t key) {
-    if (!ht) { return false; }
+    bool found;
+    return _ht_delete(ht, key, NULL, &found);
+}
 
-    _ht_load_context(ht);
-
-    size_t index;
-    size_t start_index = DOUBLE_HASH(key, HT_GET_HASH_PRIME(ht), 0, HT_GET_CAPACITY(ht));
-    if (ht->entries[start_index].key != key) {
-        int i = 1;
-        size_t found_key = -1;
-        do {
-            index = DOUBLE_HASH(key, HT_GET_HASH_PRIME(ht), i, HT_GET_CAPACITY(ht));
-            if (ht->entries[index].key) {
-                found_key = ht->entries[index].key;
-            }
-            if (index == start_index) {
-                // Non existing entries do not fail deletion
-                pthread_mutex_unlock(ht->mutex);
-                return true;
-            } i++;
-        } while (found_key != key);
-    } else {
-        index = start_index;
-    }
 
-    ht->entries[index] = clear_entry;
-    ht->length--;
+bool ht_remove(hashTable* ht, const size_t key, allocInfo* removed) {
+    // Failing to shrink leaves a bigger table than needed, nothing callers can act on
+    bool found = false;
+    _ht_delete(ht, key, removed, &found);
+    return found;
+}
 
-    if (HT_LOAD_FACTOR(ht) < SIZE_DOWN_LOAD_FACTOR && (ht->capacity_index > HT_INITIAL_CAPACITY_INDEX)) {
-        if (!_ht_resize(ht, RESIZE_DOWN)) {
-            pthread_mutex_unlock(ht->mutex);
-            return false;
+
+const allocInfo* ht_get(hashTable* ht, const size_t key) {
+    if (!ht) { return NULL; }
+
+    const size_t hash = _hash_ptr(key);
+    hashTableShard* shard = _ht_load_shard(ht, hash);
+
+    const allocInfo* ret = NULL;
+
+    long index = _seg_find(&shard->current, hash, key, shard);
+    if (index >= 0) {
+        ret = &SEG_VALUES(&shard->current)[index];
+    } else if (HT_MIGRATING(shard) && shard->old.length) {
+        index = _seg_find(&shard->old, hash, key, shard);
+        if (index >= 0) {
+            ret = &SEG_VALUES(&shard->old)[index];
         }
     }
 
-    pthread_mutex_unlock(ht->mutex);
+    pthread_mutex_unlock(&shard->mutex);
 
-    return true;
+    return ret;
 }
 
 
-const allocInfo* ht_get(hashTable* ht, const size_t key) {
-    if (!ht) { return NULL; }
+void ht_stats(hashTable* ht, htStats* stats) {
+    memset(stats, 0, sizeof(htStats));
+    if (!ht) { return; }
+
+    for (int i = 0; i < HT_SHARDS; i++) {
+        hashTableShard* shard = &ht->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+
+        stats->length += shard->current.length;
+        stats->capacity += SEG_CAPACITY(&shard->current);
+        stats->tombstones += shard->current.tombstones;
+        if (shard->current.max_probe + 1 > stats->max_probe) {
+            stats->max_probe = shard->current.max_probe + 1;
+        }
+        if (HT_MIGRATING(shard)) {
+            stats->length += shard->old.length;
+            stats->capacity += SEG_CAPACITY(&shard->old);
+            stats->tombstones += shard->old.tombstones;
+        }
+
+        stats->lookups += shard->lookups;
+        stats->probed_groups += shard->probed_groups;
+        for (int bucket = 0; bucket < HT_PROBE_BUCKETS; bucket++) {
+            stats->probe_histogram[bucket] += shard->probe_histogram[bucket];
+        }
+
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
 
-    _ht_load_context(ht);
-
-    size_t index;
-    size_t start_index = DOUBLE_HASH(key, HT_GET_HASH_PRIME(ht), 0, HT_GET_CAPACITY(ht));
-    if (ht->entries[start_index].key != key) {
-        int i = 1;
-        size_t found_key = -1;
-        do {
-            index = DOUBLE_HASH(key, HT_GET_HASH_PRIME(ht), i, HT_GET_CAPACITY(ht));
-            if (ht->entries[index].key) {
-                found_key = ht->entries[index].key;
+
+size_t ht_collect(hashTable* ht, htBlock* blocks, size_t capacity) {
+    if (!ht) { return 0; }
+
+    size_t length = 0;
+    for (int i = 0; i < HT_SHARDS && length < capacity; i++) {
+        hashTableShard* shard = &ht->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+
+        for (int pass = 0; pass < (HT_MIGRATING(shard)? 2 : 1); pass++) {
+            const htSegment* seg = pass? &shard->old : &shard->current;
+            const uint8_t* ctrl = SEG_CTRL(seg);
+            const size_t* keys = SEG_KEYS(seg);
+            const allocInfo* values = SEG_VALUES(seg);
+
+            for (size_t slot = 0; slot < SEG_CAPACITY(seg) && length < capacity; slot++) {
+                if (CTRL_IS_FULL(ctrl[slot])) {
+                    blocks[length++] = (htBlock){
+                        .address = keys[slot],
+                        .block_size = values[slot].block_size,
+                        .site_id = values[slot].site_id
+                    };
+                }
             }
-            if (index == start_index) {
-                pthread_mutex_unlock(ht->mutex);
-                return false;
-            } i++;
-        } while (found_key != key);
-    } else {
-        index = start_index;
+        }
+
+        pthread_mutex_unlock(&shard->mutex);
     }
 
-    const allocInfo* ret = &ht->entries[index].value;
+    return length;
+}
 
-    pthread_mutex_unlock(ht->mutex);
 
-    return ret;
+void ht_print_stats(hashTable* ht) {
+    htStats stats;
+    ht_stats(ht, &stats);
+
+    printf("Hashtable: %lu entries, %lu tombstones, %lu slots (%.1f%% load)\n",
+           stats.length, stats.tombstones, stats.capacity,
+           stats.capacity? 100.0 * (stats.length + stats.tombstones) / stats.capacity : 0.0);
+    printf("Lookups: %lu, %.2f groups probed on average, longest insert probe %lu groups\n",
+           stats.lookups, stats.lookups? (double)stats.probed_groups / stats.lookups : 0.0, stats.max_probe);
+    for (int bucket = 0; bucket < HT_PROBE_BUCKETS; bucket++) {
+        printf("  %s%d group%s: %lu\n", bucket == HT_PROBE_BUCKETS - 1? ">=" : "  ",
+               bucket + 1, bucket? "s" : " ", stats.probe_histogram[bucket]);
+    }
+    printf("\n");
 }
 
 
-void ht_print_debug(hashTable* ht, bool s_flag) {
+void ht_print_debug(hashTable* ht, siteTable* st, bool s_flag, uint32_t top) {
     if (!ht) {
         printf("Hash table is NULL\n");
         return;
     }
-    _ht_load_context(ht);
-
-    uint32_t unallocated_blocks_cnt = 0;
-    uint32_t unallocated_blocks_bytes = 0;
-
-    for (int i = 0; i < HT_GET_CAPACITY(ht); i++) {
-        hashTableEntry entry = ht->entries[i];
-        if (entry.key) {
-            unallocated_blocks_cnt++;
-            unallocated_blocks_bytes += entry.value.block_size;
-            if (s_flag) {
-                printf("\nLeaked Block Size: %d bytes\n", entry.value.block_size);
-                printf("Leaked Block Stack Trace:\n\n");
-                for (int i = 1; i < MAX_STRINGS; i++) {
-                    if (*entry.value.stack_trace[i] != '\0') {
-                        printf("# %s\n", entry.value.stack_trace[i]);
-                    }
-                }
-                printf("\nTo track down the leak run:\n");
-                printf("objdump -S <executable> | grep -A 10 -B 10 '<top-base-offset>'\n");
-                printf("addr2line -e <executable> <top-base-offset>\n\n");
-                printf("--------------------------------------------------------------\n");
+
+    htStats stats;
+    ht_stats(ht, &stats);
+
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nworkers = stats.length < HT_PARALLEL_REPORT_ENTRIES || ncpus < 1? 1 : ncpus;
+    if (nworkers > HT_SHARDS) {
+        nworkers = HT_SHARDS;
+    }
+
+    // Site ids past the table length can't be resolved, they are counted as unknown
+    const uint32_t nsites = st? st_length(st) : 1;
+    leakWorker* workers = calloc(nworkers, sizeof(leakWorker));
+    leakTotals* sites = calloc((size_t)nworkers * nsites, sizeof(leakTotals));
+    siteId* ranked = malloc(nsites * sizeof(siteId));
+    if (!workers || !sites || !ranked) {
+        printf("Leak report allocation failure\n");
+        free(workers);
+        free(sites);
+        free(ranked);
+        return;
+    }
+
+    for (int i = 0; i < nworkers; i++) {
+        workers[i] = (leakWorker){
+            .ht = ht,
+            .first_shard = i * HT_SHARDS / nworkers,
+            .end_shard = (i + 1) * HT_SHARDS / nworkers,
+            .nsites = nsites,
+            .sites = &sites[(size_t)i * nsites]
+        };
+    }
+
+    // The calling thread takes the first range, a worker that can't be started runs inline
+    for (int i = 1; i < nworkers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, _ht_aggregate_leaks, &workers[i]) != 0) {
+            _ht_aggregate_leaks(&workers[i]);
+            workers[i].ht = NULL;
+        }
+    }
+    _ht_aggregate_leaks(&workers[0]);
+
+    leakTotals totals = workers[0].totals;
+    for (int i = 1; i < nworkers; i++) {
+        if (workers[i].ht) {
+            pthread_join(workers[i].thread, NULL);
+        }
+        totals.blocks += workers[i].totals.blocks;
+        totals.bytes += workers[i].totals.bytes;
+        totals.estimated_blocks += workers[i].totals.estimated_blocks;
+        totals.estimated_bytes += workers[i].totals.estimated_bytes;
+        for (uint32_t id = 0; id < nsites; id++) {
+            sites[id].blocks += workers[i].sites[id].blocks;
+            sites[id].bytes += workers[i].sites[id].bytes;
+            sites[id].estimated_blocks += workers[i].sites[id].estimated_blocks;
+            sites[id].estimated_bytes += workers[i].sites[id].estimated_bytes;
+        }
+    }
+
+    if (s_flag) {
+        uint32_t nleaking = 0;
+        for (uint32_t id = 0; id < nsites; id++) {
+            if (sites[id].blocks) {
+                ranked[nleaking++] = id;
             }
         }
+
+        // Estimated bytes are the real ones when not sampling
+        sorting_leaks = sites;
+        qsort(ranked, nleaking, sizeof(siteId), _ht_compare_leaks);
+
+        for (uint32_t i = 0; i < nleaking && i < top; i++) {
+            _ht_print_leak(st, ranked[i], &sites[ranked[i]], &totals, ht->sample_interval);
+        }
+        if (nleaking > top) {
+            printf("\n%u more leaking call sites not shown, use -t to show more\n", nleaking - top);
+        }
+        printf("\n");
     }
 
-    if (unallocated_blocks_bytes) {
-        printf("%d bytes not freed in %d blocks\n\n", unallocated_blocks_bytes, unallocated_blocks_cnt);
-    } else {
+    if (!totals.bytes) {
         printf("\nNo memory leaks\n\n");
+    } else if (ht->sample_interval) {
+        printf("%lu bytes not freed in %lu sampled blocks\n", totals.bytes, totals.blocks);
+        printf("Estimated %.0f bytes not freed in %.0f blocks (sampling every %lu bytes on average)\n\n",
+               totals.estimated_bytes, totals.estimated_blocks, ht->sample_interval);
+    } else {
+        printf("%lu bytes not freed in %lu blocks\n\n", totals.bytes, totals.blocks);
     }
 
-    pthread_mutex_unlock(ht->mutex);
+    free(workers);
+    free(sites);
+    free(ranked);
 }
 
 
@@ -367,119 +588,398 @@ void ht_print_debug(hashTable* ht, bool s_flag) {
  ***********************************************************************************************************/
 
 
-#ifdef HT_TEST
-    // For hashtable testing just use stdlib functions
-    void* _no_intercept_calloc(size_t num_elements, size_t element_size) {
-        void* ptr = calloc(num_elements, element_size);
-        return ptr;
+static void* _ht_aggregate_leaks(void* arg) {
+    leakWorker* worker = arg;
+
+    for (int shard_index = worker->first_shard; shard_index < worker->end_shard; shard_index++) {
+        hashTableShard* shard = &worker->ht->shards[shard_index];
+        pthread_mutex_lock(&shard->mutex);
+
+        _ht_aggregate_segment(&shard->current, worker);
+        if (HT_MIGRATING(shard)) {
+            _ht_aggregate_segment(&shard->old, worker);
+        }
+
+        pthread_mutex_unlock(&shard->mutex);
     }
-    void  _no_intercept_free(void* ptr) {
-        free(ptr);
+
+    return NULL;
+}
+
+
+static void _ht_aggregate_segment(const htSegment* seg, leakWorker* worker) {
+    const uint8_t* ctrl = SEG_CTRL(seg);
+    const allocInfo* values = SEG_VALUES(seg);
+    const uint64_t sample_interval = worker->ht->sample_interval;
+
+    for (size_t i = 0; i < SEG_CAPACITY(seg); i++) {
+        if (CTRL_IS_FULL(ctrl[i])) {
+            double weight = sp_weight(values[i].block_size, sample_interval);
+            siteId id = values[i].site_id < worker->nsites? values[i].site_id : ST_UNKNOWN_SITE;
+            leakTotals* site = &worker->sites[id];
+
+            site->blocks++;
+            site->bytes += values[i].block_size;
+            site->estimated_blocks += weight;
+            site->estimated_bytes += weight * values[i].block_size;
+
+            worker->totals.blocks++;
+            worker->totals.bytes += values[i].block_size;
+            worker->totals.estimated_blocks += weight;
+            worker->totals.estimated_bytes += weight * values[i].block_size;
+        }
+    }
+}
+
+
+static int _ht_compare_leaks(const void* a, const void* b) {
+    const double bytes_a = sorting_leaks[*(const siteId*)a].estimated_bytes;
+    const double bytes_b = sorting_leaks[*(const siteId*)b].estimated_bytes;
+
+    return (bytes_a < bytes_b) - (bytes_a > bytes_b);
+}
+
+
+static void _ht_print_leak(siteTable* st, siteId id, const leakTotals* leak, const leakTotals* totals, uint64_t sample_interval) {
+    printf("\nLeaked %lu bytes in %lu blocks (%.1f%% of leaked bytes)\n",
+           leak->bytes, leak->blocks, totals->estimated_bytes? 100.0 * leak->estimated_bytes / totals->estimated_bytes : 0.0);
+    if (sample_interval) {
+        printf("Estimated %.0f bytes in %.0f blocks\n", leak->estimated_bytes, leak->estimated_blocks);
+    }
+    printf("Leaking Call Site Stack Trace:\n\n");
+
+    const callSite* site = st_get(st, id);
+    const moduleMap* modules = st_modules(st);
+    void* const* frames = site? st_frames(st, site) : NULL;
+
+    st_print_frames(st, id, stdout);
+
+    // Resolved sites point straight at the allocation, the others get the commands to find it
+    const symbolInfo* symbol = site? st_symbol(st, site, 0) : NULL;
+    char location[2 * MM_MAX_PATH];
+    if (symbol && symbol->file && sy_format(symbol, location, sizeof(location))) {
+        printf("\nAllocated in %s\n\n", location);
+        printf("--------------------------------------------------------------\n");
+        return;
     }
+
+    printf("\nTo track down the leak run:\n");
+    const moduleInfo* top = site? mm_find(modules, (uintptr_t)frames[0]) : NULL;
+    if (top) {
+        uintptr_t top_offset = (uintptr_t)frames[0] - top->start + top->offset;
+        printf("objdump -S %s | grep -A 10 -B 10 '%lx:'\n", top->path, top_offset);
+        printf("addr2line -e %s %#lx\n\n", top->path, top_offset);
+    } else {
+        printf("objdump -S <executable> | grep -A 10 -B 10 '<top-base-offset>'\n");
+        printf("addr2line -e <executable> <top-base-offset>\n\n");
+    }
+    printf("--------------------------------------------------------------\n");
+}
+
+
+static size_t _hash_ptr(size_t address) {
+    address ^= address >> 33;
+    address *= HT_HASH_MULTIPLIER;
+    address ^= address >> 33;
+
+    return address;
+}
+
+
+#if defined(__AVX2__)
+static groupMask _group_match(const uint8_t* group, uint8_t ctrl) {
+    __m256i bytes = _mm256_load_si256((const __m256i*)group);
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(ctrl)));
+}
+
+static groupMask _group_match_full(const uint8_t* group) {
+    return _mm256_movemask_epi8(_mm256_load_si256((const __m256i*)group));
+}
+#elif defined(__SSE2__)
+static groupMask _group_match(const uint8_t* group, uint8_t ctrl) {
+    __m128i bytes = _mm_load_si128((const __m128i*)group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(ctrl)));
+}
+
+static groupMask _group_match_full(const uint8_t* group) {
+    return _mm_movemask_epi8(_mm_load_si128((const __m128i*)group));
+}
 #else
+static groupMask _group_match(const uint8_t* group, uint8_t ctrl) {
+    groupMask mask = 0;
+    for (int i = 0; i < HT_GROUP_WIDTH; i++) {
+        mask |= (groupMask)(group[i] == ctrl) << i;
+    }
+    return mask;
+}
+
+static groupMask _group_match_full(const uint8_t* group) {
+    groupMask mask = 0;
+    for (int i = 0; i < HT_GROUP_WIDTH; i++) {
+        mask |= (groupMask)(CTRL_IS_FULL(group[i]) != 0) << i;
+    }
+    return mask;
+}
+#endif
+
+#define GROUP_ALL_SLOTS \
+    ((groupMask)((1ULL << HT_GROUP_WIDTH) - 1))
+
+
+static long _seg_find(const htSegment* seg, size_t hash, size_t key, hashTableShard* stats) {
     /**
-     * functions that handle dynamic memory but are not intercepted (the intercept does nothing),
-     * defined here as weak and redefined by the shared lib
+     * Groups are probed with a triangular sequence, which visits every group
+     * of a power of two table. A group with an empty slot ends the probe,
+     * no key was ever moved past it, and no key was placed further than
+     * max_probe groups away, so misses are bounded even among tombstones
      */
-    __attribute__((weak)) void* _no_intercept_calloc(size_t num_elements, size_t element_size) { return NULL; }
-    __attribute__((weak)) void  _no_intercept_free(void* ptr) { }
-#endif
+    const uint8_t* ctrl = SEG_CTRL(seg);
+    const size_t* keys = SEG_KEYS(seg);
+    const size_t group_mask = SEG_GROUPS(seg) - 1;
+    const uint8_t h2 = HT_H2(hash);
+
+    long ret = -1;
+    size_t group = HT_H1(hash) & group_mask;
+    uint32_t probe = 0;
+    while (probe <= seg->max_probe) {
+        const uint8_t* group_ctrl = ctrl + group * HT_GROUP_WIDTH;
+        probe++;
+
+        for (groupMask match = _group_match(group_ctrl, h2); match; match &= match - 1) {
+            size_t index = group * HT_GROUP_WIDTH + __builtin_ctz(match);
+            if (keys[index] == key) {
+                ret = index;
+                goto found;
+            }
+        }
+
+        if (_group_match(group_ctrl, CTRL_EMPTY)) {
+            break;
+        }
 
+        group = (group + probe) & group_mask;
+    }
+
+found:
+    if (stats) {
+        stats->lookups++;
+        stats->probed_groups += probe;
+        stats->probe_histogram[(probe < HT_PROBE_BUCKETS? probe : HT_PROBE_BUCKETS) - 1]++;
+    }
+
+    return ret;
+}
 
-static size_t _hash_fnv1(size_t address) {
-    // Word size independent
-    int bytes_cnt = sizeof(address);
 
-    uint8_t bytes[bytes_cnt];
-    memcpy(bytes, &address, bytes_cnt);
+static size_t _seg_slot_for_insert(htSegment* seg, size_t hash) {
+    // Callers make sure there is at least one slot that is not full
+    const uint8_t* ctrl = SEG_CTRL(seg);
+    const size_t group_mask = SEG_GROUPS(seg) - 1;
 
-    size_t hash = FNV_OFFSET_BASIS;
-    for (int i = 0; i < bytes_cnt; i++) {
-        hash *= FNV_PRIME;
-        hash ^= bytes[i];
+    size_t group = HT_H1(hash) & group_mask;
+    for (uint32_t probe = 0; ; probe++) {
+        groupMask available = ~_group_match_full(ctrl + group * HT_GROUP_WIDTH) & GROUP_ALL_SLOTS;
+        if (available) {
+            if (probe > seg->max_probe) {
+                seg->max_probe = probe;
+            }
+            return group * HT_GROUP_WIDTH + __builtin_ctz(available);
+        }
+
+        group = (group + probe + 1) & group_mask;
     }
+}
+
+
+static void _seg_place(htSegment* seg, size_t index, size_t hash, size_t key, const allocInfo* value) {
+    uint8_t* ctrl = SEG_CTRL(seg);
 
-    return hash;
+    if (ctrl[index] == CTRL_DELETED) {
+        seg->tombstones--;
+    }
+
+    ctrl[index] = HT_H2(hash);
+    SEG_KEYS(seg)[index] = key;
+    SEG_VALUES(seg)[index] = *value;
+    seg->length++;
 }
 
 
-static void _ht_load_context(hashTable* ht) {
+static void _seg_erase(htSegment* seg, size_t index) {
     /**
-     * The mutex is taken before being loaded into the current process,
-     * in this context loading means updating the ht->entries and ht->mutex pointers
-     * for the current virtual address space
+     * A group that still has an empty slot was never full, so no probe went past it
+     * and the slot can go back to empty. Otherwise it has to become a tombstone
      */
+    uint8_t* ctrl = SEG_CTRL(seg);
+    const uint8_t* group_ctrl = ctrl + (index & ~(size_t)(HT_GROUP_WIDTH - 1));
 
-    /**
-     * For simplicity let's assume that loading memory from
-     * a valid shmid never fails
-     */
+    if (_group_match(group_ctrl, CTRL_EMPTY)) {
+        ctrl[index] = CTRL_EMPTY;
+    } else {
+        ctrl[index] = CTRL_DELETED;
+        seg->tombstones++;
+    }
 
-    pid_t new_context = getpid();
-    if (ht->context == new_context) {
-        pthread_mutex_lock(ht->mutex);
-        return;
+    seg->length--;
+}
+
+
+static uint32_t _ht_capacity_bits_for(uint64_t entries) {
+    // Smallest capacity that holds entries below the grow threshold
+    const uint64_t slots = entries + entries / 7 + 1;
+
+    uint32_t capacity_bits = HT_INITIAL_CAPACITY_BITS;
+    while (capacity_bits < HT_MAX_CAPACITY_BITS && ((uint64_t)1 << capacity_bits) < slots) {
+        capacity_bits++;
+    }
+
+    return capacity_bits;
+}
+
+
+static bool _seg_alloc(htSegment* seg, uint32_t capacity_bits, bool huge_pages) {
+    // Fresh segments are zero filled, which is what empty control bytes look like
+    const size_t size = SEG_BYTES(capacity_bits);
+
+    seg->offset = shmalloc(size);
+    if (!seg->offset) {
+        return false;
     }
 
-    pthread_mutex_t* context_mutex = shmload(ht->mutex_shmid);
-    hashTableEntry* context_entries = shmload(ht->entries_shmid);
+    if (huge_pages && size >= HT_HUGE_PAGE_SIZE) {
+        shmadvise_huge(seg->offset, size);
+    }
+
+    seg->capacity_bits = capacity_bits;
+    seg->length = 0;
+    seg->tombstones = 0;
+    seg->max_probe = 0;
 
-    pthread_mutex_lock(context_mutex);
+    return true;
+}
 
-    ht->entries = context_entries;
-    ht->mutex = context_mutex;
 
-    ht->context = new_context;
+static void _seg_free(htSegment* seg) {
+    shmfree(seg->offset, SEG_BYTES(seg->capacity_bits));
+    seg->offset = 0;
 }
 
 
-static bool _ht_resize(hashTable* ht, int resize_direction) {
-    uint32_t current_capacity = HT_GET_CAPACITY(ht);
-    uint32_t new_capacity = resize_direction?  HT_GET_NEXT_CAPACITY(ht) : HT_GET_PREV_CAPACITY(ht);
+static bool _ht_delete(hashTable* ht, const size_t key, allocInfo* removed, bool* found) {
+    *found = false;
+    if (!ht) { return false; }
 
-    hashTableEntry* tmp = _no_intercept_calloc(current_capacity, sizeof(hashTableEntry));
-    memcpy(tmp, ht->entries, current_capacity * sizeof(hashTableEntry));
+    const size_t hash = _hash_ptr(key);
+    hashTableShard* shard = _ht_load_shard(ht, hash);
 
-    if (!shmfree(ht->entries, ht->entries_shmid)) {
-        _no_intercept_free(tmp);
-        return false;
+    if (HT_MIGRATING(shard)) {
+        _ht_migrate(shard, HT_MIGRATE_SLOTS);
+    }
+
+    htSegment* found_seg = &shard->current;
+    long index = _seg_find(found_seg, hash, key, shard);
+    if (index < 0 && HT_MIGRATING(shard) && shard->old.length) {
+        found_seg = &shard->old;
+        index = _seg_find(found_seg, hash, key, shard);
+    }
+    if (index >= 0) {
+        if (removed) {
+            *removed = SEG_VALUES(found_seg)[index];
+        }
+        _seg_erase(found_seg, index);
+        *found = true;
+    }
+
+    // Non existing entries do not fail deletion
+    if (index < 0) {
+        pthread_mutex_unlock(&shard->mutex);
+        return true;
+    }
+
+    htSegment* seg = &shard->current;
+    if (!HT_MIGRATING(shard) && HT_SEG_LOAD_FACTOR(seg) < SIZE_DOWN_LOAD_FACTOR && (seg->capacity_bits > shard->min_capacity_bits)) {
+        if (!_ht_resize(shard, RESIZE_DOWN)) {
+            pthread_mutex_unlock(&shard->mutex);
+            return false;
+        }
     }
 
-    int shmid_ht_realloc_entries = shmalloc(HT_ENTRIES_SHM_KEY_GEN, sizeof(hashTableEntry) * new_capacity);
-    if (shmid_ht_realloc_entries < 1) {
-        _no_intercept_free(tmp);
+    pthread_mutex_unlock(&shard->mutex);
+
+    return true;
+}
+
+
+static hashTableShard* _ht_load_shard(hashTable* ht, size_t hash) {
+    hashTableShard* shard = &ht->shards[HT_SHARD_OF(hash)];
+    pthread_mutex_lock(&shard->mutex);
+
+    return shard;
+}
+
+
+static bool _ht_resize(hashTableShard* shard, int resize_direction) {
+    // Only the new segment is set up here, entries are moved over by _ht_migrate
+    uint32_t new_capacity_bits = shard->current.capacity_bits + resize_direction;
+
+    htSegment new_segment;
+    if (!_seg_alloc(&new_segment, new_capacity_bits, shard->huge_pages)) {
         return false;
     }
-    hashTableEntry* ht_realloc_entries = shmload(shmid_ht_realloc_entries);
 
-    ht->entries_shmid = shmid_ht_realloc_entries;
-    ht->entries = ht_realloc_entries;
+    shard->old = shard->current;
+    shard->current = new_segment;
+    shard->migrate_cursor = 0;
+
+    return true;
+}
+
 
-    for (int i = 0; i < new_capacity; i++) {
-        ht->entries[i] = clear_entry;
+static bool _ht_maybe_grow(hashTableShard* shard) {
+    /**
+     * Called after an insert. A segment that is too loaded or that had to place
+     * a key too far away is rebuilt, at double the capacity unless what fills
+     * it is mostly tombstones. The rebuild drops them since only full slots
+     * are migrated
+     */
+    htSegment* seg = &shard->current;
+
+    if (HT_MIGRATING(shard)) {
+        return true;
+    }
+    if (HT_SEG_LOAD_FACTOR(seg) <= SIZE_UP_LOAD_FACTOR && seg->max_probe <= HT_PROBE_LIMIT) {
+        return true;
     }
 
-    uint32_t new_hash_prime = resize_direction?  HT_GET_NEXT_HASH_PRIME(ht) : HT_GET_PREV_HASH_PRIME(ht);
-    for (int i = 0; i < current_capacity; i++) {
-        hashTableEntry entry = tmp[i];
-        if (entry.key) {
-            int j = 0;
-            size_t new_index;
-            do {
-                new_index = DOUBLE_HASH(entry.key, new_hash_prime, j, new_capacity);
-                j++;
-            } while (ht->entries[new_index].key);
+    if (HT_SEG_MOSTLY_TOMBSTONES(seg) || seg->capacity_bits >= HT_MAX_CAPACITY_BITS) {
+        // Nothing to win from rebuilding a segment without tombstones
+        if (!seg->tombstones) {
+            return true;
+        }
+        return _ht_resize(shard, RESIZE_REHASH);
+    }
+
+    return _ht_resize(shard, RESIZE_UP);
+}
 
-            ht->entries[new_index] = entry;
+
+static void _ht_migrate(hashTableShard* shard, uint32_t nslots) {
+    htSegment* old = &shard->old;
+    const uint8_t* old_ctrl = SEG_CTRL(old);
+
+    while (nslots-- && shard->migrate_cursor < SEG_CAPACITY(old) && old->length) {
+        size_t index = shard->migrate_cursor++;
+        if (CTRL_IS_FULL(old_ctrl[index])) {
+            size_t key = SEG_KEYS(old)[index];
+            size_t hash = _hash_ptr(key);
+            _seg_place(&shard->current, _seg_slot_for_insert(&shard->current, hash), hash, key, &SEG_VALUES(old)[index]);
+            _seg_erase(old, index);
         }
     }
-    _no_intercept_free(tmp);
 
-    if (resize_direction) {
-        ht->capacity_index += 2;
-    } else {
-        ht->capacity_index -= 2;
+    if (shard->migrate_cursor < SEG_CAPACITY(old) && old->length) {
+        return;
     }
 
-    return true;
-};
+    _seg_free(old);
+}
@@ -24,7 +24,7 @@
  * in Memtrace. It exercises various aspects of the hash table including
  * insertion, deletion, retrieval, and debugging output. The test
  * demonstrates the hash table's ability to handle dynamic resizing,
- * collision resolution via double hashing, and the correct handling of
+ * bounded probing through tombstones, and the correct handling of
  * different block sizes for allocated memory. This testing helps ensure
  * the reliability and correctness of the hash table's performance in
  * tracking memory allocations and deallocations within the Memtrace
@@ -33,10 +33,17 @@
  */
 
 #include <assert.h>
+#include <pthread.h>
 #include "hashtable.h"
+#include "shmwrap.h"
 
 #define NUM_ALLOCATIONS 1000
 #define OVERWRITE_KEY 33
+#define NUM_THREADS 8
+// Enough keys for every shard to grow, and later shrink, several times
+#define NUM_RESIZE_ALLOCATIONS 100000
+// Insert and delete rounds over fresh keys, leaves tombstones behind
+#define NUM_CHURN_ROUNDS 200
 
 const allocInfo mock_1 = {
     .block_size = 1,
@@ -45,8 +52,23 @@ const allocInfo mock_2 = {
     .block_size = 2,
 };
 
+static hashTable* shared_ht;
+
+// Each thread owns a disjoint key range, shards must keep them all
+static void* thread_inserts(void* arg) {
+    size_t base = (size_t)arg * NUM_ALLOCATIONS;
+    for (size_t i = 1; i <= NUM_ALLOCATIONS; i++) {
+        assert(ht_insert(shared_ht, base + i, mock_1));
+    }
+    for (size_t i = 1; i <= NUM_ALLOCATIONS; i += 2) {
+        assert(ht_delete(shared_ht, base + i));
+    }
+    return NULL;
+}
+
 int main(void) {
-    hashTable* ht = ht_create();
+    assert(shm_create());
+    hashTable* ht = ht_create(0, false);
 
     for (int i = 1; i < NUM_ALLOCATIONS; i++) {
         assert(ht_insert(ht, i, mock_1));
@@ -72,8 +94,109 @@ int main(void) {
 
     const allocInfo* overwrite_entry = ht_get(ht, OVERWRITE_KEY);
     assert(overwrite_entry->block_size == mock_2.block_size);
+    allocInfo removed;
+    assert(ht_remove(ht, OVERWRITE_KEY, &removed));
+    assert(removed.block_size == mock_2.block_size);
+    assert(!ht_remove(ht, OVERWRITE_KEY, &removed));
 
+    // Lookups must keep working while shards migrate between segments
+    for (size_t key = 1; key <= NUM_RESIZE_ALLOCATIONS; key++) {
+        assert(ht_insert(ht, key, mock_1));
+        assert(ht_get(ht, key / 2 + 1));
+    }
+    for (size_t key = 1; key <= NUM_RESIZE_ALLOCATIONS; key++) {
+        assert(ht_get(ht, key));
+        assert(ht_delete(ht, key));
+        assert(!ht_get(ht, key));
+    }
+
+    // Churn must not let tombstones make misses walk the table
+    for (size_t round = 0; round < NUM_CHURN_ROUNDS; round++) {
+        size_t base = (round + 1) * NUM_RESIZE_ALLOCATIONS;
+        for (size_t i = 0; i < NUM_ALLOCATIONS; i++) {
+            assert(ht_insert(ht, base + i, mock_1));
+        }
+        for (size_t i = 0; i < NUM_ALLOCATIONS; i++) {
+            assert(ht_delete(ht, base + i));
+        }
+    }
+    for (size_t key = 1; key <= NUM_RESIZE_ALLOCATIONS; key++) {
+        assert(!ht_get(ht, key));
+    }
+
+    htStats stats;
+    ht_stats(ht, &stats);
+    assert(stats.length == 0);
+    assert(stats.lookups);
+    assert(stats.probed_groups < 2 * stats.lookups);
+    assert(stats.max_probe <= HT_PROBE_BUCKETS + 1);
+
+    shared_ht = ht;
+    pthread_t threads[NUM_THREADS];
+    for (size_t t = 0; t < NUM_THREADS; t++) {
+        assert(pthread_create(&threads[t], NULL, thread_inserts, (void*)t) == 0);
+    }
+    for (int t = 0; t < NUM_THREADS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    for (size_t key = 1; key <= NUM_THREADS * NUM_ALLOCATIONS; key++) {
+        const allocInfo* entry = ht_get(ht, key);
+        assert((key % 2)? !entry : entry != NULL);
+    }
+
+    // Collect copies every live block once, and never past capacity
+    static htBlock blocks[NUM_THREADS * NUM_ALLOCATIONS];
+    size_t collected = ht_collect(ht, blocks, NUM_THREADS * NUM_ALLOCATIONS);
+    assert(collected == NUM_THREADS * NUM_ALLOCATIONS / 2);
+    for (size_t i = 0; i < collected; i++) {
+        assert(blocks[i].address % 2 == 0);
+        assert(blocks[i].block_size == mock_1.block_size);
+    }
+    assert(ht_collect(ht, blocks, 10) == 10);
+
+    ht_destroy(ht);
+
+    // A table sized up front never resizes, nor shrinks below its hint
+    ht = ht_create(NUM_RESIZE_ALLOCATIONS, false);
+    ht_stats(ht, &stats);
+    const uint64_t presized_capacity = stats.capacity;
+    for (size_t key = 1; key <= NUM_RESIZE_ALLOCATIONS; key++) {
+        assert(ht_insert(ht, key, mock_1));
+    }
+    for (size_t key = 1; key <= NUM_RESIZE_ALLOCATIONS; key++) {
+        assert(ht_delete(ht, key));
+    }
+    ht_stats(ht, &stats);
+    assert(stats.capacity == presized_capacity);
     ht_destroy(ht);
 
+    // Site counters follow live bytes and keep their peak
+    siteTable* st = st_create();
+    void* frames[] = { (void*)main };
+    siteId site = st_intern(st, frames, 1);
+    st_count_alloc(st, site, 1, 64);
+    st_count_alloc(st, site, 1, 32);
+    st_count_free(st, site, 1, 64, 1000);
+    st_count_alloc(st, site, 1, 16);
+    const siteCounters* counters = st_counters(st, site);
+    assert(counters->allocs == 3 && counters->alloc_bytes == 112);
+    assert(counters->frees == 1 && counters->live_bytes == 48);
+    assert(counters->peak_live_bytes == 96);
+    // 1000 ticks fall in [512, 1024)
+    assert(st_lifetimes(st, site)->buckets[9] == 1);
+
+    // Growing past the snapshot threshold records the heap breakdown
+    st_count_alloc(st, site, 1, 1 << 24);
+    st_count_free(st, site, 1, 1 << 24, 0);
+    uint32_t peak_sites;
+    uint64_t peak_bytes;
+    const sitePeak* peak = st_peak_snapshot(st, &peak_sites, &peak_bytes);
+    assert(peak_sites == 1 && peak[0].id == site);
+    assert(peak_bytes == (1 << 24) + 48);
+    assert(st_peak_live_bytes(st) == peak_bytes);
+    st_destroy(st);
+
+    shm_destroy();
+
     return 0;
 }
@@ -27,6 +27,7 @@
  */
 
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <pthread.h>
 
@@ -48,5 +49,12 @@ int main(void) {
         free(arr[i]);
     }
 
+    // A failed realloc leaves the block as it was, still leaked with its size and call site
+    volatile size_t too_big = SIZE_MAX;
+    if (realloc(arr[NUM_ALLOCATIONS-1], too_big) != NULL) {
+        fprintf(stderr, "Realloc should have failed\n");
+        return -1;
+    }
+
     return 0;
 }
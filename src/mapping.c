@@ -0,0 +1,336 @@
+/*
+ * Copyright (C) 2024 Alejandro Cadarso
+ *
+ * This file is part of Memtrace.
+ *
+ * Memtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Memtrace.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * File: mapping.c
+ * Author: Alejandro Cadarso
+ * Date: 17-10-2026
+ *
+ * This file implements the mapping table. Regions are kept sorted by
+ * address in a fixed size array in shared memory, mapping calls are rare
+ * next to allocations so a single mutex and a binary search are enough.
+ * Unmapping part of a region trims or splits it, the way the kernel does.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "mapping.h"
+#include "shmwrap.h"
+
+// The kernel allows 65530 mappings per process by default, vm.max_map_count
+#define MP_MAX_REGIONS (1 << 16)
+
+struct mappingTable {
+    pthread_mutex_t mutex;
+    uint32_t length;
+    uint64_t live_bytes;
+    uint64_t peak_live_bytes;
+    // Regions that did not fit, their bytes are not accounted anywhere
+    uint64_t dropped;
+    mappingCounters counters[ST_MAX_SITES];
+    mappedRegion regions[MP_MAX_REGIONS];
+};
+
+static uint32_t _mp_first_overlap(mappingTable* mp, uint64_t start);
+static void _mp_remove(mappingTable* mp, uint64_t start, uint64_t end);
+static void _mp_count_unmap(mappingTable* mp, siteId site_id, uint64_t bytes);
+static int _mp_compare_peak_bytes(const void* a, const void* b);
+
+// Table whose sites are being sorted by mp_print, qsort takes no context
+static mappingTable* sorting_table;
+
+
+/************************************************************************************************************
+ *                                          PUBLIC FUNCTIONS                                                *
+ ***********************************************************************************************************/
+
+
+mappingTable* mp_create() {
+    mappingTable* mp = shmload(shmalloc(sizeof(mappingTable)));
+    if (!mp) {
+        return NULL;
+    }
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    if (pthread_mutex_init(&mp->mutex, &attr) != 0) {
+        pthread_mutexattr_destroy(&attr);
+        shmfree(shmoffset(mp), sizeof(mappingTable));
+        return NULL;
+    }
+    pthread_mutexattr_destroy(&attr);
+
+    shm_set_root(SHM_ROOT_MP, shmoffset(mp));
+
+    return mp;
+}
+
+
+mappingTable* mp_load() {
+    return shmload(shm_root(SHM_ROOT_MP));
+}
+
+
+void mp_destroy(mappingTable* mp) {
+    if (!mp) { return; }
+
+    if (pthread_mutex_destroy(&mp->mutex) != 0) {
+        fputs("Mutex destruction failure\n", stderr);
+    }
+
+    shm_set_root(SHM_ROOT_MP, 0);
+    shmfree(shmoffset(mp), sizeof(mappingTable));
+}
+
+
+bool mp_map(mappingTable* mp, uint64_t start, uint64_t length, siteId site_id, regionKind kind) {
+    if (!length) { return true; }
+    if (site_id >= ST_MAX_SITES) { site_id = ST_UNKNOWN_SITE; }
+
+    const uint64_t end = start + length;
+
+    pthread_mutex_lock(&mp->mutex);
+
+    _mp_remove(mp, start, end);
+
+    if (mp->length == MP_MAX_REGIONS) {
+        mp->dropped++;
+        pthread_mutex_unlock(&mp->mutex);
+        return false;
+    }
+
+    // Nothing overlaps any more, the first region ending after start is the first one after it
+    uint32_t index = _mp_first_overlap(mp, start);
+    memmove(&mp->regions[index + 1], &mp->regions[index], (mp->length - index) * sizeof(mappedRegion));
+    mp->regions[index] = (mappedRegion){ .start = start, .end = end, .site_id = site_id, .kind = kind };
+    mp->length++;
+
+    mappingCounters* counters = &mp->counters[site_id];
+    counters->maps++;
+    counters->mapped_bytes += length;
+    counters->live_bytes += length;
+    if (counters->live_bytes > counters->peak_live_bytes) {
+        counters->peak_live_bytes = counters->live_bytes;
+    }
+
+    mp->live_bytes += length;
+    if (mp->live_bytes > mp->peak_live_bytes) {
+        mp->peak_live_bytes = mp->live_bytes;
+    }
+
+    pthread_mutex_unlock(&mp->mutex);
+
+    return true;
+}
+
+
+void mp_unmap(mappingTable* mp, uint64_t start, uint64_t length) {
+    if (!length) { return; }
+
+    pthread_mutex_lock(&mp->mutex);
+    _mp_remove(mp, start, start + length);
+    pthread_mutex_unlock(&mp->mutex);
+}
+
+
+bool mp_region_at(mappingTable* mp, uint64_t address, mappedRegion* region) {
+    pthread_mutex_lock(&mp->mutex);
+
+    uint32_t index = _mp_first_overlap(mp, address);
+    bool found = index < mp->length && mp->regions[index].start <= address;
+    if (found) {
+        *region = mp->regions[index];
+    }
+
+    pthread_mutex_unlock(&mp->mutex);
+
+    return found;
+}
+
+
+const mappedRegion* mp_regions(mappingTable* mp, uint32_t* length) {
+    *length = mp->length;
+
+    return mp->regions;
+}
+
+
+const mappingCounters* mp_counters(mappingTable* mp, siteId id) {
+    if (!mp || id >= ST_MAX_SITES) {
+        return NULL;
+    }
+
+    return &mp->counters[id];
+}
+
+
+uint64_t mp_live_bytes(mappingTable* mp) {
+    return mp->live_bytes;
+}
+
+
+uint64_t mp_peak_live_bytes(mappingTable* mp) {
+    return mp->peak_live_bytes;
+}
+
+
+void mp_print(mappingTable* mp, siteTable* st, uint32_t top) {
+    if (!mp) { return; }
+
+    printf("Mapped memory\n");
+    printf("--------------------------------------------------------------\n");
+    printf("\n%lu bytes mapped at the peak, %lu bytes still mapped in %u regions\n", mp->peak_live_bytes,
+           mp->live_bytes, mp->length);
+    if (mp->dropped) {
+        printf("%lu regions were not tracked, the table was full\n", mp->dropped);
+    }
+
+    const uint32_t nsites = st_length(st) < ST_MAX_SITES? st_length(st) : ST_MAX_SITES;
+    siteId* ids = malloc((nsites? nsites : 1) * sizeof(siteId));
+    if (!ids) {
+        fputs("Mapping report allocation failure\n", stderr);
+        return;
+    }
+
+    uint32_t length = 0;
+    for (siteId id = 0; id < nsites; id++) {
+        if (mp->counters[id].maps) {
+            ids[length++] = id;
+        }
+    }
+
+    sorting_table = mp;
+    qsort(ids, length, sizeof(siteId), _mp_compare_peak_bytes);
+
+    for (uint32_t i = 0; i < length && i < top; i++) {
+        const mappingCounters* counters = &mp->counters[ids[i]];
+
+        uint32_t regions = 0;
+        uint64_t file_bytes = 0;
+        for (uint32_t r = 0; r < mp->length; r++) {
+            if (mp->regions[r].site_id == ids[i]) {
+                regions++;
+                file_bytes += mp->regions[r].kind == MP_FILE? mp->regions[r].end - mp->regions[r].start : 0;
+            }
+        }
+
+        printf("\n#%u: %lu bytes mapped at most, %lu in %lu mappings\n", i + 1, counters->peak_live_bytes,
+               counters->mapped_bytes, counters->maps);
+        printf("%lu bytes still mapped in %u regions", counters->live_bytes, regions);
+        if (file_bytes) {
+            printf(", %lu of them file backed", file_bytes);
+        }
+        printf("\n\n");
+        st_print_frames(st, ids[i], stdout);
+    }
+    if (length > top) {
+        printf("\n%u more mapping call sites not shown, use -t to show more\n", length - top);
+    }
+    printf("--------------------------------------------------------------\n\n");
+
+    free(ids);
+}
+
+
+void mp_print_summary(mappingTable* mp) {
+    if (!mp || !mp->length) { return; }
+
+    printf("%lu bytes still mapped in %u regions by the program, use -M to see where they come from\n\n",
+           mp->live_bytes, mp->length);
+}
+
+
+/************************************************************************************************************
+ *                                          PRIVATE FUNCTIONS                                               *
+ ***********************************************************************************************************/
+
+
+// Index of the first region ending after start, regions never overlap so ends are sorted too
+static uint32_t _mp_first_overlap(mappingTable* mp, uint64_t start) {
+    uint32_t low = 0;
+    uint32_t high = mp->length;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (mp->regions[middle].end <= start) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+
+static void _mp_remove(mappingTable* mp, uint64_t start, uint64_t end) {
+    uint32_t index = _mp_first_overlap(mp, start);
+
+    while (index < mp->length && mp->regions[index].start < end) {
+        mappedRegion* region = &mp->regions[index];
+
+        if (region->start < start && region->end > end) {
+            // A hole in the middle, the tail becomes a region of its own if there is room for it
+            _mp_count_unmap(mp, region->site_id, region->end - start);
+            if (mp->length < MP_MAX_REGIONS) {
+                memmove(&mp->regions[index + 2], &mp->regions[index + 1],
+                        (mp->length - index - 1) * sizeof(mappedRegion));
+                mp->regions[index + 1] = *region;
+                mp->regions[index + 1].start = end;
+                mp->length++;
+                mp->counters[region->site_id].live_bytes += region->end - end;
+                mp->live_bytes += region->end - end;
+            } else {
+                mp->dropped++;
+            }
+            region->end = start;
+            return;
+        }
+
+        if (region->start < start) {
+            _mp_count_unmap(mp, region->site_id, region->end - start);
+            region->end = start;
+            index++;
+        } else if (region->end > end) {
+            _mp_count_unmap(mp, region->site_id, end - region->start);
+            region->start = end;
+            return;
+        } else {
+            _mp_count_unmap(mp, region->site_id, region->end - region->start);
+            memmove(region, region + 1, (mp->length - index - 1) * sizeof(mappedRegion));
+            mp->length--;
+        }
+    }
+}
+
+
+static void _mp_count_unmap(mappingTable* mp, siteId site_id, uint64_t bytes) {
+    mp->counters[site_id].live_bytes -= bytes;
+    mp->live_bytes -= bytes;
+}
+
+
+static int _mp_compare_peak_bytes(const void* a, const void* b) {
+    const mappingCounters* counters_a = &sorting_table->counters[*(const siteId*)a];
+    const mappingCounters* counters_b = &sorting_table->counters[*(const siteId*)b];
+
+    return (counters_a->peak_live_bytes < counters_b->peak_live_bytes) -
+           (counters_a->peak_live_bytes > counters_b->peak_live_bytes);
+}
@@ -30,29 +30,155 @@
  *
  */
 
+#include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include "hashtable.h"
+#include "callsite.h"
+#include "unwind.h"
+#include "evring.h"
+#include "shmwrap.h"
+#include "sampling.h"
+#include "timestamp.h"
+#include "telemetry.h"
+#include "profile.h"
+#include "trace.h"
+#include "mapping.h"
+#include "resident.h"
 
+// Time memtrace sleeps when the event rings are empty
+#define DRAIN_IDLE_USEC 100
+
+// Sites shown with -s, -l or -m when -t does not say how many
+#define DEFAULT_HOTTEST 10
+
+// Sites on every telemetry line when -t does not say how many
+#define DEFAULT_TELEMETRY_SITES 3
+
+// Longest memtrace sleeps between telemetry samples before checking on the child
+#define TELEMETRY_IDLE_USEC 10000
+
+// Set by SIGUSR1, a heap diff is printed as soon as memtrace gets to it
+static volatile sig_atomic_t diff_requested = 0;
+
+static void request_diff(int signum);
 void print_usage(void);
 void print_ascii_art(void);
 
 int main(int argc, char* argv[]) {
     bool h_opt = false;
     bool s_opt = false;
+    bool a_opt = false;
+    bool p_opt = false;
+    bool H_opt = false;
+    bool l_opt = false;
+    bool m_opt = false;
+    bool M_opt = false;
+    bool R_opt = false;
+    uint32_t hottest = 0;
     bool invalid_opt = false;
     char* executable = NULL;
+    char* depth = NULL;
+    char* unwinder = NULL;
+    uint64_t capacity_hint = 0;
+    char* sample_interval = NULL;
+    uint64_t telemetry_ms = 0;
+    uint64_t diff_ms = 0;
+    char* pprof_path = NULL;
+    char* folded_path = NULL;
+    char* record_path = NULL;
+    profileWeight folded_weight = PF_INUSE;
+    unwindMode unwind_mode;
+    char* end;
 
     print_ascii_art();
 
     int opt;
-    while ((opt = getopt(argc, argv, "sh")) != -1) {
+    while ((opt = getopt(argc, argv, "shaplmMRHd:u:n:i:t:T:D:P:F:w:r:")) != -1) {
         switch (opt) {
             case 's':
                 s_opt = true;
                 break;
+            case 'a':
+                a_opt = true;
+                break;
+            case 'p':
+                p_opt = true;
+                break;
+            case 'l':
+                l_opt = true;
+                break;
+            case 'm':
+                m_opt = true;
+                break;
+            case 'M':
+                M_opt = true;
+                break;
+            case 'R':
+                R_opt = true;
+                break;
+            case 'H':
+                H_opt = true;
+                break;
+            case 'n':
+                capacity_hint = strtoull(optarg, &end, 10);
+                if (*end != '\0') {
+                    invalid_opt = true;
+                }
+                break;
+            case 'd':
+                depth = optarg;
+                if (atoi(depth) < 1 || atoi(depth) > ST_MAX_DEPTH) {
+                    invalid_opt = true;
+                }
+                break;
+            case 'u':
+                unwinder = optarg;
+                if (!uw_parse_mode(unwinder, &unwind_mode)) {
+                    invalid_opt = true;
+                }
+                break;
+            case 'i':
+                sample_interval = optarg;
+                if (strtoull(sample_interval, &end, 10) == 0 || *end != '\0') {
+                    invalid_opt = true;
+                }
+                break;
+            case 't':
+                hottest = strtoul(optarg, &end, 10);
+                if (hottest == 0 || *end != '\0') {
+                    invalid_opt = true;
+                }
+                break;
+            case 'T':
+                telemetry_ms = strtoull(optarg, &end, 10);
+                if (telemetry_ms == 0 || *end != '\0') {
+                    invalid_opt = true;
+                }
+                break;
+            case 'D':
+                diff_ms = strtoull(optarg, &end, 10);
+                if (diff_ms == 0 || *end != '\0') {
+                    invalid_opt = true;
+                }
+                break;
+            case 'P':
+                pprof_path = optarg;
+                break;
+            case 'F':
+                folded_path = optarg;
+                break;
+            case 'r':
+                record_path = optarg;
+                break;
+            case 'w':
+                if (!pf_parse_weight(optarg, &folded_weight)) {
+                    invalid_opt = true;
+                }
+                break;
             case 'h':
                 h_opt = true;
                 break;
@@ -62,18 +188,133 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    // Recorded events go to the trace, the counters telemetry and diffs read never move
+    if (record_path && (telemetry_ms || diff_ms)) {
+        invalid_opt = true;
+    }
+
     if (invalid_opt || h_opt || !(optind < argc)) {
         print_usage();
         exit(0);
     }
 
-    hashTable* ht = ht_create();
+    // Unwinder settings reach the interposer through the child's environment
+    if (depth) {
+        setenv("MEMTRACE_DEPTH", depth, 1);
+    }
+    if (unwinder) {
+        setenv("MEMTRACE_UNWIND", unwinder, 1);
+    }
+    if (sample_interval) {
+        setenv("MEMTRACE_SAMPLE_INTERVAL", sample_interval, 1);
+    }
+
+    if (!shm_create()) {
+        printf("Could not create shared memory region");
+        exit(1);
+    }
+
+    hashTable* ht = ht_create(capacity_hint, H_opt);
 
     if (!ht) {
         printf("Could not start hashtable");
+        shm_destroy();
+        exit(1);
+    }
+
+    ht_set_sample_interval(ht, sample_interval? strtoull(sample_interval, NULL, 10) : 0);
+
+    siteTable* st = st_create();
+
+    if (!st) {
+        printf("Could not start call-site table");
+        ht_destroy(ht);
+        shm_destroy();
+        exit(1);
+    }
+
+    mappingTable* mp = mp_create();
+
+    if (!mp) {
+        printf("Could not start mapping table");
+        ht_destroy(ht);
+        st_destroy(st);
+        shm_destroy();
+        exit(1);
+    }
+
+    eventRings* rings = NULL;
+
+    // Recordings write every event to the trace, there is nothing for the rings to do
+    if (a_opt && !record_path) {
+        rings = er_create();
+        if (!rings) {
+            printf("Could not start event rings");
+            ht_destroy(ht);
+            st_destroy(st);
+            mp_destroy(mp);
+            shm_destroy();
+            exit(1);
+        }
+    }
+
+    trace* recording = NULL;
+
+    if (record_path) {
+        recording = tr_create(record_path, ht_sample_interval(ht));
+        if (!recording) {
+            printf("Could not create trace file %s\n", record_path);
+            ht_destroy(ht);
+            st_destroy(st);
+            mp_destroy(mp);
+            er_destroy(rings);
+            shm_destroy();
+            exit(1);
+        }
+    }
+
+    residentTable* residents = NULL;
+
+    // Measured by the child from its own table, only there in synchronous mode
+    if (R_opt && !rings && !recording) {
+        residents = rs_create();
+        if (!residents) {
+            printf("Could not start resident table");
+            ht_destroy(ht);
+            st_destroy(st);
+            mp_destroy(mp);
+            tr_destroy(recording);
+            shm_destroy();
+            exit(1);
+        }
+    } else if (R_opt) {
+        printf("Resident memory is only measured in synchronous mode without -r\n\n");
+    }
+
+    // Lifetimes are measured in ts_now() ticks, the whole run calibrates them
+    const uint64_t start_ticks = ts_now();
+    const uint64_t start_ns = ts_monotonic_ns();
+
+    // Always there, heap diffs can be requested with SIGUSR1 at any time
+    telemetry* tm = tm_create(st, hottest? hottest : DEFAULT_TELEMETRY_SITES, stderr, start_ns);
+
+    if (!tm) {
+        printf("Could not start telemetry");
+        ht_destroy(ht);
+        st_destroy(st);
+        mp_destroy(mp);
+        rs_destroy(residents);
+        er_destroy(rings);
+        tr_destroy(recording);
+        shm_destroy();
         exit(1);
     }
 
+    // No SA_RESTART, the signal has to wake up the blocking waitpid below. Recordings have no diffs to print
+    struct sigaction action = {.sa_handler = recording? SIG_IGN : request_diff};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+
     pid_t pid = fork();
 
     if (pid == 0) {
@@ -83,9 +324,97 @@ int main(int argc, char* argv[]) {
         exit(1);
     } else if (pid > 0) {
         int status;
-        waitpid(pid, &status, 0);
-        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
-            ht_print_debug(ht, s_opt);
+        if (rings || telemetry_ms || diff_ms) {
+            // Keep the table up to date and report on it while the child runs
+            const uint64_t telemetry_ns = telemetry_ms * 1000000;
+            const uint64_t diff_ns = diff_ms * 1000000;
+            uint64_t next_sample_ns = telemetry_ns? start_ns + telemetry_ns : UINT64_MAX;
+            uint64_t next_diff_ns = diff_ns? start_ns + diff_ns : UINT64_MAX;
+            while (waitpid(pid, &status, WNOHANG) == 0) {
+                if (rings && er_drain(rings, ht, st)) {
+                    continue;
+                }
+
+                uint64_t now_ns = ts_monotonic_ns();
+                if (now_ns >= next_sample_ns) {
+                    tm_sample(tm, now_ns);
+                    // Samples that could not be taken in time are skipped, not bunched up
+                    next_sample_ns += telemetry_ns;
+                    if (next_sample_ns <= now_ns) {
+                        next_sample_ns = now_ns + telemetry_ns;
+                    }
+                    continue;
+                }
+                if (diff_requested || now_ns >= next_diff_ns) {
+                    diff_requested = 0;
+                    tm_diff(tm, now_ns);
+                    if (now_ns >= next_diff_ns) {
+                        next_diff_ns += diff_ns;
+                        if (next_diff_ns <= now_ns) {
+                            next_diff_ns = now_ns + diff_ns;
+                        }
+                    }
+                    continue;
+                }
+
+                uint64_t next_ns = next_sample_ns < next_diff_ns? next_sample_ns : next_diff_ns;
+                uint64_t idle_usec = rings? DRAIN_IDLE_USEC : (next_ns - now_ns) / 1000;
+                usleep(idle_usec < TELEMETRY_IDLE_USEC? idle_usec : TELEMETRY_IDLE_USEC);
+            }
+            while (rings && er_drain(rings, ht, st));
+            if (telemetry_ms) {
+                tm_sample(tm, ts_monotonic_ns());
+            }
+        } else {
+            // Only SIGUSR1 interrupts the wait, print the diff it asked for and go back to waiting
+            while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+                if (diff_requested) {
+                    diff_requested = 0;
+                    tm_diff(tm, ts_monotonic_ns());
+                }
+            }
+        }
+        const uint64_t elapsed_ns = ts_monotonic_ns() - start_ns;
+        const double ticks_per_ns = elapsed_ns? (double)(ts_now() - start_ticks) / elapsed_ns : 1.0;
+
+        // Traces are worth completing even if the process crashed, they hold everything up to the crash
+        if (recording) {
+            if (tr_finish(recording, st, ticks_per_ns, elapsed_ns)) {
+                printf("Recorded %lu events to %s", tr_events(recording), record_path);
+                if (tr_dropped(recording)) {
+                    printf(", %lu dropped once the file could not grow", tr_dropped(recording));
+                }
+                printf("\nAnalyze it with memtrace-analyze %s\n\n", record_path);
+            } else {
+                printf("Could not complete trace file %s\n", record_path);
+            }
+        }
+
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0 && !recording) {
+            ht_print_debug(ht, st, s_opt, hottest? hottest : DEFAULT_HOTTEST);
+            if (M_opt) {
+                mp_print(mp, st, hottest? hottest : DEFAULT_HOTTEST);
+            } else {
+                mp_print_summary(mp);
+            }
+            if (residents) {
+                rs_print(residents, st, hottest? hottest : DEFAULT_HOTTEST);
+            }
+            if (hottest || l_opt) {
+                st_print_hottest(st, hottest? hottest : DEFAULT_HOTTEST, l_opt? ticks_per_ns : 0);
+            }
+            if (m_opt) {
+                st_print_peak(st, hottest? hottest : DEFAULT_HOTTEST);
+            }
+            if (p_opt) {
+                ht_print_stats(ht);
+            }
+            if (pprof_path && !pf_save_pprof(st, pprof_path, elapsed_ns, ht_sample_interval(ht))) {
+                printf("Could not write pprof profile to %s\n", pprof_path);
+            }
+            if (folded_path && !pf_save_folded(st, folded_path, folded_weight)) {
+                printf("Could not write folded stacks to %s\n", folded_path);
+            }
         } else if (WIFSIGNALED(status)) {
             printf("executable process terminated due to signal %d\n", WTERMSIG(status));
         }
@@ -95,11 +424,24 @@ int main(int argc, char* argv[]) {
     }
 
     ht_destroy(ht);
+    st_destroy(st);
+    mp_destroy(mp);
+    rs_destroy(residents);
+    er_destroy(rings);
+    tm_destroy(tm);
+    tr_destroy(recording);
+    shm_destroy();
 
     return 0;
 }
 
 
+static void request_diff(int signum) {
+    (void)signum;
+    diff_requested = 1;
+}
+
+
 void print_ascii_art(void) {
     // Looks crooked but prints properly
     printf("                          _                       \n");
@@ -113,7 +455,25 @@ void print_ascii_art(void) {
 void print_usage(void) {
     printf("Usage: memtrace <executable> <option(s)>\n");
     printf("  Find lib C memory leaks in <executable>\n");
-    printf("  -s, Display Stack traces for leaks\n");
+    printf("  -s, Display the call sites leaking the most bytes with their stack traces (default %d sites)\n", DEFAULT_HOTTEST);
+    printf("  -a, Asynchronous mode, memtrace builds the table from per-thread event rings\n");
+    printf("  -t <n>, Display the <n> call sites allocating most often, also sets the sites shown by -s, -l, -m, -M and -R\n");
+    printf("  -l, Display allocation lifetime histograms of the hottest call sites (default %d sites)\n", DEFAULT_HOTTEST);
+    printf("  -m, Display the call sites holding the heap at its peak (default %d sites)\n", DEFAULT_HOTTEST);
+    printf("  -M, Display the call sites mapping the most memory with mmap, mremap or brk (default %d sites)\n", DEFAULT_HOTTEST);
+    printf("  -R, Display the call sites holding the most resident memory when the program exits (default %d sites)\n", DEFAULT_HOTTEST);
+    printf("  -T <ms>, Print live heap telemetry to stderr every <ms> milliseconds while running, not with -r\n");
+    printf("  -D <ms>, Print a heap diff to stderr every <ms> milliseconds, SIGUSR1 prints one at any time, not with -r\n");
+    printf("  -P <file>, Write a pprof profile of allocated, in use and peak memory per call site to <file>\n");
+    printf("  -F <file>, Write folded stacks for flamegraphs to <file>\n");
+    printf("  -w <inuse|peak|alloc>, Bytes the folded stacks are weighted by (default inuse)\n");
+    printf("  -p, Display hashtable probe length statistics\n");
+    printf("  -d <depth>, Stack trace depth, 1 to %d (default %d)\n", ST_MAX_DEPTH, UW_DEFAULT_DEPTH);
+    printf("  -u <dwarf|fp>, Stack unwinder, fp needs -fno-omit-frame-pointer (default dwarf)\n");
+    printf("  -i <bytes>, Sample allocations every <bytes> on average, e.g. %d, reports are estimates\n", SP_DEFAULT_INTERVAL);
+    printf("  -r <file>, Record every allocation and free to <file> for memtrace-analyze instead of reporting\n");
+    printf("  -n <count>, Size the table up front for <count> live allocations\n");
+    printf("  -H, Back the table with huge pages when available\n");
     printf("  -h, Display this information\n");
 }
 
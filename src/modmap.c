@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2024 Alejandro Cadarso
+ *
+ * This file is part of Memtrace.
+ *
+ * Memtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Memtrace.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * File: modmap.c
+ * Author: Alejandro Cadarso
+ * Date: 17-10-2026
+ *
+ * This file provides the implementation of the module map. Snapshots are
+ * taken inside the traced process from /proc/self/maps using plain
+ * syscalls, since they run from within intercepted allocations and must
+ * not allocate themselves. Formatting happens in the parent process.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "modmap.h"
+
+#define MM_READ_CHUNK 4096
+#define MM_MAX_LINE 512
+
+
+typedef struct mappingQuery {
+    uintptr_t address;
+    uintptr_t start;
+    uintptr_t end;
+    bool found;
+} mappingQuery;
+
+static bool _mm_read_maps(void (*on_line)(const char* line, void* ctx), void* ctx);
+static void _mm_parse_line(const char* line, void* ctx);
+static void _mm_query_line(const char* line, void* ctx);
+static const char* _parse_hex(const char* str, uintptr_t* value);
+
+
+/************************************************************************************************************
+ *                                          PUBLIC FUNCTIONS                                                *
+ ***********************************************************************************************************/
+
+
+void mm_init(moduleMap* mm) {
+    mm->length = 0;
+}
+
+
+bool mm_snapshot(moduleMap* mm) {
+    return _mm_read_maps(_mm_parse_line, mm);
+}
+
+
+bool mm_mapping_of(uintptr_t address, uintptr_t* start, uintptr_t* end) {
+    mappingQuery query = {
+        .address = address,
+        .found = false
+    };
+
+    if (!_mm_read_maps(_mm_query_line, &query) || !query.found) {
+        return false;
+    }
+
+    *start = query.start;
+    *end = query.end;
+
+    return true;
+}
+
+
+bool mm_covers(const moduleMap* mm, void* const* frames, uint32_t depth) {
+    for (uint32_t i = 0; i < depth; i++) {
+        if (!mm_find(mm, (uintptr_t)frames[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+const moduleInfo* mm_find(const moduleMap* mm, uintptr_t pc) {
+    // Latest snapshots first, an address range may have been reused by dlopen
+    for (int i = mm->length - 1; i >= 0; i--) {
+        const moduleInfo* module = &mm->modules[i];
+        if (pc >= module->start && pc < module->end) {
+            return module;
+        }
+    }
+
+    return NULL;
+}
+
+
+int mm_format(const moduleMap* mm, uintptr_t pc, char* buffer, size_t size) {
+    const moduleInfo* module = mm_find(mm, pc);
+    if (!module) {
+        return snprintf(buffer, size, "?? [%#lx]", pc);
+    }
+
+    return snprintf(buffer, size, "%s(+%#lx) [%#lx]",
+                    module->path, pc - module->start + module->offset, pc);
+}
+
+
+/************************************************************************************************************
+ *                                          PRIVATE FUNCTIONS                                               *
+ ***********************************************************************************************************/
+
+
+static bool _mm_read_maps(void (*on_line)(const char* line, void* ctx), void* ctx) {
+    int fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    char chunk[MM_READ_CHUNK];
+    char line[MM_MAX_LINE];
+    size_t line_length = 0;
+
+    ssize_t bytes;
+    while ((bytes = read(fd, chunk, sizeof(chunk))) > 0) {
+        for (ssize_t i = 0; i < bytes; i++) {
+            if (chunk[i] == '\n') {
+                line[line_length] = '\0';
+                on_line(line, ctx);
+                line_length = 0;
+            } else if (line_length < MM_MAX_LINE - 1) {
+                // Overlong lines are truncated, only the path tail is lost
+                line[line_length++] = chunk[i];
+            }
+        }
+    }
+
+    close(fd);
+
+    return bytes == 0;
+}
+
+
+static void _mm_parse_line(const char* line, void* ctx) {
+    // start-end perms offset dev inode path
+    moduleMap* mm = ctx;
+    uintptr_t start, end, offset;
+
+    line = _parse_hex(line, &start);
+    if (*line != '-') { return; }
+    line = _parse_hex(line + 1, &end);
+    if (*line != ' ') { return; }
+    line++;
+
+    if (strlen(line) < 5 || line[2] != 'x') { return; }
+    line += 5;
+
+    line = _parse_hex(line, &offset);
+
+    // Skip dev and inode
+    for (int field = 0; field < 2; field++) {
+        while (*line == ' ') { line++; }
+        while (*line && *line != ' ') { line++; }
+    }
+    while (*line == ' ') { line++; }
+
+    for (uint32_t i = 0; i < mm->length; i++) {
+        const moduleInfo* module = &mm->modules[i];
+        if (module->start == start && module->end == end && strcmp(module->path, line) == 0) {
+            return;
+        }
+    }
+
+    if (mm->length >= MM_MAX_MODULES) { return; }
+
+    moduleInfo* module = &mm->modules[mm->length];
+    module->start = start;
+    module->end = end;
+    module->offset = offset;
+    strncpy(module->path, line, MM_MAX_PATH - 1);
+    module->path[MM_MAX_PATH - 1] = '\0';
+
+    mm->length++;
+}
+
+
+static void _mm_query_line(const char* line, void* ctx) {
+    mappingQuery* query = ctx;
+    uintptr_t start, end;
+
+    line = _parse_hex(line, &start);
+    if (*line != '-') { return; }
+    _parse_hex(line + 1, &end);
+
+    if (query->address >= start && query->address < end) {
+        query->start = start;
+        query->end = end;
+        query->found = true;
+    }
+}
+
+
+static const char* _parse_hex(const char* str, uintptr_t* value) {
+    uintptr_t result = 0;
+    for (;; str++) {
+        if (*str >= '0' && *str <= '9') {
+            result = (result << 4) | (*str - '0');
+        } else if (*str >= 'a' && *str <= 'f') {
+            result = (result << 4) | (*str - 'a' + 10);
+        } else {
+            break;
+        }
+    }
+    *value = result;
+
+    return str;
+}
@@ -22,50 +22,174 @@
  *
  * This file implements a shared library for the Memtrace memory profiling tool.
  * It intercepts standard library memory allocation and deallocation functions
- * (`malloc`, `calloc`, `realloc`, `free`) using dynamic linking to track
- * memory operations performed by the target application. The interception
+ * (`malloc`, `calloc`, `realloc`, `free`, the aligned allocators and
+ * `reallocarray`) and the C++ `operator new` and `operator delete`
+ * overloads using dynamic linking to track
+ * memory operations performed by the target application. The regions the
+ * program maps itself with `mmap`, `mremap`, `brk` and `sbrk` go to the
+ * mapping table, libc's own mappings don't go through these symbols. The interception
  * mechanism ensures that every memory operation is recorded in a shared
  * memory hash table, allowing the parent process to collect and analyze memory
- * profiles.
+ * profiles. libc symbols are resolved and the shared tables attached once,
+ * from a constructor, so the steady state intercept only checks a
+ * per-thread reentrancy guard before recording.
  *
  */
 
 #ifdef RUNTIME
 #define _GNU_SOURCE
-#include <execinfo.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdarg.h>
 #include <dlfcn.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/ipc.h>
-#include <sys/shm.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include "hashtable.h"
+#include "callsite.h"
+#include "mapping.h"
+#include "resident.h"
+#include "unwind.h"
+#include "evring.h"
+#include "trace.h"
+#include "timestamp.h"
+#include "sampling.h"
 #include "shmwrap.h"
 
 
-// Pointers to stdlib functions
+// Pointers to stdlib functions, resolved once by _bootstrap
 static void* (*libc_malloc)(size_t size);
 static void* (*libc_calloc)(size_t num_elements, size_t element_size);
 static void* (*libc_realloc)(void* ptr, size_t new_size);
 static void  (*libc_free)(void*);
+static int   (*libc_posix_memalign)(void** memptr, size_t alignment, size_t size);
+static void* (*libc_aligned_alloc)(size_t alignment, size_t size);
+static void* (*libc_memalign)(size_t alignment, size_t size);
+static void* (*libc_valloc)(size_t size);
+static void* (*libc_pvalloc)(size_t size);
+static void* (*libc_reallocarray)(void* ptr, size_t num_elements, size_t element_size);
+static void* (*libc_mmap)(void* addr, size_t length, int prot, int flags, int fd, off_t offset);
+static void* (*libc_mmap64)(void* addr, size_t length, int prot, int flags, int fd, off64_t offset);
+static int   (*libc_munmap)(void* addr, size_t length);
+static void* (*libc_mremap)(void* old_address, size_t old_size, size_t new_size, int flags, ...);
+static int   (*libc_brk)(void* addr);
+static void* (*libc_sbrk)(intptr_t increment);
 
 
-// Intercept flags needed to prevent recursive interceptions
-static uint8_t intercept_flags =    0x0F;
-#define FIRST_MALLOC_INTERCEPT      0X01 // 0000 0001
-#define FIRST_CALLOC_INTERCEPT      0X02 // 0000 0010
-#define FIRST_REALLOC_INTERCEPT     0X04 // 0000 0100
-#define FIRST_FREE_INTERCEPT        0X08 // 0000 1000
+/**
+ * Per-thread reentrancy guard, set while an intercepted call is being recorded
+ * so allocations made by the tracker itself (unwinder, dlsym...) pass through.
+ * initial-exec keeps each access a single TLS load, it never calls into ld.so
+ */
+static __thread bool in_intercept __attribute__((tls_model("initial-exec")));
+
+
+#define BOOTSTRAP_NONE 0
+#define BOOTSTRAP_RUNNING 1
+#define BOOTSTRAP_DONE 2
+
+static int bootstrap_state = BOOTSTRAP_NONE;
+
+// Only true when running under memtrace and both tables could be attached
+static bool tracking = false;
+
+// Shared tables, attached once per process
+static hashTable* ht;
+static siteTable* site_table;
+
+// Regions mapped by the program, NULL if the parent did not create the table
+static mappingTable* mappings;
+
+// Only set when memtrace asked for resident memory to be measured at exit
+static residentTable* residents;
+
+// Mapped lengths are rounded up to whole pages like the kernel does
+static size_t page_size = 4096;
+
+// Only set in async mode, events are pushed instead of updating the table
+static eventRings* rings;
+
+// Only set in recording mode, events are written to the trace file and nothing else is updated
+static trace* recording;
+
+// Mean bytes between sampled allocations, 0 records every allocation
+static uint64_t sample_interval = 0;
+
+/**
+ * Counts of sampled blocks in the table per address hash, only kept when
+ * sampling in synchronous mode. A free hashing to a zero count can't be of
+ * a sampled block and skips the table, most frees are of unsampled blocks.
+ * Counts are only dropped when an entry is really removed, so collisions
+ * make misses slower, never wrong
+ */
+#define SAMPLED_FILTER_BITS 15
+static uint16_t* sampled_filter;
+
+#define SAMPLED_FILTER_SLOT(ptr) \
+    (((uint64_t)(uintptr_t)(ptr) >> 4) * 0x9E3779B97F4A7C15ULL >> (64 - SAMPLED_FILTER_BITS))
+
+/**
+ * Per-thread sampling state, bytes left until the next sample point and the
+ * generator drawing the distances. A zero state marks a thread not seeded yet
+ */
+static __thread int64_t bytes_until_sample __attribute__((tls_model("initial-exec")));
+static __thread uint64_t sample_state __attribute__((tls_model("initial-exec")));
 
 
-#define GET_HT_SHMID atoi(getenv("HT_SHMID"))
+/**
+ * dlsym may allocate before the libc functions are known, those allocations
+ * are served from this arena and are never freed. Each block is preceded by
+ * its size so realloc can move it out of the arena
+ */
+#define BOOTSTRAP_ARENA_SIZE (64 * 1024)
+#define BOOTSTRAP_HEADER 16
+
+static char bootstrap_arena[BOOTSTRAP_ARENA_SIZE] __attribute__((aligned(BOOTSTRAP_HEADER)));
+static size_t bootstrap_arena_used = 0;
+
+#define IS_BOOTSTRAP_PTR(ptr) \
+    ((char*)(ptr) >= bootstrap_arena && (char*)(ptr) < bootstrap_arena + BOOTSTRAP_ARENA_SIZE)
+
+
+/**
+ * A block whose entry was taken out of the table before libc got to release
+ * it, realloc only knows whether it really was released once libc returns
+ */
+typedef struct detachedBlock {
+    // ts_now() before libc was called, a reused address can only be allocated after it
+    uint64_t timestamp;
+    bool tracked;
+    allocInfo info;
+} detachedBlock;
 
 
+// Frames of the interposer above the caller, _record_alloc and the intercepted function
 #define BT_OFFSET 2
 
-void _add_trace_symbols(allocInfo* trace);
+static void _bootstrap(void) __attribute__((constructor));
+static void _measure_resident(void) __attribute__((destructor));
+static void* _resolve(const char* symbol);
+static void* _bootstrap_alloc(size_t size);
+static void* _bootstrap_aligned_alloc(size_t alignment, size_t size);
+static inline void _track_alloc(void* ptr, size_t size) __attribute__((always_inline));
+static inline void* _new(size_t size, size_t alignment) __attribute__((always_inline));
+static void* _new_failed(const char* symbol, size_t size, size_t alignment, const void* nothrow);
+static inline void _delete(void* ptr) __attribute__((always_inline));
+static inline void* _map(void* (*libc_map)(void*, size_t, int, int, int, off_t), void* addr, size_t length, int prot,
+                         int flags, int fd, off_t offset) __attribute__((always_inline));
+static inline void _track_break(void* old_break, void* new_break) __attribute__((always_inline));
+static void _record_mapping(void* ptr, size_t length, regionKind kind) __attribute__((noinline));
+static void _record_alloc(void* ptr, size_t size) __attribute__((noinline));
+static void _record_free(void* ptr);
+static void _detach(void* ptr, detachedBlock* block);
+static void _settle(void* ptr, const detachedBlock* block, bool freed);
+static inline bool _sampled(size_t size) __attribute__((always_inline));
+static inline bool _maybe_sampled(void* ptr) __attribute__((always_inline));
+static bool _sampled_slow(void) __attribute__((noinline));
 
 /**
  * If ht functions fail then exit(1) and parent process
@@ -73,183 +197,813 @@ void _add_trace_symbols(allocInfo* trace);
  */
 
 void* malloc(size_t size) {
-    if (intercept_flags & FIRST_MALLOC_INTERCEPT) {
-        libc_malloc = dlsym(RTLD_NEXT, "malloc");
-        char* error;
-        if ((error = dlerror()) != NULL) {
-            fputs(error, stderr);
-            exit(1);
+    if (!libc_malloc) {
+        if (bootstrap_state == BOOTSTRAP_RUNNING) {
+            return _bootstrap_alloc(size);
         }
+        _bootstrap();
+    }
 
-        intercept_flags &= ~FIRST_MALLOC_INTERCEPT;
+    if (!tracking || in_intercept) {
+        return libc_malloc(size);
+    }
 
-        void* ptr = libc_malloc(size);
-        if (!ptr) {
-            return NULL;
-        }
+    in_intercept = true;
+
+    void* ptr = libc_malloc(size);
+    if (ptr && _sampled(size)) {
+        _record_alloc(ptr, size);
+    }
 
-        hashTable* ht = shmload(GET_HT_SHMID);
-        allocInfo trace = {
-            .block_size = size,
-        };
-        _add_trace_symbols(&trace);
+    in_intercept = false;
 
-        if (!ht_insert(ht, (size_t)ptr, trace)) {
-            fputs("Unrecoverable error: HashTable | Shared Memory Failure\n", stderr);
-            exit(1);
+    return ptr;
+}
+
+void* calloc(size_t num_elements, size_t element_size) {
+    if (!libc_calloc) {
+        if (bootstrap_state == BOOTSTRAP_RUNNING) {
+            // The arena is static storage, already zeroed
+            return _bootstrap_alloc(num_elements * element_size);
         }
+        _bootstrap();
+    }
+
+    if (!tracking || in_intercept) {
+        return libc_calloc(num_elements, element_size);
+    }
 
-        intercept_flags |= FIRST_MALLOC_INTERCEPT;
+    in_intercept = true;
 
-        return ptr;
+    void* ptr = libc_calloc(num_elements, element_size);
+    if (ptr && _sampled(num_elements * element_size)) {
+        _record_alloc(ptr, num_elements * element_size);
     }
 
-    void* ptr = libc_malloc(size);
+    in_intercept = false;
 
     return ptr;
 }
 
-void* calloc(size_t num_elements, size_t element_size) {
-    if (intercept_flags & FIRST_CALLOC_INTERCEPT) {
-        libc_calloc = dlsym(RTLD_NEXT, "calloc");
-        char* error;
-        if ((error = dlerror()) != NULL) {
-            fputs(error, stderr);
-            exit(1);
+void* realloc(void* ptr, size_t new_size) {
+    if (IS_BOOTSTRAP_PTR(ptr)) {
+        size_t old_size = *(size_t*)((char*)ptr - BOOTSTRAP_HEADER);
+        void* new_ptr = malloc(new_size);
+        if (new_ptr) {
+            memcpy(new_ptr, ptr, old_size < new_size? old_size : new_size);
         }
+        return new_ptr;
+    }
 
-        intercept_flags &= ~FIRST_CALLOC_INTERCEPT;
-        void* ptr = libc_calloc(num_elements, element_size);
-        if (!ptr) {
-            return NULL;
+    if (!libc_realloc) {
+        if (bootstrap_state == BOOTSTRAP_RUNNING) {
+            return _bootstrap_alloc(new_size);
         }
+        _bootstrap();
+    }
+
+    if (!tracking || in_intercept) {
+        return libc_realloc(ptr, new_size);
+    }
 
-        hashTable* ht = shmload(GET_HT_SHMID);
+    in_intercept = true;
 
-        allocInfo trace = {
-            .block_size = num_elements * element_size,
-        };
-        _add_trace_symbols(&trace);
+    /**
+     * The old block is released before libc_realloc returns, its entry goes
+     * first so another thread reusing the address can't have its entry deleted.
+     * The free is only charged once libc_realloc tells whether it happened
+     */
+    detachedBlock old_block;
+    if (ptr) {
+        _detach(ptr, &old_block);
+    }
 
-        if (!ht_insert(ht, (size_t)ptr, trace)) {
-            fputs("Unrecoverable error: HashTable | Shared Memory Failure\n", stderr);
-            exit(1);
+    void* new_ptr = libc_realloc(ptr, new_size);
+    if (ptr) {
+        _settle(ptr, &old_block, new_ptr || !new_size);
+    }
+    if (new_ptr && _sampled(new_size)) {
+        _record_alloc(new_ptr, new_size);
+    }
+
+    in_intercept = false;
+
+    return new_ptr;
+}
+
+void free(void* ptr) {
+    if (!ptr || IS_BOOTSTRAP_PTR(ptr)) { return; }
+
+    if (!libc_free) {
+        _bootstrap();
+    }
+
+    if (tracking && !in_intercept && _maybe_sampled(ptr)) {
+        in_intercept = true;
+        _record_free(ptr);
+        in_intercept = false;
+    }
+
+    libc_free(ptr);
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size) {
+    if (!libc_posix_memalign) {
+        if (bootstrap_state == BOOTSTRAP_RUNNING) {
+            *memptr = _bootstrap_aligned_alloc(alignment, size);
+            return *memptr? 0 : ENOMEM;
         }
+        _bootstrap();
+    }
+
+    if (!tracking || in_intercept) {
+        return libc_posix_memalign(memptr, alignment, size);
+    }
+
+    in_intercept = true;
 
-        intercept_flags |= FIRST_CALLOC_INTERCEPT;
+    int result = libc_posix_memalign(memptr, alignment, size);
+    _track_alloc(result == 0? *memptr : NULL, size);
 
-        return ptr;
+    in_intercept = false;
+
+    return result;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    if (!libc_aligned_alloc) {
+        if (bootstrap_state == BOOTSTRAP_RUNNING) {
+            return _bootstrap_aligned_alloc(alignment, size);
+        }
+        _bootstrap();
     }
 
-    void* ptr = libc_calloc(num_elements, element_size);
+    if (!tracking || in_intercept) {
+        return libc_aligned_alloc(alignment, size);
+    }
+
+    in_intercept = true;
+
+    void* ptr = libc_aligned_alloc(alignment, size);
+    _track_alloc(ptr, size);
+
+    in_intercept = false;
 
     return ptr;
 }
 
-void* realloc(void* ptr, size_t new_size) {
-    if (intercept_flags & FIRST_REALLOC_INTERCEPT) {
-        libc_realloc = dlsym(RTLD_NEXT, "realloc");
-        char* error;
-        if ((error = dlerror()) != NULL) {
-            fputs(error, stderr);
-            exit(1);
+void* memalign(size_t alignment, size_t size) {
+    if (!libc_memalign) {
+        if (bootstrap_state == BOOTSTRAP_RUNNING) {
+            return _bootstrap_aligned_alloc(alignment, size);
         }
+        _bootstrap();
+    }
+
+    if (!tracking || in_intercept) {
+        return libc_memalign(alignment, size);
+    }
+
+    in_intercept = true;
+
+    void* ptr = libc_memalign(alignment, size);
+    _track_alloc(ptr, size);
+
+    in_intercept = false;
+
+    return ptr;
+}
 
-        intercept_flags &= ~FIRST_REALLOC_INTERCEPT;
-        void* new_ptr = libc_realloc(ptr, new_size);
-        if (!new_ptr) {
+void* valloc(size_t size) {
+    if (!libc_valloc) {
+        if (bootstrap_state == BOOTSTRAP_RUNNING) {
             return NULL;
         }
+        _bootstrap();
+    }
 
-        hashTable* ht = shmload(GET_HT_SHMID);
+    if (!tracking || in_intercept) {
+        return libc_valloc(size);
+    }
 
-        allocInfo trace = {
-            .block_size = new_size,
-        };
-        _add_trace_symbols(&trace);
+    in_intercept = true;
 
-        if (!ht_delete(ht, (size_t)ptr) || !ht_insert(ht, (size_t)ptr, trace)) {
-            fputs("Unrecoverable error: HashTable | Shared Memory Failure\n", stderr);
-            exit(1);
+    void* ptr = libc_valloc(size);
+    _track_alloc(ptr, size);
+
+    in_intercept = false;
+
+    return ptr;
+}
+
+void* pvalloc(size_t size) {
+    if (!libc_pvalloc) {
+        if (bootstrap_state == BOOTSTRAP_RUNNING) {
+            return NULL;
         }
+        _bootstrap();
+    }
 
-        intercept_flags |= FIRST_REALLOC_INTERCEPT;
+    if (!tracking || in_intercept) {
+        return libc_pvalloc(size);
+    }
 
-        return new_ptr;
+    in_intercept = true;
+
+    // The block is rounded up to whole pages, the program still asked for size bytes
+    void* ptr = libc_pvalloc(size);
+    _track_alloc(ptr, size);
+
+    in_intercept = false;
+
+    return ptr;
+}
+
+void* reallocarray(void* ptr, size_t num_elements, size_t element_size) {
+    size_t new_size;
+    if (IS_BOOTSTRAP_PTR(ptr) || !libc_reallocarray) {
+        // Overflow fails like libc would, everything else is a plain realloc
+        if (__builtin_mul_overflow(num_elements, element_size, &new_size)) {
+            return NULL;
+        }
+        return realloc(ptr, new_size);
     }
 
-    void* new_ptr = libc_realloc(ptr, new_size);
+    if (!tracking || in_intercept) {
+        return libc_reallocarray(ptr, num_elements, element_size);
+    }
+
+    // Same as realloc, but libc must reject an overflowing size before the old block is released
+    if (__builtin_mul_overflow(num_elements, element_size, &new_size)) {
+        return libc_reallocarray(ptr, num_elements, element_size);
+    }
+
+    in_intercept = true;
+
+    detachedBlock old_block;
+    if (ptr) {
+        _detach(ptr, &old_block);
+    }
+
+    void* new_ptr = libc_reallocarray(ptr, num_elements, element_size);
+    if (ptr) {
+        _settle(ptr, &old_block, new_ptr || !new_size);
+    }
+    _track_alloc(new_ptr, new_size);
+
+    in_intercept = false;
 
     return new_ptr;
 }
 
-void free(void* ptr) {
-    if (!ptr) { return; }
+void* mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    if (!libc_mmap) {
+        if (bootstrap_state == BOOTSTRAP_RUNNING) {
+            return (void*)syscall(SYS_mmap, addr, length, prot, flags, fd, offset);
+        }
+        _bootstrap();
+    }
 
-    if (intercept_flags & FIRST_FREE_INTERCEPT) {
-        libc_free = dlsym(RTLD_NEXT, "free");
-        char* error;
-        if ((error = dlerror()) != NULL) {
-            fputs(error, stderr);
-            exit(1);
+    return _map(libc_mmap, addr, length, prot, flags, fd, offset);
+}
+
+void* mmap64(void* addr, size_t length, int prot, int flags, int fd, off64_t offset) {
+    if (!libc_mmap64) {
+        if (bootstrap_state == BOOTSTRAP_RUNNING) {
+            return (void*)syscall(SYS_mmap, addr, length, prot, flags, fd, offset);
         }
+        _bootstrap();
+    }
 
-        intercept_flags &= ~FIRST_FREE_INTERCEPT;
+    return _map(libc_mmap64, addr, length, prot, flags, fd, offset);
+}
 
-        hashTable* ht = shmload(GET_HT_SHMID);
+int munmap(void* addr, size_t length) {
+    if (!libc_munmap) {
+        if (bootstrap_state == BOOTSTRAP_RUNNING) {
+            return syscall(SYS_munmap, addr, length);
+        }
+        _bootstrap();
+    }
 
-        if (!ht_delete(ht, (size_t)ptr)) {
-            fputs("Unrecoverable error: HashTable | Shared Memory Failure\n", stderr);
-            fputs("Error at free\n", stderr);
-            exit(1);
+    // Forgotten first, another thread may get the range mapped again as soon as it is released
+    if (tracking && mappings && !in_intercept) {
+        in_intercept = true;
+        mp_unmap(mappings, (uint64_t)addr, (length + page_size - 1) & ~(page_size - 1));
+        in_intercept = false;
+    }
+
+    return libc_munmap(addr, length);
+}
+
+void* mremap(void* old_address, size_t old_size, size_t new_size, int flags, ...) {
+    void* new_address = NULL;
+    if (flags & MREMAP_FIXED) {
+        va_list args;
+        va_start(args, flags);
+        new_address = va_arg(args, void*);
+        va_end(args);
+    }
+
+    if (!libc_mremap) {
+        if (bootstrap_state == BOOTSTRAP_RUNNING) {
+            return (void*)syscall(SYS_mremap, old_address, old_size, new_size, flags, new_address);
         }
+        _bootstrap();
+    }
 
-        intercept_flags |= FIRST_FREE_INTERCEPT;
+    if (!tracking || !mappings || in_intercept) {
+        return libc_mremap(old_address, old_size, new_size, flags, new_address);
     }
 
-    libc_free(ptr);
+    in_intercept = true;
+
+    // Like realloc, the region is charged to whoever resized it last
+    mappedRegion region;
+    regionKind kind = mp_region_at(mappings, (uint64_t)old_address, &region)? region.kind : MP_ANONYMOUS;
+#ifdef MREMAP_DONTUNMAP
+    bool keeps_old = flags & MREMAP_DONTUNMAP;
+#else
+    bool keeps_old = false;
+#endif
+
+    // Failed remaps leave the old region, and its entry, untouched
+    void* ptr = libc_mremap(old_address, old_size, new_size, flags, new_address);
+    if (ptr != MAP_FAILED) {
+        if (!keeps_old) {
+            mp_unmap(mappings, (uint64_t)old_address, (old_size + page_size - 1) & ~(page_size - 1));
+        }
+        _record_mapping(ptr, new_size, kind);
+    }
+
+    in_intercept = false;
+
+    return ptr;
 }
 
-void* _no_intercept_calloc(size_t num_elements, size_t element_size) {
-    libc_calloc = dlsym(RTLD_NEXT, "calloc");
+int brk(void* addr) {
+    if (!libc_brk) {
+        if (bootstrap_state == BOOTSTRAP_RUNNING) {
+            return syscall(SYS_brk, addr) == (long)addr? 0 : -1;
+        }
+        _bootstrap();
+    }
+
+    if (!tracking || !mappings || in_intercept) {
+        return libc_brk(addr);
+    }
+
+    in_intercept = true;
+
+    void* old_break = libc_sbrk(0);
+    int result = libc_brk(addr);
+    if (result == 0) {
+        _track_break(old_break, addr);
+    }
+
+    in_intercept = false;
+
+    return result;
+}
+
+void* sbrk(intptr_t increment) {
+    if (!libc_sbrk) {
+        if (bootstrap_state == BOOTSTRAP_RUNNING) {
+            return (void*)-1;
+        }
+        _bootstrap();
+    }
+
+    if (!tracking || !mappings || in_intercept || !increment) {
+        return libc_sbrk(increment);
+    }
+
+    in_intercept = true;
+
+    void* old_break = libc_sbrk(increment);
+    if (old_break != (void*)-1) {
+        _track_break(old_break, (char*)old_break + increment);
+    }
+
+    in_intercept = false;
+
+    return old_break;
+}
+
+/**
+ * C++ operator new and operator delete, by their Itanium ABI mangled names.
+ * Blocks come straight from libc through the same path as malloc, so they
+ * are attributed to the caller of new rather than to libstdc++. Only when
+ * libc fails is the libstdc++ operator called, it runs the new handler and
+ * throws std::bad_alloc as the program expects. Mangled names assume a 64
+ * bit size_t
+ */
+#if UINTPTR_MAX == UINT64_MAX
+
+void* _Znwm(size_t size) {
+    void* ptr = _new(size, 0);
+    return ptr? ptr : _new_failed("_Znwm", size, 0, NULL);
+}
+
+void* _Znam(size_t size) {
+    void* ptr = _new(size, 0);
+    return ptr? ptr : _new_failed("_Znam", size, 0, NULL);
+}
+
+void* _ZnwmRKSt9nothrow_t(size_t size, const void* nothrow) {
+    void* ptr = _new(size, 0);
+    return ptr? ptr : _new_failed("_ZnwmRKSt9nothrow_t", size, 0, nothrow);
+}
+
+void* _ZnamRKSt9nothrow_t(size_t size, const void* nothrow) {
+    void* ptr = _new(size, 0);
+    return ptr? ptr : _new_failed("_ZnamRKSt9nothrow_t", size, 0, nothrow);
+}
+
+void* _ZnwmSt11align_val_t(size_t size, size_t alignment) {
+    void* ptr = _new(size, alignment);
+    return ptr? ptr : _new_failed("_ZnwmSt11align_val_t", size, alignment, NULL);
+}
+
+void* _ZnamSt11align_val_t(size_t size, size_t alignment) {
+    void* ptr = _new(size, alignment);
+    return ptr? ptr : _new_failed("_ZnamSt11align_val_t", size, alignment, NULL);
+}
+
+void* _ZnwmSt11align_val_tRKSt9nothrow_t(size_t size, size_t alignment, const void* nothrow) {
+    void* ptr = _new(size, alignment);
+    return ptr? ptr : _new_failed("_ZnwmSt11align_val_tRKSt9nothrow_t", size, alignment, nothrow);
+}
+
+void* _ZnamSt11align_val_tRKSt9nothrow_t(size_t size, size_t alignment, const void* nothrow) {
+    void* ptr = _new(size, alignment);
+    return ptr? ptr : _new_failed("_ZnamSt11align_val_tRKSt9nothrow_t", size, alignment, nothrow);
+}
+
+/**
+ * Sized deletes can't skip the table, the entry also holds the site and
+ * timestamp the free is charged to, so every delete is a plain free
+ */
+void _ZdlPv(void* ptr) { _delete(ptr); }
+void _ZdaPv(void* ptr) { _delete(ptr); }
+void _ZdlPvm(void* ptr, size_t size) { (void)size; _delete(ptr); }
+void _ZdaPvm(void* ptr, size_t size) { (void)size; _delete(ptr); }
+void _ZdlPvRKSt9nothrow_t(void* ptr, const void* nothrow) { (void)nothrow; _delete(ptr); }
+void _ZdaPvRKSt9nothrow_t(void* ptr, const void* nothrow) { (void)nothrow; _delete(ptr); }
+void _ZdlPvSt11align_val_t(void* ptr, size_t alignment) { (void)alignment; _delete(ptr); }
+void _ZdaPvSt11align_val_t(void* ptr, size_t alignment) { (void)alignment; _delete(ptr); }
+void _ZdlPvmSt11align_val_t(void* ptr, size_t size, size_t alignment) { (void)size; (void)alignment; _delete(ptr); }
+void _ZdaPvmSt11align_val_t(void* ptr, size_t size, size_t alignment) { (void)size; (void)alignment; _delete(ptr); }
+void _ZdlPvSt11align_val_tRKSt9nothrow_t(void* ptr, size_t alignment, const void* nothrow) {
+    (void)alignment;
+    (void)nothrow;
+    _delete(ptr);
+}
+void _ZdaPvSt11align_val_tRKSt9nothrow_t(void* ptr, size_t alignment, const void* nothrow) {
+    (void)alignment;
+    (void)nothrow;
+    _delete(ptr);
+}
+
+#endif
+
+static void _bootstrap(void) {
+    // Runs from the constructor or from the first intercepted call, whichever comes first
+    if (bootstrap_state != BOOTSTRAP_NONE) { return; }
+
+    bootstrap_state = BOOTSTRAP_RUNNING;
+
+    libc_malloc = _resolve("malloc");
+    libc_calloc = _resolve("calloc");
+    libc_realloc = _resolve("realloc");
+    libc_free = _resolve("free");
+    libc_posix_memalign = _resolve("posix_memalign");
+    libc_aligned_alloc = _resolve("aligned_alloc");
+    libc_memalign = _resolve("memalign");
+    libc_valloc = _resolve("valloc");
+    libc_pvalloc = _resolve("pvalloc");
+    libc_reallocarray = _resolve("reallocarray");
+    libc_mmap = _resolve("mmap");
+    libc_mmap64 = _resolve("mmap64");
+    libc_munmap = _resolve("munmap");
+    libc_mremap = _resolve("mremap");
+    libc_brk = _resolve("brk");
+    libc_sbrk = _resolve("sbrk");
+
+    bootstrap_state = BOOTSTRAP_DONE;
+
+    in_intercept = true;
+
+    // Not running under memtrace, behave as plain libc
+    if (!shm_attach()) {
+        in_intercept = false;
+        return;
+    }
+
+    char* interval_str = getenv("MEMTRACE_SAMPLE_INTERVAL");
+    sample_interval = interval_str? strtoull(interval_str, NULL, 10) : 0;
+
+    ht = ht_load();
+    site_table = st_load();
+    rings = er_load();
+    recording = tr_load();
+    mappings = mp_load();
+    residents = rs_load();
+    page_size = sysconf(_SC_PAGESIZE);
+    uw_init(ST_MAX_DEPTH);
+
+    tracking = ht && site_table;
+
+    // Untouched pages of the filter are never backed, only slots of sampled blocks cost memory
+    if (tracking && sample_interval && !rings && !recording) {
+        sampled_filter = libc_mmap(NULL, sizeof(uint16_t) << SAMPLED_FILTER_BITS, PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (sampled_filter == MAP_FAILED) {
+            sampled_filter = NULL;
+        }
+    }
+
+    in_intercept = false;
+}
+
+static void _measure_resident(void) {
+    /**
+     * Pages can only be looked up from inside the process, as late as it gets.
+     * Async and recording modes don't keep the table here, there is nothing to measure
+     */
+    if (!tracking || !residents || rings || recording || in_intercept) { return; }
+
+    in_intercept = true;
+    if (!rs_measure(residents, ht, mappings, sample_interval)) {
+        fputs("Resident memory could not be measured\n", stderr);
+    }
+    in_intercept = false;
+}
+
+static void* _resolve(const char* symbol) {
+    void* fn = dlsym(RTLD_NEXT, symbol);
     char* error;
-    if ((error = dlerror()) != NULL) {
-        fputs(error, stderr);
+    if ((error = dlerror()) != NULL || !fn) {
+        fputs(error? error : symbol, stderr);
         exit(1);
     }
 
-    void* ptr = libc_calloc(num_elements, element_size);
+    return fn;
+}
+
+static void* _bootstrap_alloc(size_t size) {
+    size_t block = BOOTSTRAP_HEADER + ((size + BOOTSTRAP_HEADER - 1) & ~(size_t)(BOOTSTRAP_HEADER - 1));
+
+    size_t offset = __atomic_fetch_add(&bootstrap_arena_used, block, __ATOMIC_RELAXED);
+    if (offset + block > BOOTSTRAP_ARENA_SIZE) {
+        return NULL;
+    }
+
+    char* ptr = bootstrap_arena + offset + BOOTSTRAP_HEADER;
+    *(size_t*)(ptr - BOOTSTRAP_HEADER) = size;
+
     return ptr;
 }
 
-void  _no_intercept_free(void* ptr) {
-    libc_free = dlsym(RTLD_NEXT, "free");
-    char* error;
-    if ((error = dlerror()) != NULL) {
-        fputs(error, stderr);
-        exit(1);
+// Only alignments the arena already guarantees can be served while bootstrapping
+static void* _bootstrap_aligned_alloc(size_t alignment, size_t size) {
+    return alignment <= BOOTSTRAP_HEADER? _bootstrap_alloc(size) : NULL;
+}
+
+// Inlined so every intercepted function is a single frame above _record_alloc
+static inline void _track_alloc(void* ptr, size_t size) {
+    if (ptr && _sampled(size)) {
+        _record_alloc(ptr, size);
     }
+}
+
+static inline void* _new(size_t size, size_t alignment) {
+    if (!libc_memalign) {
+        if (bootstrap_state == BOOTSTRAP_RUNNING) {
+            return _bootstrap_aligned_alloc(alignment, size);
+        }
+        _bootstrap();
+    }
+
+    if (!tracking || in_intercept) {
+        return alignment? libc_memalign(alignment, size) : libc_malloc(size);
+    }
+
+    in_intercept = true;
+
+    void* ptr = alignment? libc_memalign(alignment, size) : libc_malloc(size);
+    _track_alloc(ptr, size);
+
+    in_intercept = false;
+
+    return ptr;
+}
+
+/**
+ * libc is out of memory, the next operator new handles it, calling the new
+ * handler and retrying or throwing. Its own allocations are tracked as mallocs
+ */
+static void* _new_failed(const char* symbol, size_t size, size_t alignment, const void* nothrow) {
+    void* next = dlsym(RTLD_NEXT, symbol);
+    if (!next) {
+        return NULL;
+    }
+
+    if (alignment) {
+        return nothrow? ((void* (*)(size_t, size_t, const void*))next)(size, alignment, nothrow) :
+                        ((void* (*)(size_t, size_t))next)(size, alignment);
+    }
+    return nothrow? ((void* (*)(size_t, const void*))next)(size, nothrow) : ((void* (*)(size_t))next)(size);
+}
+
+static inline void _delete(void* ptr) {
+    if (!ptr || IS_BOOTSTRAP_PTR(ptr)) { return; }
+
+    if (!libc_free) {
+        _bootstrap();
+    }
+
+    if (tracking && !in_intercept && _maybe_sampled(ptr)) {
+        in_intercept = true;
+        _record_free(ptr);
+        in_intercept = false;
+    }
+
     libc_free(ptr);
 }
 
-void _add_trace_symbols(allocInfo* trace) {
-    char tmp_buffer[MAX_CHAR];
+static inline void* _map(void* (*libc_map)(void*, size_t, int, int, int, off_t), void* addr, size_t length, int prot,
+                         int flags, int fd, off_t offset) {
+    if (!tracking || !mappings || in_intercept) {
+        return libc_map(addr, length, prot, flags, fd, offset);
+    }
+
+    in_intercept = true;
+
+    // MAP_FIXED replaces whatever was mapped there, the table drops it when the new region goes in
+    void* ptr = libc_map(addr, length, prot, flags, fd, offset);
+    if (ptr != MAP_FAILED) {
+        _record_mapping(ptr, length, (flags & MAP_ANONYMOUS)? MP_ANONYMOUS : MP_FILE);
+    }
+
+    in_intercept = false;
+
+    return ptr;
+}
+
+static inline void _track_break(void* old_break, void* new_break) {
+    if (new_break > old_break) {
+        _record_mapping(old_break, (char*)new_break - (char*)old_break, MP_BRK);
+    } else if (new_break < old_break) {
+        mp_unmap(mappings, (uint64_t)new_break, (char*)old_break - (char*)new_break);
+    }
+}
+
+static void _record_mapping(void* ptr, size_t length, regionKind kind) {
+    void* frames[ST_MAX_DEPTH];
+    int nframes = uw_capture(frames, BT_OFFSET);
+
+    // The break moves by the byte, mappings always cover whole pages
+    if (kind != MP_BRK) {
+        length = (length + page_size - 1) & ~(page_size - 1);
+    }
+
+    mp_map(mappings, (uint64_t)ptr, length, st_intern(site_table, frames, nframes), kind);
+}
+
+static void _record_alloc(void* ptr, size_t size) {
+    void* frames[ST_MAX_DEPTH];
+    int nframes = uw_capture(frames, BT_OFFSET);
+
+    allocInfo trace = {
+        .block_size = size,
+        .site_id = st_intern(site_table, frames, nframes),
+        .timestamp = ts_now()
+    };
+
+    if (recording) {
+        tr_push_alloc(recording, (size_t)ptr, trace);
+        return;
+    }
+
+    if (rings) {
+        er_push_alloc(rings, (size_t)ptr, trace);
+        return;
+    }
 
-    int nptrs;
-    void* buffer[MAX_CHAR];
-    char** strings;
+    // Counted before the entry exists, a free racing with the insert can't miss it
+    if (sampled_filter) {
+        __atomic_fetch_add(&sampled_filter[SAMPLED_FILTER_SLOT(ptr)], 1, __ATOMIC_RELAXED);
+    }
 
-    nptrs = backtrace(buffer, MAX_CHAR);
+    if (!ht_insert(ht, (size_t)ptr, trace)) {
+        fputs("Unrecoverable error: HashTable | Shared Memory Failure\n", stderr);
+        exit(1);
+    }
 
-    strings = backtrace_symbols(buffer, nptrs);
+    st_count_alloc(site_table, trace.site_id, sp_scale(1, size, sample_interval), sp_scale(size, size, sample_interval));
+}
+
+static inline bool _sampled(size_t size) {
+    /**
+     * Unsampled allocations only pay for this, they are neither unwound nor
+     * recorded. Their frees are turned away by sampled_filter before the table
+     */
+    if (!sample_interval) {
+        return true;
+    }
+
+    bytes_until_sample -= size;
+    if (bytes_until_sample > 0) {
+        return false;
+    }
+
+    return _sampled_slow();
+}
+
+static bool _sampled_slow(void) {
+    // New threads draw their first distance, the allocation that got here counts against it
+    if (!sample_state) {
+        sample_state = ts_now() ^ (uint64_t)(uintptr_t)&sample_state;
+        sample_state = sample_state? sample_state : 1;
+
+        bytes_until_sample += sp_next_interval(&sample_state, sample_interval);
+        if (bytes_until_sample > 0) {
+            return false;
+        }
+    }
+
+    bytes_until_sample = sp_next_interval(&sample_state, sample_interval);
+
+    return true;
+}
+
+// Inlined into free so unsampled frees return before doing anything else
+static inline bool _maybe_sampled(void* ptr) {
+    return !sampled_filter || __atomic_load_n(&sampled_filter[SAMPLED_FILTER_SLOT(ptr)], __ATOMIC_RELAXED);
+}
+
+static void _record_free(void* ptr) {
+    detachedBlock block;
+    _detach(ptr, &block);
+    _settle(ptr, &block, true);
+}
+
+static void _detach(void* ptr, detachedBlock* block) {
+    block->tracked = false;
+
+    // Not a sampled block, no lock taken and nothing to look up
+    if (!_maybe_sampled(ptr)) {
+        return;
+    }
+
+    block->timestamp = ts_now();
+
+    // Recordings and rings keep no table here, _settle pushes the free once it is known to happen
+    if (recording || rings) {
+        return;
+    }
+
+    // Frees of blocks that were never recorded are not counted anywhere
+    block->tracked = ht_remove(ht, (size_t)ptr, &block->info);
+}
+
+static void _settle(void* ptr, const detachedBlock* block, bool freed) {
+    // Recordings keep no table, every free is written and matched when the trace is analyzed
+    if (recording) {
+        if (freed) {
+            tr_push_free(recording, (size_t)ptr, block->timestamp);
+        }
+        return;
+    }
+
+    if (rings) {
+        if (freed) {
+            er_push_free(rings, (size_t)ptr, block->timestamp);
+        }
+        return;
+    }
+
+    if (!block->tracked) {
+        return;
+    }
+
+    // The block is still live, it goes back as it was and nothing is charged
+    if (!freed) {
+        if (!ht_insert(ht, (size_t)ptr, block->info)) {
+            fputs("Unrecoverable error: HashTable | Shared Memory Failure\n", stderr);
+            exit(1);
+        }
+        return;
+    }
 
-    for (int i = BT_OFFSET; i < nptrs && i < MAX_STRINGS; i++) {
-        strncpy(tmp_buffer, strings[i], MAX_CHAR - 1);
-        tmp_buffer[MAX_CHAR - 1] = '\0';
-        strcpy(trace->stack_trace[i], tmp_buffer);
+    if (sampled_filter) {
+        __atomic_fetch_sub(&sampled_filter[SAMPLED_FILTER_SLOT(ptr)], 1, __ATOMIC_RELAXED);
     }
 
-    free(strings);
+    const allocInfo* info = &block->info;
+    st_count_free(site_table, info->site_id, sp_scale(1, info->block_size, sample_interval),
+                  sp_scale(info->block_size, info->block_size, sample_interval), block->timestamp - info->timestamp);
 }
 
 #endif
@@ -0,0 +1,413 @@
+/*
+ * Copyright (C) 2024 Alejandro Cadarso
+ *
+ * This file is part of Memtrace.
+ *
+ * Memtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Memtrace.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * File: profile.c
+ * Author: Alejandro Cadarso
+ * Date: 17-10-2026
+ *
+ * This file implements the profile writers. Both formats are streamed:
+ * every site is encoded and written as soon as it is read from the call
+ * site table, nothing but the record being encoded is held in memory.
+ *
+ * pprof profiles are written uncompressed, which pprof reads as is. The
+ * repeated fields of a profile may come in any order, so the string table
+ * is written as strings are needed and every site brings its own
+ * locations, identified by the position of their frame in the site table
+ * frame pool. Addresses are return addresses, they are moved back by one
+ * byte so they resolve to the call instruction. Frames the symbolizer
+ * resolved carry their function and line, one function per location.
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "profile.h"
+
+// Largest encoded sample, mapping or location, a full depth sample takes under 1KB
+#define PF_MAX_MESSAGE 2048
+
+// Longest frame name in folded output
+#define PF_MAX_FRAME (MM_MAX_PATH + 32)
+
+// Protobuf wire types
+#define PB_VARINT 0
+#define PB_LEN 2
+
+// perftools.profiles.Profile fields
+#define PPROF_SAMPLE_TYPE 1
+#define PPROF_SAMPLE 2
+#define PPROF_MAPPING 3
+#define PPROF_LOCATION 4
+#define PPROF_FUNCTION 5
+#define PPROF_STRING_TABLE 6
+#define PPROF_DURATION_NANOS 10
+#define PPROF_PERIOD_TYPE 11
+#define PPROF_PERIOD 12
+#define PPROF_DEFAULT_SAMPLE_TYPE 14
+
+// Sample values, in the order of the sample types written by pf_write_pprof
+enum pprofValue {
+    PPROF_ALLOC_OBJECTS,
+    PPROF_ALLOC_SPACE,
+    PPROF_INUSE_OBJECTS,
+    PPROF_INUSE_SPACE,
+    PPROF_PEAK_SPACE,
+    PPROF_VALUES
+};
+
+typedef struct pbBuffer {
+    size_t length;
+    uint8_t data[PF_MAX_MESSAGE];
+} pbBuffer;
+
+typedef struct pprofWriter {
+    siteTable* st;
+    FILE* out;
+    // Index the next string written gets in the string table
+    uint64_t strings;
+    // Functions written so far, pprof expects their ids to be dense
+    uint64_t functions;
+} pprofWriter;
+
+static void _pb_varint(pbBuffer* pb, uint64_t value);
+static void _pb_uint(pbBuffer* pb, uint32_t field, uint64_t value);
+static void _pb_bytes(pbBuffer* pb, uint32_t field, const void* data, size_t length);
+static void _pf_emit(pprofWriter* writer, uint32_t field, const pbBuffer* message);
+static uint64_t _pf_string(pprofWriter* writer, const char* string);
+static void _pf_value_type(pprofWriter* writer, uint32_t field, uint64_t type, uint64_t unit);
+static void _pf_locations(pprofWriter* writer, siteId id);
+static void _pf_sample(pprofWriter* writer, siteId id, const uint64_t values[PPROF_VALUES]);
+static void _pf_write_stack(siteTable* st, siteId id, FILE* out);
+static void _pf_frame_name(siteTable* st, const callSite* site, uint32_t i, char* buffer, size_t size);
+
+
+/************************************************************************************************************
+ *                                          PUBLIC FUNCTIONS                                                *
+ ***********************************************************************************************************/
+
+
+bool pf_parse_weight(const char* name, profileWeight* weight) {
+    if (strcmp(name, "inuse") == 0) {
+        *weight = PF_INUSE;
+        return true;
+    }
+    if (strcmp(name, "peak") == 0) {
+        *weight = PF_PEAK;
+        return true;
+    }
+    if (strcmp(name, "alloc") == 0) {
+        *weight = PF_ALLOC;
+        return true;
+    }
+
+    return false;
+}
+
+
+bool pf_write_pprof(siteTable* st, FILE* out, uint64_t duration_ns, uint64_t sample_interval) {
+    pprofWriter writer = {.st = st, .out = out};
+
+    // The string table must start with the empty string
+    _pf_string(&writer, "");
+    const uint64_t count = _pf_string(&writer, "count");
+    const uint64_t bytes = _pf_string(&writer, "bytes");
+    const uint64_t inuse_space = _pf_string(&writer, "inuse_space");
+
+    _pf_value_type(&writer, PPROF_SAMPLE_TYPE, _pf_string(&writer, "alloc_objects"), count);
+    _pf_value_type(&writer, PPROF_SAMPLE_TYPE, _pf_string(&writer, "alloc_space"), bytes);
+    _pf_value_type(&writer, PPROF_SAMPLE_TYPE, _pf_string(&writer, "inuse_objects"), count);
+    _pf_value_type(&writer, PPROF_SAMPLE_TYPE, inuse_space, bytes);
+    _pf_value_type(&writer, PPROF_SAMPLE_TYPE, _pf_string(&writer, "peak_space"), bytes);
+
+    pbBuffer message = {0};
+    _pb_uint(&message, PPROF_DEFAULT_SAMPLE_TYPE, inuse_space);
+    _pb_uint(&message, PPROF_DURATION_NANOS, duration_ns);
+    if (sample_interval) {
+        _pb_uint(&message, PPROF_PERIOD, sample_interval);
+    }
+    fwrite(message.data, 1, message.length, out);
+    if (sample_interval) {
+        _pf_value_type(&writer, PPROF_PERIOD_TYPE, _pf_string(&writer, "space"), bytes);
+    }
+
+    // Mapping ids are module indexes plus one, pprof uses them to symbolize from the binaries
+    const moduleMap* modules = st_modules(st);
+    for (uint32_t i = 0; i < modules->length; i++) {
+        const moduleInfo* module = &modules->modules[i];
+        uint64_t filename = _pf_string(&writer, module->path);
+
+        message.length = 0;
+        _pb_uint(&message, 1, i + 1);
+        _pb_uint(&message, 2, module->start);
+        _pb_uint(&message, 3, module->end);
+        _pb_uint(&message, 4, module->offset);
+        _pb_uint(&message, 5, filename);
+        _pf_emit(&writer, PPROF_MAPPING, &message);
+    }
+
+    const uint32_t length = st_length(st);
+    for (siteId id = 0; id < length; id++) {
+        const siteCounters* counters = st_counters(st, id);
+        uint64_t values[PPROF_VALUES] = {
+            [PPROF_ALLOC_OBJECTS] = __atomic_load_n(&counters->allocs, __ATOMIC_RELAXED),
+            [PPROF_ALLOC_SPACE] = __atomic_load_n(&counters->alloc_bytes, __ATOMIC_RELAXED),
+            [PPROF_INUSE_OBJECTS] = __atomic_load_n(&counters->allocs, __ATOMIC_RELAXED) -
+                                    __atomic_load_n(&counters->frees, __ATOMIC_RELAXED),
+            [PPROF_INUSE_SPACE] = __atomic_load_n(&counters->live_bytes, __ATOMIC_RELAXED)
+        };
+        if (!values[PPROF_ALLOC_OBJECTS]) {
+            continue;
+        }
+
+        _pf_locations(&writer, id);
+        _pf_sample(&writer, id, values);
+    }
+
+    // Peak sites were all written above, their samples only reference the locations already there
+    uint32_t peak_length;
+    uint64_t peak_bytes;
+    const sitePeak* peak = st_peak_snapshot(st, &peak_length, &peak_bytes);
+    for (uint32_t i = 0; i < peak_length; i++) {
+        uint64_t values[PPROF_VALUES] = {[PPROF_PEAK_SPACE] = peak[i].live_bytes};
+        _pf_sample(&writer, peak[i].id, values);
+    }
+
+    return fflush(out) == 0 && !ferror(out);
+}
+
+
+bool pf_write_folded(siteTable* st, FILE* out, profileWeight weight) {
+    if (weight == PF_PEAK) {
+        uint32_t peak_length;
+        uint64_t peak_bytes;
+        const sitePeak* peak = st_peak_snapshot(st, &peak_length, &peak_bytes);
+        for (uint32_t i = 0; i < peak_length; i++) {
+            _pf_write_stack(st, peak[i].id, out);
+            fprintf(out, " %lu\n", peak[i].live_bytes);
+        }
+    } else {
+        const uint32_t length = st_length(st);
+        for (siteId id = 0; id < length; id++) {
+            const siteCounters* counters = st_counters(st, id);
+            uint64_t bytes = weight == PF_INUSE? __atomic_load_n(&counters->live_bytes, __ATOMIC_RELAXED) :
+                                                 __atomic_load_n(&counters->alloc_bytes, __ATOMIC_RELAXED);
+            if (!bytes) {
+                continue;
+            }
+            _pf_write_stack(st, id, out);
+            fprintf(out, " %lu\n", bytes);
+        }
+    }
+
+    return fflush(out) == 0 && !ferror(out);
+}
+
+
+bool pf_save_pprof(siteTable* st, const char* path, uint64_t duration_ns, uint64_t sample_interval) {
+    FILE* out = fopen(path, "wb");
+    if (!out) {
+        return false;
+    }
+
+    bool written = pf_write_pprof(st, out, duration_ns, sample_interval);
+
+    return fclose(out) == 0 && written;
+}
+
+
+bool pf_save_folded(siteTable* st, const char* path, profileWeight weight) {
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        return false;
+    }
+
+    bool written = pf_write_folded(st, out, weight);
+
+    return fclose(out) == 0 && written;
+}
+
+
+/************************************************************************************************************
+ *                                          PRIVATE FUNCTIONS                                               *
+ ***********************************************************************************************************/
+
+
+static void _pb_varint(pbBuffer* pb, uint64_t value) {
+    while (value >= 0x80) {
+        pb->data[pb->length++] = (uint8_t)value | 0x80;
+        value >>= 7;
+    }
+    pb->data[pb->length++] = (uint8_t)value;
+}
+
+
+static void _pb_uint(pbBuffer* pb, uint32_t field, uint64_t value) {
+    _pb_varint(pb, field << 3 | PB_VARINT);
+    _pb_varint(pb, value);
+}
+
+
+static void _pb_bytes(pbBuffer* pb, uint32_t field, const void* data, size_t length) {
+    _pb_varint(pb, field << 3 | PB_LEN);
+    _pb_varint(pb, length);
+    memcpy(&pb->data[pb->length], data, length);
+    pb->length += length;
+}
+
+
+static void _pf_emit(pprofWriter* writer, uint32_t field, const pbBuffer* message) {
+    pbBuffer header = {0};
+    _pb_varint(&header, field << 3 | PB_LEN);
+    _pb_varint(&header, message->length);
+
+    fwrite(header.data, 1, header.length, writer->out);
+    fwrite(message->data, 1, message->length, writer->out);
+}
+
+
+static uint64_t _pf_string(pprofWriter* writer, const char* string) {
+    pbBuffer header = {0};
+    size_t length = strlen(string);
+    _pb_varint(&header, PPROF_STRING_TABLE << 3 | PB_LEN);
+    _pb_varint(&header, length);
+
+    fwrite(header.data, 1, header.length, writer->out);
+    fwrite(string, 1, length, writer->out);
+
+    return writer->strings++;
+}
+
+
+static void _pf_value_type(pprofWriter* writer, uint32_t field, uint64_t type, uint64_t unit) {
+    pbBuffer message = {0};
+    _pb_uint(&message, 1, type);
+    _pb_uint(&message, 2, unit);
+    _pf_emit(writer, field, &message);
+}
+
+
+static void _pf_locations(pprofWriter* writer, siteId id) {
+    const callSite* site = st_get(writer->st, id);
+    if (!site) {
+        return;
+    }
+
+    const moduleMap* modules = st_modules(writer->st);
+    void* const* frames = st_frames(writer->st, site);
+    pbBuffer message, line;
+    char path[2 * MM_MAX_PATH];
+    for (uint32_t i = 0; i < site->depth; i++) {
+        const uint64_t location_id = site->frames + i + 1;
+        const moduleInfo* module = mm_find(modules, (uintptr_t)frames[i]);
+        const symbolInfo* symbol = st_symbol(writer->st, site, i);
+
+        // One function per resolved location, the strings it needs go first
+        uint64_t function_id = 0;
+        if (symbol && symbol->function) {
+            const bool relative = symbol->file && symbol->file[0] != '/' && symbol->directory;
+            snprintf(path, sizeof(path), "%s%s%s", relative? symbol->directory : "", relative? "/" : "",
+                     symbol->file? symbol->file : "");
+            const uint64_t name = _pf_string(writer, symbol->function);
+            const uint64_t filename = _pf_string(writer, path);
+
+            function_id = ++writer->functions;
+            message.length = 0;
+            _pb_uint(&message, 1, function_id);
+            _pb_uint(&message, 2, name);
+            _pb_uint(&message, 3, name);
+            _pb_uint(&message, 4, filename);
+            _pf_emit(writer, PPROF_FUNCTION, &message);
+        }
+
+        message.length = 0;
+        _pb_uint(&message, 1, location_id);
+        if (module) {
+            _pb_uint(&message, 2, module - modules->modules + 1);
+        }
+        _pb_uint(&message, 3, (uintptr_t)frames[i] - 1);
+        if (function_id) {
+            line.length = 0;
+            _pb_uint(&line, 1, function_id);
+            _pb_uint(&line, 2, symbol->line);
+            _pb_bytes(&message, 4, line.data, line.length);
+        }
+        _pf_emit(writer, PPROF_LOCATION, &message);
+    }
+}
+
+
+static void _pf_sample(pprofWriter* writer, siteId id, const uint64_t values[PPROF_VALUES]) {
+    pbBuffer packed = {0};
+    pbBuffer message = {0};
+
+    // Sites that could not be stored have no frames, their samples have no locations
+    const callSite* site = st_get(writer->st, id);
+    if (site) {
+        for (uint32_t i = 0; i < site->depth; i++) {
+            _pb_varint(&packed, site->frames + i + 1);
+        }
+        _pb_bytes(&message, 1, packed.data, packed.length);
+    }
+
+    packed.length = 0;
+    for (int i = 0; i < PPROF_VALUES; i++) {
+        _pb_varint(&packed, values[i]);
+    }
+    _pb_bytes(&message, 2, packed.data, packed.length);
+
+    _pf_emit(writer, PPROF_SAMPLE, &message);
+}
+
+
+static void _pf_write_stack(siteTable* st, siteId id, FILE* out) {
+    const callSite* site = st_get(st, id);
+    if (!site) {
+        fputs("[unknown]", out);
+        return;
+    }
+
+    char frame[PF_MAX_FRAME];
+    for (int i = site->depth - 1; i >= 0; i--) {
+        _pf_frame_name(st, site, i, frame, sizeof(frame));
+        fprintf(out, "%s%s", frame, i? ";" : "");
+    }
+}
+
+
+static void _pf_frame_name(siteTable* st, const callSite* site, uint32_t i, char* buffer, size_t size) {
+    const uintptr_t pc = (uintptr_t)st_frames(st, site)[i];
+    const symbolInfo* symbol = st_symbol(st, site, i);
+    const moduleInfo* module = mm_find(st_modules(st), pc);
+
+    if (symbol && symbol->function) {
+        snprintf(buffer, size, "%s", symbol->function);
+    } else if (module) {
+        const char* name = strrchr(module->path, '/');
+        snprintf(buffer, size, "%s+0x%lx", name? name + 1 : module->path, pc - module->start + module->offset);
+    } else {
+        snprintf(buffer, size, "0x%lx", pc);
+    }
+
+    // Spaces and semicolons are separators in folded stacks
+    for (char* c = buffer; *c; c++) {
+        if (*c == ' ' || *c == ';') {
+            *c = '_';
+        }
+    }
+}
@@ -0,0 +1,573 @@
+/*
+ * Copyright (C) 2024 Alejandro Cadarso
+ *
+ * This file is part of Memtrace.
+ *
+ * Memtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Memtrace.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * File: replay.c
+ * Author: Alejandro Cadarso
+ * Date: 17-10-2026
+ *
+ * This file implements memtrace-replay, which replays the allocations of a
+ * trace recorded with memtrace -r against whatever malloc the process runs
+ * with, so allocators can be compared on a real allocation pattern. Every
+ * recorded thread gets a replay thread issuing the same sizes in the same
+ * order, a free of a block another thread allocated waits until that
+ * allocation was replayed. Threads don't otherwise wait for each other and
+ * run as fast as the allocator lets them. Reports throughput, latency
+ * percentiles and the peak resident set size of the replay.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "timestamp.h"
+#include "trace.h"
+
+// Log-linear latency buckets, values below RP_SUB_BUCKETS * 2 ticks are exact
+#define RP_SUB_BITS 3
+#define RP_SUB_BUCKETS (1 << RP_SUB_BITS)
+#define RP_BUCKETS (2 * RP_SUB_BUCKETS + (64 - RP_SUB_BITS - 1) * RP_SUB_BUCKETS)
+
+// Waits for another thread's allocation spin this many times before yielding
+#define RP_SPINS 256
+
+// Set once memtrace-replay re-executed itself with the allocator of -a preloaded
+#define RP_PRELOADED_ENV "MEMTRACE_REPLAY_PRELOADED"
+
+#define RP_NO_EVENT SIZE_MAX
+
+typedef struct replayOp {
+    uint64_t block_size;
+    uint32_t slot;
+    uint8_t kind;
+    // Frees of blocks allocated by another thread wait until it did
+    uint8_t wait;
+} replayOp;
+
+// A replayed allocation, frees find their block through the slot of the op
+typedef struct replaySlot {
+    void* block;
+    uint32_t ready;
+} replaySlot;
+
+typedef struct replayThread {
+    replayOp* ops;
+    size_t nops;
+    replaySlot* slots;
+    uint64_t malloc_latency[RP_BUCKETS];
+    uint64_t free_latency[RP_BUCKETS];
+    uint64_t malloc_max;
+    uint64_t free_max;
+    uint64_t failed;
+    pthread_t thread;
+} replayThread;
+
+typedef struct replayPlan {
+    replayThread* threads;
+    size_t nthreads;
+    replaySlot* slots;
+    uint64_t nslots;
+    uint64_t nmallocs;
+    uint64_t nfrees;
+    // Frees that match no recorded allocation, not replayed
+    uint64_t unmatched;
+    uint64_t peak_live_bytes;
+} replayPlan;
+
+// 0 while threads are being started, 1 to replay, -1 if starting them failed
+static int start_state;
+static size_t page_size;
+
+// Events the sorting functions look at, qsort has no context argument
+static const traceEvent* sorting_events;
+
+void print_usage(void);
+static bool _rp_plan(trace* tr, int nthreads, replayPlan* plan);
+static void _rp_destroy_plan(replayPlan* plan);
+static void* _rp_replay(void* arg);
+static inline uint32_t _rp_bucket(uint64_t ticks);
+static uint64_t _rp_bucket_value(uint32_t bucket);
+static uint64_t _rp_percentile(const uint64_t* buckets, uint64_t count, uint64_t max, double percentile);
+static void _rp_print_latencies(const char* label, const uint64_t* buckets, uint64_t count, uint64_t max, double ticks_per_ns);
+static void _rp_format_ns(char* buf, size_t size, double ns);
+static bool _rp_read_status(const char* field, uint64_t* kb);
+static int _rp_compare_addresses(const void* a, const void* b);
+static int _rp_compare_tids(const void* a, const void* b);
+
+
+int main(int argc, char* argv[]) {
+    bool h_opt = false;
+    bool invalid_opt = false;
+    char* allocator = NULL;
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    char* end;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "ha:j:")) != -1) {
+        switch (opt) {
+            case 'a':
+                allocator = optarg;
+                break;
+            case 'j':
+                nthreads = strtol(optarg, &end, 10);
+                if (nthreads < 1 || *end != '\0') {
+                    invalid_opt = true;
+                }
+                break;
+            case 'h':
+                h_opt = true;
+                break;
+            default:
+                invalid_opt = true;
+                break;
+        }
+    }
+
+    if (invalid_opt || h_opt || !(optind < argc)) {
+        print_usage();
+        exit(0);
+    }
+
+    // The allocator has to be there from the start, run again with it preloaded
+    if (allocator && !getenv(RP_PRELOADED_ENV)) {
+        setenv("LD_PRELOAD", allocator, 1);
+        setenv(RP_PRELOADED_ENV, "1", 1);
+        execv("/proc/self/exe", argv);
+        perror("execv");
+        exit(1);
+    }
+    unsetenv(RP_PRELOADED_ENV);
+
+    trace* tr = tr_open(argv[optind]);
+
+    if (!tr) {
+        printf("Could not read trace file %s\n", argv[optind]);
+        exit(1);
+    }
+
+    page_size = sysconf(_SC_PAGESIZE);
+
+    replayPlan plan;
+    if (!_rp_plan(tr, nthreads, &plan)) {
+        printf("Could not prepare the replay of %s\n", argv[optind]);
+        tr_destroy(tr);
+        exit(1);
+    }
+
+    char* preloaded = getenv("LD_PRELOAD");
+    printf("Replaying %lu mallocs and %lu frees of %zu threads from %s with %s\n", plan.nmallocs, plan.nfrees,
+           plan.nthreads, argv[optind], preloaded && *preloaded? preloaded : "the default malloc");
+    if (tr_sample_interval(tr)) {
+        printf("The trace was sampled every %lu bytes, only sampled allocations are replayed\n", tr_sample_interval(tr));
+    }
+    if (tr_dropped(tr)) {
+        printf("%lu events were dropped while recording\n", tr_dropped(tr));
+    }
+    if (plan.unmatched) {
+        printf("%lu frees of blocks allocated before recording started are skipped\n", plan.unmatched);
+    }
+
+    // Forget the peak of the preparation so only the replay itself is measured
+    FILE* clear_refs = fopen("/proc/self/clear_refs", "w");
+    bool peak_reset = clear_refs && fputs("5", clear_refs) >= 0;
+    if (clear_refs && fclose(clear_refs) != 0) {
+        peak_reset = false;
+    }
+    uint64_t baseline_kb = 0;
+    _rp_read_status("VmRSS:", &baseline_kb);
+
+    size_t started = 0;
+    for (; started < plan.nthreads; started++) {
+        if (pthread_create(&plan.threads[started].thread, NULL, _rp_replay, &plan.threads[started]) != 0) {
+            break;
+        }
+    }
+
+    const uint64_t start_ns = ts_monotonic_ns();
+    const uint64_t start_ticks = ts_now();
+    __atomic_store_n(&start_state, started == plan.nthreads? 1 : -1, __ATOMIC_RELEASE);
+
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(plan.threads[i].thread, NULL);
+    }
+
+    const uint64_t elapsed_ns = ts_monotonic_ns() - start_ns;
+    const double ticks_per_ns = elapsed_ns? (double)(ts_now() - start_ticks) / elapsed_ns : 1.0;
+
+    if (started < plan.nthreads) {
+        printf("Could not start replay thread %zu of %zu\n", started + 1, plan.nthreads);
+        _rp_destroy_plan(&plan);
+        tr_destroy(tr);
+        exit(1);
+    }
+
+    uint64_t peak_kb = 0;
+    _rp_read_status("VmHWM:", &peak_kb);
+
+    uint64_t malloc_latency[RP_BUCKETS] = {0};
+    uint64_t free_latency[RP_BUCKETS] = {0};
+    uint64_t malloc_max = 0;
+    uint64_t free_max = 0;
+    uint64_t failed = 0;
+    for (size_t i = 0; i < plan.nthreads; i++) {
+        const replayThread* thread = &plan.threads[i];
+        for (uint32_t bucket = 0; bucket < RP_BUCKETS; bucket++) {
+            malloc_latency[bucket] += thread->malloc_latency[bucket];
+            free_latency[bucket] += thread->free_latency[bucket];
+        }
+        malloc_max = thread->malloc_max > malloc_max? thread->malloc_max : malloc_max;
+        free_max = thread->free_max > free_max? thread->free_max : free_max;
+        failed += thread->failed;
+    }
+
+    const uint64_t operations = plan.nmallocs + plan.nfrees;
+    printf("\nReplayed %lu operations in %.3fs, %.0f operations/s\n", operations, elapsed_ns / 1e9,
+           elapsed_ns? operations * 1e9 / elapsed_ns : 0);
+    if (failed) {
+        printf("%lu allocations failed\n", failed);
+    }
+
+    printf("\n%-8s %10s %10s %10s %10s %10s %10s\n", "Latency", "p50", "p90", "p99", "p99.9", "p99.99", "max");
+    _rp_print_latencies("malloc", malloc_latency, plan.nmallocs, malloc_max, ticks_per_ns);
+    _rp_print_latencies("free", free_latency, plan.nfrees, free_max, ticks_per_ns);
+
+    printf("\nPeak RSS %.1f MB%s, %.1f MB before replaying, %.1f MB live at the recorded peak\n",
+           peak_kb / 1024.0, peak_reset? "" : " (including the preparation)", baseline_kb / 1024.0,
+           plan.peak_live_bytes / (1024.0 * 1024.0));
+
+    _rp_destroy_plan(&plan);
+    tr_destroy(tr);
+
+    return 0;
+}
+
+
+void print_usage(void) {
+    printf("Usage: memtrace-replay <trace> <option(s)>\n");
+    printf("  Replay the allocations of a trace recorded with memtrace -r <trace> to benchmark an allocator\n");
+    printf("  Reports throughput, malloc and free latency percentiles and peak RSS\n");
+    printf("  Every allocation is replayed as a malloc of the recorded size, reallocs as a free and a malloc\n");
+    printf("  -a <library>, Replay against the allocator in <library>, preloaded like LD_PRELOAD=<library> would\n");
+    printf("  -j <threads>, Threads decoding the trace (default one per CPU)\n");
+    printf("  -h, Display this information\n");
+}
+
+
+/**
+ * Turns the recorded events into one list of operations per recorded
+ * thread. Frees are paired with the allocation they release by sorting the
+ * events by address, each allocation gets a slot its free finds it through
+ */
+static bool _rp_plan(trace* tr, int nthreads, replayPlan* plan) {
+    memset(plan, 0, sizeof(replayPlan));
+
+    size_t nevents;
+    traceEvent* events = tr_sorted_events(tr, nthreads, &nevents);
+    size_t* order = malloc((nevents? nevents : 1) * sizeof(size_t));
+    size_t* partner = malloc((nevents? nevents : 1) * sizeof(size_t));
+    uint32_t* tids = malloc((nevents? nevents : 1) * sizeof(uint32_t));
+    uint32_t* slot_of = malloc((nevents? nevents : 1) * sizeof(uint32_t));
+    if (!events || !order || !partner || !tids || !slot_of) {
+        free(events);
+        free(order);
+        free(partner);
+        free(tids);
+        free(slot_of);
+        return false;
+    }
+
+    // A free releases the allocation right before it at the same address, if any
+    for (size_t i = 0; i < nevents; i++) {
+        order[i] = i;
+        partner[i] = RP_NO_EVENT;
+    }
+    sorting_events = events;
+    qsort(order, nevents, sizeof(size_t), _rp_compare_addresses);
+    for (size_t i = 1; i < nevents; i++) {
+        const traceEvent* previous = &events[order[i - 1]];
+        const traceEvent* event = &events[order[i]];
+        if (event->kind == TR_EVENT_FREE && previous->kind == TR_EVENT_ALLOC && previous->address == event->address) {
+            partner[order[i]] = order[i - 1];
+        }
+    }
+    free(order);
+
+    // Recorded threads are numbered in the order of their ids
+    size_t ntids = 0;
+    for (size_t i = 0; i < nevents; i++) {
+        tids[i] = events[i].tid;
+    }
+    qsort(tids, nevents, sizeof(uint32_t), _rp_compare_tids);
+    for (size_t i = 0; i < nevents; i++) {
+        if (!ntids || tids[ntids - 1] != tids[i]) {
+            tids[ntids++] = tids[i];
+        }
+    }
+
+    plan->threads = calloc(ntids? ntids : 1, sizeof(replayThread));
+    if (!plan->threads) {
+        free(events);
+        free(partner);
+        free(tids);
+        free(slot_of);
+        return false;
+    }
+    plan->nthreads = ntids;
+
+    for (size_t i = 0; i < nevents; i++) {
+        if (events[i].kind == TR_EVENT_ALLOC || partner[i] != RP_NO_EVENT) {
+            uint32_t* tid = bsearch(&events[i].tid, tids, ntids, sizeof(uint32_t), _rp_compare_tids);
+            plan->threads[tid - tids].nops++;
+        }
+        if (events[i].kind == TR_EVENT_ALLOC) {
+            plan->nslots++;
+        }
+    }
+
+    bool planned = plan->nslots < UINT32_MAX;
+    plan->slots = planned? calloc(plan->nslots? plan->nslots : 1, sizeof(replaySlot)) : NULL;
+    planned = plan->slots != NULL;
+    for (size_t i = 0; planned && i < ntids; i++) {
+        plan->threads[i].ops = malloc((plan->threads[i].nops? plan->threads[i].nops : 1) * sizeof(replayOp));
+        plan->threads[i].slots = plan->slots;
+        planned = plan->threads[i].ops != NULL;
+        plan->threads[i].nops = 0;
+    }
+
+    uint64_t live_bytes = 0;
+    for (size_t i = 0; planned && i < nevents; i++) {
+        const traceEvent* event = &events[i];
+        uint32_t thread = (uint32_t*)bsearch(&event->tid, tids, ntids, sizeof(uint32_t), _rp_compare_tids) - tids;
+        replayOp* op = &plan->threads[thread].ops[plan->threads[thread].nops];
+
+        if (event->kind == TR_EVENT_ALLOC) {
+            slot_of[i] = plan->nmallocs++;
+            op->block_size = event->block_size;
+            op->slot = slot_of[i];
+            op->kind = TR_EVENT_ALLOC;
+            op->wait = false;
+            plan->threads[thread].nops++;
+
+            live_bytes += event->block_size;
+            plan->peak_live_bytes = live_bytes > plan->peak_live_bytes? live_bytes : plan->peak_live_bytes;
+        } else if (partner[i] != RP_NO_EVENT) {
+            const traceEvent* allocation = &events[partner[i]];
+            op->block_size = 0;
+            op->slot = slot_of[partner[i]];
+            op->kind = TR_EVENT_FREE;
+            op->wait = allocation->tid != event->tid;
+            plan->threads[thread].nops++;
+            plan->nfrees++;
+
+            live_bytes -= allocation->block_size;
+        } else {
+            plan->unmatched++;
+        }
+    }
+
+    free(events);
+    free(partner);
+    free(tids);
+    free(slot_of);
+
+    if (!planned) {
+        _rp_destroy_plan(plan);
+        return false;
+    }
+
+    // Fault the slots in now so the replay's peak RSS is the allocator's
+    memset(plan->slots, 0, plan->nslots * sizeof(replaySlot));
+
+    return true;
+}
+
+
+static void _rp_destroy_plan(replayPlan* plan) {
+    for (size_t i = 0; plan->threads && i < plan->nthreads; i++) {
+        free(plan->threads[i].ops);
+    }
+    free(plan->threads);
+    free(plan->slots);
+}
+
+
+static void* _rp_replay(void* arg) {
+    replayThread* thread = arg;
+    replaySlot* slots = thread->slots;
+
+    int state;
+    while (!(state = __atomic_load_n(&start_state, __ATOMIC_ACQUIRE))) {
+        sched_yield();
+    }
+    if (state < 0) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < thread->nops; i++) {
+        const replayOp* op = &thread->ops[i];
+        replaySlot* slot = &slots[op->slot];
+
+        if (op->kind == TR_EVENT_ALLOC) {
+            const uint64_t start = ts_now();
+            void* block = malloc(op->block_size);
+            const uint64_t ticks = ts_now() - start;
+
+            thread->malloc_latency[_rp_bucket(ticks)]++;
+            thread->malloc_max = ticks > thread->malloc_max? ticks : thread->malloc_max;
+            if (!block && op->block_size) {
+                thread->failed++;
+            }
+
+            // Programs write what they allocate, without it large blocks would never be resident
+            for (size_t offset = 0; block && offset < op->block_size; offset += page_size) {
+                ((volatile char*)block)[offset] = 0;
+            }
+
+            slot->block = block;
+            __atomic_store_n(&slot->ready, 1, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        for (uint32_t spins = 0; op->wait && !__atomic_load_n(&slot->ready, __ATOMIC_ACQUIRE); spins++) {
+            if (spins >= RP_SPINS) {
+                sched_yield();
+            }
+        }
+
+        const uint64_t start = ts_now();
+        free(slot->block);
+        const uint64_t ticks = ts_now() - start;
+
+        thread->free_latency[_rp_bucket(ticks)]++;
+        thread->free_max = ticks > thread->free_max? ticks : thread->free_max;
+    }
+
+    return NULL;
+}
+
+
+static inline uint32_t _rp_bucket(uint64_t ticks) {
+    if (ticks < 2 * RP_SUB_BUCKETS) {
+        return ticks;
+    }
+
+    // The top RP_SUB_BITS bits below the leading one pick the sub-bucket
+    const uint32_t exponent = 63 - __builtin_clzll(ticks);
+    const uint32_t sub_bucket = (ticks >> (exponent - RP_SUB_BITS)) & (RP_SUB_BUCKETS - 1);
+
+    return 2 * RP_SUB_BUCKETS + (exponent - RP_SUB_BITS - 1) * RP_SUB_BUCKETS + sub_bucket;
+}
+
+
+// Middle of the range of ticks a bucket counts
+static uint64_t _rp_bucket_value(uint32_t bucket) {
+    if (bucket < 2 * RP_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    const uint32_t exponent = (bucket - 2 * RP_SUB_BUCKETS) / RP_SUB_BUCKETS + RP_SUB_BITS + 1;
+    const uint64_t sub_bucket = (bucket - 2 * RP_SUB_BUCKETS) % RP_SUB_BUCKETS;
+    const uint64_t width = 1ULL << (exponent - RP_SUB_BITS);
+
+    return (RP_SUB_BUCKETS + sub_bucket) * width + width / 2;
+}
+
+
+static uint64_t _rp_percentile(const uint64_t* buckets, uint64_t count, uint64_t max, double percentile) {
+    const uint64_t rank = (uint64_t)(count * percentile / 100.0);
+    uint64_t seen = 0;
+    for (uint32_t bucket = 0; bucket < RP_BUCKETS; bucket++) {
+        seen += buckets[bucket];
+        if (seen > rank) {
+            const uint64_t value = _rp_bucket_value(bucket);
+            return value < max? value : max;
+        }
+    }
+
+    return max;
+}
+
+
+static void _rp_print_latencies(const char* label, const uint64_t* buckets, uint64_t count, uint64_t max, double ticks_per_ns) {
+    static const double percentiles[] = {50, 90, 99, 99.9, 99.99};
+    char value[32];
+
+    printf("%-8s", label);
+    for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+        _rp_format_ns(value, sizeof(value), _rp_percentile(buckets, count, max, percentiles[i]) / ticks_per_ns);
+        printf(" %10s", value);
+    }
+    _rp_format_ns(value, sizeof(value), max / ticks_per_ns);
+    printf(" %10s\n", value);
+}
+
+
+static void _rp_format_ns(char* buf, size_t size, double ns) {
+    if (ns < 1e3) {
+        snprintf(buf, size, "%.0fns", ns);
+    } else if (ns < 1e6) {
+        snprintf(buf, size, "%.1fus", ns / 1e3);
+    } else {
+        snprintf(buf, size, "%.1fms", ns / 1e6);
+    }
+}
+
+
+// Reads a kB field such as VmRSS: of /proc/self/status
+static bool _rp_read_status(const char* field, uint64_t* kb) {
+    FILE* status = fopen("/proc/self/status", "r");
+    if (!status) {
+        return false;
+    }
+
+    char line[256];
+    bool found = false;
+    const size_t length = strlen(field);
+    while (!found && fgets(line, sizeof(line), status)) {
+        found = strncmp(line, field, length) == 0 && sscanf(line + length, "%lu", kb) == 1;
+    }
+    fclose(status);
+
+    return found;
+}
+
+
+static int _rp_compare_addresses(const void* a, const void* b) {
+    const size_t index_a = *(const size_t*)a;
+    const size_t index_b = *(const size_t*)b;
+    const uint64_t address_a = sorting_events[index_a].address;
+    const uint64_t address_b = sorting_events[index_b].address;
+
+    // Events at one address stay in time order
+    if (address_a != address_b) {
+        return (address_a > address_b) - (address_a < address_b);
+    }
+    return (index_a > index_b) - (index_a < index_b);
+}
+
+
+static int _rp_compare_tids(const void* a, const void* b) {
+    const uint32_t tid_a = *(const uint32_t*)a;
+    const uint32_t tid_b = *(const uint32_t*)b;
+
+    return (tid_a > tid_b) - (tid_a < tid_b);
+}
@@ -0,0 +1,435 @@
+/*
+ * Copyright (C) 2024 Alejandro Cadarso
+ *
+ * This file is part of Memtrace.
+ *
+ * Memtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Memtrace.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * File: resident.c
+ * Author: Alejandro Cadarso
+ * Date: 17-10-2026
+ *
+ * This file implements resident memory attribution. The live blocks are
+ * copied out of the hashtable and radix sorted by address, then swept in
+ * order while mincore is asked about whole runs of pages at a time: any
+ * run of pages covered by live blocks without a gap is mapped, so one call
+ * covers it. Pages shared by several blocks are split by the bytes each
+ * one covers, the blocks sharing a page are next to each other once sorted.
+ * Mapped regions are swept the same way, they are already sorted.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "resident.h"
+#include "sampling.h"
+#include "shmwrap.h"
+#include "timestamp.h"
+
+// Most pages asked about in one mincore call
+#define RS_BATCH_PAGES 16384
+
+struct residentTable {
+    // Set once the traced process measured, it may never get to
+    uint32_t measured;
+    uint64_t blocks;
+    uint64_t regions;
+    uint64_t pages;
+    uint64_t elapsed_ns;
+    residentCounters totals;
+    residentCounters sites[ST_MAX_SITES];
+};
+
+/**
+ * Shares of pages and sampling weights are fractional, they are summed as
+ * doubles and only rounded into the counters once the sweep is over
+ */
+typedef struct residentSums {
+    double heap_bytes;
+    double heap_resident_bytes;
+    double mapped_resident_bytes;
+} residentSums;
+
+// Position of a sweep over address sorted blocks
+typedef struct residentSweep {
+    const htBlock* blocks;
+    size_t length;
+    uint64_t page_size;
+    // Residency of the pages in [window_start, window_end) as mincore reports it
+    uint64_t window_start;
+    uint64_t window_end;
+    unsigned char window[RS_BATCH_PAGES];
+    // Bytes of blocks on the last shared page, pages are visited in order
+    uint64_t covered_page;
+    uint64_t covered_bytes;
+    uint64_t pages;
+    residentSums totals;
+    residentSums* sites;
+} residentSweep;
+
+static htBlock* _rs_sort(htBlock* blocks, htBlock* buffer, size_t length);
+static void _rs_sweep(residentTable* rs, residentSweep* sweep, bool mapped, uint64_t sample_interval);
+static bool _rs_resident(residentSweep* sweep, size_t index, uint64_t page);
+static void _rs_round(residentCounters* counters, const residentSums* sums);
+static uint64_t _rs_covered(residentSweep* sweep, size_t index, uint64_t page);
+static inline uint64_t _rs_overlap(const htBlock* block, uint64_t page, uint64_t page_size);
+static int _rs_compare_resident(const void* a, const void* b);
+
+// Table whose sites are being sorted by rs_print, qsort takes no context
+static residentTable* sorting_table;
+
+
+/************************************************************************************************************
+ *                                          PUBLIC FUNCTIONS                                                *
+ ***********************************************************************************************************/
+
+
+residentTable* rs_create() {
+    residentTable* rs = shmload(shmalloc(sizeof(residentTable)));
+    if (!rs) {
+        return NULL;
+    }
+
+    shm_set_root(SHM_ROOT_RS, shmoffset(rs));
+
+    return rs;
+}
+
+
+residentTable* rs_load() {
+    return shmload(shm_root(SHM_ROOT_RS));
+}
+
+
+void rs_destroy(residentTable* rs) {
+    if (!rs) { return; }
+
+    shm_set_root(SHM_ROOT_RS, 0);
+    shmfree(shmoffset(rs), sizeof(residentTable));
+}
+
+
+bool rs_measure(residentTable* rs, hashTable* ht, mappingTable* mp, uint64_t sample_interval) {
+    const uint64_t start_ns = ts_monotonic_ns();
+
+    // Other threads may still allocate, leave room for the blocks they add meanwhile
+    htStats stats;
+    ht_stats(ht, &stats);
+    uint32_t nregions = 0;
+    const mappedRegion* regions = mp? mp_regions(mp, &nregions) : NULL;
+    const size_t capacity = stats.length + stats.length / 8 + nregions + 1;
+
+    htBlock* blocks = malloc(capacity * sizeof(htBlock));
+    htBlock* buffer = malloc(capacity * sizeof(htBlock));
+    residentSweep* sweep = malloc(sizeof(residentSweep));
+    residentSums* sums = calloc(ST_MAX_SITES, sizeof(residentSums));
+    if (!blocks || !buffer || !sweep || !sums) {
+        free(blocks);
+        free(buffer);
+        free(sweep);
+        free(sums);
+        return false;
+    }
+
+    memset(rs->sites, 0, sizeof(rs->sites));
+    memset(&rs->totals, 0, sizeof(rs->totals));
+    memset(sweep, 0, sizeof(residentSweep));
+    sweep->page_size = sysconf(_SC_PAGESIZE);
+    sweep->sites = sums;
+
+    const size_t nblocks = ht_collect(ht, blocks, capacity);
+    sweep->blocks = _rs_sort(blocks, buffer, nblocks);
+    sweep->length = nblocks;
+    _rs_sweep(rs, sweep, false, sample_interval);
+
+    // Regions are kept sorted, and never share pages with heap blocks
+    uint32_t length = 0;
+    for (uint32_t i = 0; i < nregions && length < capacity; i++) {
+        blocks[length++] = (htBlock){
+            .address = regions[i].start,
+            .block_size = regions[i].end - regions[i].start,
+            .site_id = regions[i].site_id
+        };
+    }
+    sweep->blocks = blocks;
+    sweep->length = length;
+    sweep->window_start = sweep->window_end = 0;
+    sweep->covered_page = 0;
+    _rs_sweep(rs, sweep, true, 0);
+
+    for (siteId id = 0; id < ST_MAX_SITES; id++) {
+        _rs_round(&rs->sites[id], &sums[id]);
+    }
+    _rs_round(&rs->totals, &sweep->totals);
+
+    rs->blocks = nblocks;
+    rs->regions = length;
+    rs->pages = sweep->pages;
+    rs->elapsed_ns = ts_monotonic_ns() - start_ns;
+    __atomic_store_n(&rs->measured, 1, __ATOMIC_RELEASE);
+
+    free(blocks);
+    free(buffer);
+    free(sweep);
+    free(sums);
+
+    return true;
+}
+
+
+const residentCounters* rs_counters(residentTable* rs, siteId id) {
+    if (!rs || id >= ST_MAX_SITES) {
+        return NULL;
+    }
+
+    return &rs->sites[id];
+}
+
+
+void rs_print(residentTable* rs, siteTable* st, uint32_t top) {
+    if (!rs) { return; }
+
+    printf("Resident memory at exit\n");
+    printf("--------------------------------------------------------------\n");
+    printf("Heap pages are counted whole and split between the blocks on them in proportion to\n");
+    printf("their bytes, a block's share includes allocator headers and free space next to it,\n");
+    printf("so resident bytes can exceed live bytes\n");
+    if (!__atomic_load_n(&rs->measured, __ATOMIC_ACQUIRE)) {
+        printf("\nNot measured, the program did not exit through exit() or by returning from main\n");
+        printf("--------------------------------------------------------------\n\n");
+        return;
+    }
+
+    const residentCounters* totals = &rs->totals;
+    const uint64_t resident_bytes = totals->heap_resident_bytes + totals->mapped_resident_bytes;
+    printf("\nHeap: %lu bytes resident of %lu bytes live in %lu blocks\n", totals->heap_resident_bytes,
+           totals->heap_bytes, rs->blocks);
+    printf("Mappings: %lu bytes resident of %lu bytes mapped in %lu regions\n", totals->mapped_resident_bytes,
+           totals->mapped_bytes, rs->regions);
+    printf("Measured %lu pages in %.3fs\n", rs->pages, rs->elapsed_ns / 1e9);
+
+    const uint32_t nsites = st_length(st) < ST_MAX_SITES? st_length(st) : ST_MAX_SITES;
+    siteId* ids = malloc((nsites? nsites : 1) * sizeof(siteId));
+    if (!ids) {
+        fputs("Resident report allocation failure\n", stderr);
+        return;
+    }
+
+    uint32_t length = 0;
+    for (siteId id = 0; id < nsites; id++) {
+        if (rs->sites[id].heap_bytes || rs->sites[id].mapped_bytes) {
+            ids[length++] = id;
+        }
+    }
+
+    sorting_table = rs;
+    qsort(ids, length, sizeof(siteId), _rs_compare_resident);
+
+    for (uint32_t i = 0; i < length && i < top; i++) {
+        const residentCounters* site = &rs->sites[ids[i]];
+        const uint64_t site_resident = site->heap_resident_bytes + site->mapped_resident_bytes;
+
+        printf("\n#%u: %lu bytes resident (%.1f%%)\n", i + 1, site_resident,
+               resident_bytes? 100.0 * site_resident / resident_bytes : 0);
+        if (site->heap_bytes) {
+            printf("Heap: %lu bytes resident of %lu bytes live\n", site->heap_resident_bytes, site->heap_bytes);
+        }
+        if (site->mapped_bytes) {
+            printf("Mapped: %lu bytes resident of %lu bytes mapped\n", site->mapped_resident_bytes, site->mapped_bytes);
+        }
+        printf("\n");
+        st_print_frames(st, ids[i], stdout);
+    }
+    if (length > top) {
+        printf("\n%u more call sites not shown, use -t to show more\n", length - top);
+    }
+    printf("--------------------------------------------------------------\n\n");
+
+    free(ids);
+}
+
+
+/************************************************************************************************************
+ *                                          PRIVATE FUNCTIONS                                               *
+ ***********************************************************************************************************/
+
+
+/**
+ * LSD radix sort by address a byte at a time, returns whichever of the two
+ * arrays ends up holding the result. Bytes every address shares are skipped,
+ * which leaves the handful that differ between heap addresses
+ */
+static htBlock* _rs_sort(htBlock* blocks, htBlock* buffer, size_t length) {
+    if (length < 2) {
+        return blocks;
+    }
+
+    for (int shift = 0; shift < 64; shift += 8) {
+        size_t counts[256] = {0};
+        for (size_t i = 0; i < length; i++) {
+            counts[(blocks[i].address >> shift) & 0xff]++;
+        }
+        if (counts[(blocks[0].address >> shift) & 0xff] == length) {
+            continue;
+        }
+
+        size_t offset = 0;
+        for (int digit = 0; digit < 256; digit++) {
+            size_t count = counts[digit];
+            counts[digit] = offset;
+            offset += count;
+        }
+        for (size_t i = 0; i < length; i++) {
+            buffer[counts[(blocks[i].address >> shift) & 0xff]++] = blocks[i];
+        }
+
+        htBlock* sorted = buffer;
+        buffer = blocks;
+        blocks = sorted;
+    }
+
+    return blocks;
+}
+
+
+static void _rs_sweep(residentTable* rs, residentSweep* sweep, bool mapped, uint64_t sample_interval) {
+    const uint64_t page_size = sweep->page_size;
+
+    for (size_t i = 0; i < sweep->length; i++) {
+        const htBlock* block = &sweep->blocks[i];
+        if (!block->block_size) {
+            continue;
+        }
+
+        const uint64_t end = block->address + block->block_size;
+        double resident = 0;
+        for (uint64_t page = block->address & ~(page_size - 1); page < end; page += page_size) {
+            if (!_rs_resident(sweep, i, page)) {
+                continue;
+            }
+
+            const uint64_t overlap = _rs_overlap(block, page, page_size);
+            resident += overlap == page_size? page_size : (double)page_size * overlap / _rs_covered(sweep, i, page);
+        }
+
+        const siteId id = block->site_id < ST_MAX_SITES? block->site_id : ST_UNKNOWN_SITE;
+        residentSums* site = &sweep->sites[id];
+        if (mapped) {
+            rs->sites[id].mapped_bytes += block->block_size;
+            rs->totals.mapped_bytes += block->block_size;
+            site->mapped_resident_bytes += resident;
+            sweep->totals.mapped_resident_bytes += resident;
+        } else {
+            // A sampled block stands for the ones that were not, like in every other report
+            const double weight = sp_weight(block->block_size, sample_interval);
+            site->heap_bytes += weight * block->block_size;
+            site->heap_resident_bytes += weight * resident;
+            sweep->totals.heap_bytes += weight * block->block_size;
+            sweep->totals.heap_resident_bytes += weight * resident;
+        }
+    }
+}
+
+
+static void _rs_round(residentCounters* counters, const residentSums* sums) {
+    counters->heap_bytes = sums->heap_bytes + 0.5;
+    counters->heap_resident_bytes = sums->heap_resident_bytes + 0.5;
+    counters->mapped_resident_bytes = sums->mapped_resident_bytes + 0.5;
+}
+
+
+static bool _rs_resident(residentSweep* sweep, size_t index, uint64_t page) {
+    const uint64_t page_size = sweep->page_size;
+
+    if (page >= sweep->window_start && page < sweep->window_end) {
+        return sweep->window[(page - sweep->window_start) / page_size] & 1;
+    }
+
+    // Every page up to the first gap between blocks is mapped, they can all go in one call
+    const uint64_t limit = page + RS_BATCH_PAGES * page_size;
+    const htBlock* block = &sweep->blocks[index];
+    uint64_t end = (block->address + block->block_size + page_size - 1) & ~(page_size - 1);
+    for (size_t i = index + 1; i < sweep->length && end < limit; i++) {
+        block = &sweep->blocks[i];
+        if ((block->address & ~(page_size - 1)) > end) {
+            break;
+        }
+        const uint64_t block_end = (block->address + block->block_size + page_size - 1) & ~(page_size - 1);
+        end = block_end > end? block_end : end;
+    }
+    end = end < limit? end : limit;
+
+    const uint64_t npages = (end - page) / page_size;
+    if (mincore((void*)page, end - page, sweep->window) != 0) {
+        // Something was unmapped after the blocks were collected, ask page by page
+        for (uint64_t i = 0; i < npages; i++) {
+            if (mincore((void*)(page + i * page_size), page_size, &sweep->window[i]) != 0) {
+                sweep->window[i] = 0;
+            }
+        }
+    }
+
+    sweep->window_start = page;
+    sweep->window_end = end;
+    sweep->pages += npages;
+
+    return sweep->window[0] & 1;
+}
+
+
+// Bytes of page covered by any block, only called for pages the block at index shares
+static uint64_t _rs_covered(residentSweep* sweep, size_t index, uint64_t page) {
+    if (sweep->covered_page == page) {
+        return sweep->covered_bytes;
+    }
+
+    const uint64_t page_size = sweep->page_size;
+    uint64_t bytes = 0;
+
+    // Blocks don't overlap, ends are sorted like starts and the scan stops at the first one before the page
+    for (size_t i = index; i-- > 0 && sweep->blocks[i].address + sweep->blocks[i].block_size > page;) {
+        bytes += _rs_overlap(&sweep->blocks[i], page, page_size);
+    }
+    for (size_t i = index; i < sweep->length && sweep->blocks[i].address < page + page_size; i++) {
+        bytes += _rs_overlap(&sweep->blocks[i], page, page_size);
+    }
+
+    sweep->covered_page = page;
+    sweep->covered_bytes = bytes;
+
+    return bytes;
+}
+
+
+static inline uint64_t _rs_overlap(const htBlock* block, uint64_t page, uint64_t page_size) {
+    const uint64_t start = block->address > page? block->address : page;
+    const uint64_t block_end = block->address + block->block_size;
+    const uint64_t end = block_end < page + page_size? block_end : page + page_size;
+
+    return end > start? end - start : 0;
+}
+
+
+static int _rs_compare_resident(const void* a, const void* b) {
+    const residentCounters* site_a = &sorting_table->sites[*(const siteId*)a];
+    const residentCounters* site_b = &sorting_table->sites[*(const siteId*)b];
+    const uint64_t bytes_a = site_a->heap_resident_bytes + site_a->mapped_resident_bytes;
+    const uint64_t bytes_b = site_b->heap_resident_bytes + site_b->mapped_resident_bytes;
+
+    return (bytes_a < bytes_b) - (bytes_a > bytes_b);
+}
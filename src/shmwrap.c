@@ -20,42 +20,205 @@
  * Author: Alejandro Cadarso
  * Date: 28-05-2024
  *
- * This file provides a wrapper around system-shared memory (sys/shm)
- * functionalities for the Memtrace memory profiling tool. It offers
- * simplified interfaces for creating, attaching, and detaching shared
- * memory segments, as well as removing them once they are no longer needed.
- * These wrappers facilitate the management of shared memory segments used
- * by Memtrace to store memory allocation and deallocation records, enabling
- * efficient inter-process communication between the target application and
- * the profiling tool. The implementation abstracts away the complexities
- * of direct sys/shm API calls, making it easier to integrate shared memory
- * management into the broader application  architecture.
+ * This file provides the shared memory region of a memtrace session. The
+ * region is an anonymous memfd, so concurrent sessions on the same host
+ * never share anything, truncated to a large size and mapped with
+ * MAP_NORESERVE: pages only cost memory once touched. memtrace creates it
+ * and the traced process inherits the descriptor through exec, the fd
+ * number travels in the environment. Every process maps the whole
+ * reservation once, blocks are then addressed by their offset and growing
+ * a table is just allocating another block, no segment is ever created,
+ * attached or remapped.
+ *
+ * Blocks come from a bump allocator with power of two size classes. Freed
+ * blocks have their pages punched out of the memfd, which both returns the
+ * memory and leaves them zero filled for the next user of the class.
  *
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include "shmwrap.h"
 
-int shmalloc(key_t key, size_t size ) {
-    int shmid = shmget(key, size, IPC_CREAT | 0666);
-    return shmid;
+// Address space reserved for a session, memory is only used as it's touched
+#define SHM_REGION_SIZE (1UL << 40)
+
+#define SHM_PAGE_SIZE 4096UL
+#define SHM_HUGE_PAGE_SIZE (2UL << 20)
+#define SHM_MIN_CLASS 12
+#define SHM_CLASSES 41
+
+// Kept out of the way of the low descriptors the traced program may expect
+#define SHM_FD_MIN 512
+
+#define SHM_FD_ENV "MEMTRACE_SHM_FD"
+
+typedef struct shmHeader {
+    uint64_t cursor;
+    pthread_mutex_t mutex;
+    // Freed blocks by size class, each holds the offset of the next
+    shmOffset free_lists[SHM_CLASSES];
+    shmOffset roots[SHM_ROOTS];
+} shmHeader;
+
+char* shm_base = NULL;
+static int shm_fd = -1;
+
+#define SHM_HEADER \
+    ((shmHeader*)shm_base)
+
+static bool _shm_map(int fd);
+static int _shm_class_of(size_t size);
+
+
+bool shm_create(void) {
+    int fd = memfd_create("memtrace", 0);
+    if (fd < 0) {
+        return false;
+    }
+
+    int high_fd = fcntl(fd, F_DUPFD, SHM_FD_MIN);
+    if (high_fd >= 0) {
+        close(fd);
+        fd = high_fd;
+    }
+
+    if (ftruncate(fd, SHM_REGION_SIZE) != 0 || !_shm_map(fd)) {
+        close(fd);
+        return false;
+    }
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&SHM_HEADER->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    SHM_HEADER->cursor = (sizeof(shmHeader) + SHM_PAGE_SIZE - 1) & ~(SHM_PAGE_SIZE - 1);
+
+    // The descriptor is inherited through exec, its number through the environment
+    char fd_str[16];
+    sprintf(fd_str, "%d", fd);
+    setenv(SHM_FD_ENV, fd_str, 1);
+
+    return true;
+}
+
+bool shm_attach(void) {
+    if (shm_base) {
+        return true;
+    }
+
+    char* fd_str = getenv(SHM_FD_ENV);
+    if (!fd_str) {
+        return false;
+    }
+
+    return _shm_map(atoi(fd_str));
 }
 
-void* shmload(int shmid) {
-    void* ptr = shmat(shmid, NULL, 0);
-    if (ptr == (void*)-1) {
-        return NULL;
+void shm_destroy(void) {
+    if (!shm_base) {
+        return;
     }
 
-    return ptr;
+    pthread_mutex_destroy(&SHM_HEADER->mutex);
+    munmap(shm_base, SHM_REGION_SIZE);
+    close(shm_fd);
+    unsetenv(SHM_FD_ENV);
+
+    shm_base = NULL;
+    shm_fd = -1;
 }
 
-bool shmfree(void* ptr, int shmid) {
-    shmdt(ptr);
-    if (shmctl(shmid, IPC_RMID, NULL) == -1) {
+shmOffset shmalloc(size_t size) {
+    if (!shm_base) {
+        return 0;
+    }
+
+    int class = _shm_class_of(size);
+    if (class < 0) {
+        return 0;
+    }
+
+    shmHeader* header = SHM_HEADER;
+    shmOffset offset = 0;
+
+    pthread_mutex_lock(&header->mutex);
+
+    if (header->free_lists[class]) {
+        offset = header->free_lists[class];
+        header->free_lists[class] = *(shmOffset*)(shm_base + offset);
+        // The link was the only thing written since the pages were punched
+        *(shmOffset*)(shm_base + offset) = 0;
+    } else {
+        // Blocks are aligned to their size, up to a huge page
+        const uint64_t block_size = 1UL << class;
+        const uint64_t align = block_size < SHM_HUGE_PAGE_SIZE? block_size : SHM_HUGE_PAGE_SIZE;
+        const uint64_t start = (header->cursor + align - 1) & ~(align - 1);
+        if (start + block_size <= SHM_REGION_SIZE) {
+            offset = start;
+            header->cursor = start + block_size;
+        }
+    }
+
+    pthread_mutex_unlock(&header->mutex);
+
+    return offset;
+}
+
+void shmfree(shmOffset offset, size_t size) {
+    if (!shm_base || !offset) {
+        return;
+    }
+
+    int class = _shm_class_of(size);
+
+    fallocate(shm_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, 1UL << class);
+
+    shmHeader* header = SHM_HEADER;
+    pthread_mutex_lock(&header->mutex);
+    *(shmOffset*)(shm_base + offset) = header->free_lists[class];
+    header->free_lists[class] = offset;
+    pthread_mutex_unlock(&header->mutex);
+}
+
+void shmadvise_huge(shmOffset offset, size_t size) {
+    // Only a hint, shmem THP may well be disabled
+    madvise(shm_base + offset, size, MADV_HUGEPAGE);
+}
+
+void shm_set_root(shmRoot root, shmOffset offset) {
+    __atomic_store_n(&SHM_HEADER->roots[root], offset, __ATOMIC_RELEASE);
+}
+
+shmOffset shm_root(shmRoot root) {
+    return shm_base? __atomic_load_n(&SHM_HEADER->roots[root], __ATOMIC_ACQUIRE) : 0;
+}
+
+static bool _shm_map(int fd) {
+    void* base = mmap(NULL, SHM_REGION_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+    if (base == MAP_FAILED) {
         return false;
     }
 
+    shm_base = base;
+    shm_fd = fd;
+
     return true;
 }
+
+static int _shm_class_of(size_t size) {
+    int class = SHM_MIN_CLASS;
+    while (class < SHM_CLASSES && (1UL << class) < size) {
+        class++;
+    }
+
+    return class < SHM_CLASSES? class : -1;
+}
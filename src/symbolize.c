@@ -0,0 +1,864 @@
+/*
+ * Copyright (C) 2024 Alejandro Cadarso
+ *
+ * This file is part of Memtrace.
+ *
+ * Memtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Memtrace.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * File: symbolize.c
+ * Author: Alejandro Cadarso
+ * Date: 17-10-2026
+ *
+ * This file implements the symbolizer. Every module file is mapped read
+ * only the first time one of its addresses is resolved, and indexed once:
+ * its function symbols and its DWARF line table rows are sorted by
+ * address, so every later lookup is a pair of binary searches. Index
+ * strings point into the mapping, nothing is copied.
+ *
+ * Modules without a symbol table or line table of their own are completed
+ * from their separate debug file under /usr/lib/debug/.build-id when it is
+ * installed. Only 64 bit ELF files and DWARF 2 to 5 line tables are read,
+ * compressed debug sections are skipped.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <elf.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "symbolize.h"
+
+#define SY_DEBUG_DIR "/usr/lib/debug/.build-id"
+
+// DWARF line program opcodes and forms, see the DWARF 5 standard section 6.2
+#define DW_LNS_copy 1
+#define DW_LNS_advance_pc 2
+#define DW_LNS_advance_line 3
+#define DW_LNS_set_file 4
+#define DW_LNS_const_add_pc 8
+#define DW_LNS_fixed_advance_pc 9
+#define DW_LNE_end_sequence 1
+#define DW_LNE_set_address 2
+#define DW_LNCT_path 1
+#define DW_LNCT_directory_index 2
+#define DW_FORM_data2 0x05
+#define DW_FORM_data4 0x06
+#define DW_FORM_data8 0x07
+#define DW_FORM_string 0x08
+#define DW_FORM_block 0x09
+#define DW_FORM_data1 0x0b
+#define DW_FORM_strp 0x0e
+#define DW_FORM_udata 0x0f
+#define DW_FORM_data16 0x1e
+#define DW_FORM_line_strp 0x1f
+
+// Entry formats a DWARF 5 directory or file table may describe
+#define SY_MAX_FORMATS 16
+// Include directories kept per line table unit
+#define SY_MAX_DIRECTORIES 256
+
+typedef struct elfSymbol {
+    uint64_t address;
+    uint64_t size;
+    const char* name;
+} elfSymbol;
+
+// Rows with line 0 end a sequence, addresses past them have no line
+typedef struct lineRow {
+    uint64_t address;
+    uint32_t file;
+    uint32_t line;
+} lineRow;
+
+typedef struct lineFile {
+    const char* directory;
+    const char* name;
+} lineFile;
+
+typedef struct elfFile {
+    const uint8_t* data;
+    size_t size;
+} elfFile;
+
+typedef struct elfSection {
+    const uint8_t* data;
+    size_t size;
+} elfSection;
+
+/**
+ * The index of a module file, shared by every mapping of it. Built once
+ * under its lock, read without it once loaded is set
+ */
+typedef struct elfImage {
+    pthread_mutex_t mutex;
+    bool loaded;
+    char path[MM_MAX_PATH];
+    elfFile file;
+    elfFile debug_file;
+    const Elf64_Phdr* phdrs;
+    uint32_t nphdrs;
+    elfSymbol* symbols;
+    size_t nsymbols;
+    lineRow* rows;
+    size_t nrows;
+    lineFile* files;
+    size_t nfiles;
+} elfImage;
+
+struct symbolizer {
+    const moduleMap* mm;
+    pthread_mutex_t mutex;
+    uint32_t nimages;
+    // Image of every module of the map, looked up by path the first time
+    elfImage* image_of[MM_MAX_MODULES];
+    elfImage images[MM_MAX_MODULES];
+};
+
+// Growable arrays filled while indexing an image
+typedef struct lineTable {
+    lineRow* rows;
+    size_t nrows;
+    size_t rows_capacity;
+    lineFile* files;
+    size_t nfiles;
+    size_t files_capacity;
+} lineTable;
+
+typedef struct lineDirectories {
+    const char* names[SY_MAX_DIRECTORIES];
+    uint32_t length;
+} lineDirectories;
+
+// Debug sections a line table refers to
+typedef struct dwarfSections {
+    elfSection line;
+    elfSection line_str;
+    elfSection str;
+} dwarfSections;
+
+static elfImage* _sy_image(symbolizer* sy, const moduleInfo* module);
+static void _sy_load(elfImage* image);
+static bool _sy_map(const char* path, elfFile* file);
+static const Elf64_Shdr* _sy_section(const elfFile* file, const char* name, elfSection* section);
+static bool _sy_debug_path(const elfFile* file, char* path, size_t size);
+static void _sy_read_symbols(elfImage* image, const elfFile* file);
+static void _sy_read_lines(elfImage* image, const elfFile* file);
+static bool _sy_read_unit(const dwarfSections* dwarf, const uint8_t* p, const uint8_t* end, lineTable* table);
+/**
+ * Reads a DWARF 5 directory table into directories when table is NULL,
+ * or else a file table into table. Returns NULL if it can't be read
+ */
+static const uint8_t* _sy_read_entries(const dwarfSections* dwarf, const uint8_t* p, const uint8_t* end, int offset_size,
+                                       lineDirectories* directories, lineTable* table);
+static const uint8_t* _sy_read_form(const dwarfSections* dwarf, const uint8_t* p, const uint8_t* end, uint64_t form,
+                                    int offset_size, uint64_t* value, const char** string);
+static bool _sy_add_row(lineTable* table, uint64_t address, uint32_t file, uint32_t line);
+static bool _sy_add_file(lineTable* table, const char* directory, const char* name);
+static bool _sy_file_vaddr(const elfImage* image, uint64_t offset, uint64_t* vaddr);
+static const char* _sy_string(const elfSection* section, uint64_t offset);
+static uint64_t _read_uleb(const uint8_t** p, const uint8_t* end);
+static int64_t _read_sleb(const uint8_t** p, const uint8_t* end);
+static uint64_t _read_uint(const uint8_t** p, const uint8_t* end, int size);
+static int _compare_symbols(const void* a, const void* b);
+static int _compare_rows(const void* a, const void* b);
+
+
+/************************************************************************************************************
+ *                                          PUBLIC FUNCTIONS                                                *
+ ***********************************************************************************************************/
+
+
+symbolizer* sy_create(const moduleMap* mm) {
+    symbolizer* sy = calloc(1, sizeof(symbolizer));
+    if (!sy) {
+        return NULL;
+    }
+
+    sy->mm = mm;
+    pthread_mutex_init(&sy->mutex, NULL);
+    for (int i = 0; i < MM_MAX_MODULES; i++) {
+        pthread_mutex_init(&sy->images[i].mutex, NULL);
+    }
+
+    return sy;
+}
+
+
+void sy_destroy(symbolizer* sy) {
+    if (!sy) { return; }
+
+    for (int i = 0; i < MM_MAX_MODULES; i++) {
+        elfImage* image = &sy->images[i];
+        if (image->file.data) {
+            munmap((void*)image->file.data, image->file.size);
+        }
+        if (image->debug_file.data) {
+            munmap((void*)image->debug_file.data, image->debug_file.size);
+        }
+        free(image->symbols);
+        free(image->rows);
+        free(image->files);
+        pthread_mutex_destroy(&image->mutex);
+    }
+
+    pthread_mutex_destroy(&sy->mutex);
+    free(sy);
+}
+
+
+bool sy_resolve(symbolizer* sy, uintptr_t pc, symbolInfo* info) {
+    memset(info, 0, sizeof(symbolInfo));
+
+    const moduleInfo* module = mm_find(sy->mm, pc);
+    if (!module || !pc) {
+        return false;
+    }
+
+    elfImage* image = _sy_image(sy, module);
+    uint64_t vaddr;
+    // Return addresses point past the call, step back into it
+    if (!image || !_sy_file_vaddr(image, pc - 1 - module->start + module->offset, &vaddr)) {
+        return false;
+    }
+
+    // Last symbol starting at or before the address
+    size_t low = 0, high = image->nsymbols;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (image->symbols[mid].address <= vaddr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low) {
+        const elfSymbol* symbol = &image->symbols[low - 1];
+        if (!symbol->size || vaddr < symbol->address + symbol->size) {
+            info->function = symbol->name;
+        }
+    }
+
+    // Same for the line table rows
+    low = 0, high = image->nrows;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (image->rows[mid].address <= vaddr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low && image->rows[low - 1].line && image->files[image->rows[low - 1].file].name) {
+        const lineRow* row = &image->rows[low - 1];
+        info->directory = image->files[row->file].directory;
+        info->file = image->files[row->file].name;
+        info->line = row->line;
+    }
+
+    return info->function || info->file;
+}
+
+
+int sy_format(const symbolInfo* info, char* buffer, size_t size) {
+    if (!info->function && !info->file) {
+        if (size) { buffer[0] = '\0'; }
+        return 0;
+    }
+
+    const char* function = info->function? info->function : "??";
+    if (!info->file) {
+        return snprintf(buffer, size, "%s", function);
+    }
+
+    // Relative file names are relative to their compilation directory
+    bool relative = info->file[0] != '/' && info->directory && info->directory[0];
+    return snprintf(buffer, size, "%s at %s%s%s:%u", function, relative? info->directory : "",
+                    relative? "/" : "", info->file, info->line);
+}
+
+
+/************************************************************************************************************
+ *                                          PRIVATE FUNCTIONS                                               *
+ ***********************************************************************************************************/
+
+
+static elfImage* _sy_image(symbolizer* sy, const moduleInfo* module) {
+    const uint32_t index = module - sy->mm->modules;
+    elfImage* image = __atomic_load_n(&sy->image_of[index], __ATOMIC_ACQUIRE);
+
+    if (!image) {
+        // Snapshots repeat modules, every mapping of a file shares its image
+        pthread_mutex_lock(&sy->mutex);
+        for (uint32_t i = 0; i < sy->nimages && !image; i++) {
+            if (strcmp(sy->images[i].path, module->path) == 0) {
+                image = &sy->images[i];
+            }
+        }
+        if (!image && sy->nimages < MM_MAX_MODULES) {
+            image = &sy->images[sy->nimages++];
+            strncpy(image->path, module->path, MM_MAX_PATH - 1);
+        }
+        __atomic_store_n(&sy->image_of[index], image, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&sy->mutex);
+    }
+
+    if (image && !__atomic_load_n(&image->loaded, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&image->mutex);
+        if (!image->loaded) {
+            _sy_load(image);
+            __atomic_store_n(&image->loaded, true, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&image->mutex);
+    }
+
+    return image;
+}
+
+
+static void _sy_load(elfImage* image) {
+    // Pseudo files like [vdso] can't be opened, they are left empty
+    if (image->path[0] != '/' || !_sy_map(image->path, &image->file)) {
+        return;
+    }
+
+    const Elf64_Ehdr* ehdr = (const Elf64_Ehdr*)image->file.data;
+    image->phdrs = (const Elf64_Phdr*)(image->file.data + ehdr->e_phoff);
+    image->nphdrs = ehdr->e_phoff + (uint64_t)ehdr->e_phnum * sizeof(Elf64_Phdr) <= image->file.size? ehdr->e_phnum : 0;
+
+    _sy_read_symbols(image, &image->file);
+    _sy_read_lines(image, &image->file);
+
+    // Stripped modules may have their tables in a separate debug file
+    char debug_path[MM_MAX_PATH];
+    if ((!image->nsymbols || !image->nrows) && _sy_debug_path(&image->file, debug_path, sizeof(debug_path)) &&
+        _sy_map(debug_path, &image->debug_file)) {
+        if (!image->nsymbols) {
+            _sy_read_symbols(image, &image->debug_file);
+        }
+        if (!image->nrows) {
+            _sy_read_lines(image, &image->debug_file);
+        }
+    }
+}
+
+
+static bool _sy_map(const char* path, elfFile* file) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Elf64_Ehdr)) {
+        close(fd);
+        return false;
+    }
+
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+
+    const Elf64_Ehdr* ehdr = data;
+    if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 || ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+        ehdr->e_ident[EI_DATA] != ELFDATA2LSB || ehdr->e_shentsize != sizeof(Elf64_Shdr) ||
+        ehdr->e_shoff + (uint64_t)ehdr->e_shnum * sizeof(Elf64_Shdr) > (uint64_t)st.st_size) {
+        munmap(data, st.st_size);
+        return false;
+    }
+
+    file->data = data;
+    file->size = st.st_size;
+
+    return true;
+}
+
+
+static const Elf64_Shdr* _sy_section(const elfFile* file, const char* name, elfSection* section) {
+    const Elf64_Ehdr* ehdr = (const Elf64_Ehdr*)file->data;
+    const Elf64_Shdr* shdrs = (const Elf64_Shdr*)(file->data + ehdr->e_shoff);
+
+    if (ehdr->e_shstrndx >= ehdr->e_shnum) {
+        return NULL;
+    }
+    const Elf64_Shdr* names = &shdrs[ehdr->e_shstrndx];
+    if (names->sh_offset + names->sh_size > file->size) {
+        return NULL;
+    }
+
+    for (int i = 0; i < ehdr->e_shnum; i++) {
+        const Elf64_Shdr* shdr = &shdrs[i];
+        if (shdr->sh_name >= names->sh_size ||
+            strncmp((const char*)file->data + names->sh_offset + shdr->sh_name, name, names->sh_size - shdr->sh_name) != 0) {
+            continue;
+        }
+        if (shdr->sh_type == SHT_NOBITS || (shdr->sh_flags & SHF_COMPRESSED) ||
+            shdr->sh_offset + shdr->sh_size > file->size) {
+            return NULL;
+        }
+        section->data = file->data + shdr->sh_offset;
+        section->size = shdr->sh_size;
+        return shdr;
+    }
+
+    return NULL;
+}
+
+
+static bool _sy_debug_path(const elfFile* file, char* path, size_t size) {
+    elfSection note;
+    if (!_sy_section(file, ".note.gnu.build-id", &note) || note.size < sizeof(Elf64_Nhdr)) {
+        return false;
+    }
+
+    const Elf64_Nhdr* nhdr = (const Elf64_Nhdr*)note.data;
+    const uint8_t* id = note.data + sizeof(Elf64_Nhdr) + ((nhdr->n_namesz + 3) & ~3);
+    if (nhdr->n_type != NT_GNU_BUILD_ID || nhdr->n_descsz < 2 || id + nhdr->n_descsz > note.data + note.size) {
+        return false;
+    }
+
+    // The first byte of the build id names the directory, the rest the file
+    int length = snprintf(path, size, "%s/%02x/", SY_DEBUG_DIR, id[0]);
+    for (uint32_t i = 1; i < nhdr->n_descsz && length + 3 < (int)size; i++) {
+        length += snprintf(path + length, size - length, "%02x", id[i]);
+    }
+
+    return snprintf(path + length, size - length, ".debug") < (int)(size - length);
+}
+
+
+static void _sy_read_symbols(elfImage* image, const elfFile* file) {
+    elfSection symtab, strtab;
+    const Elf64_Shdr* shdr = _sy_section(file, ".symtab", &symtab);
+    bool has_strings = shdr && _sy_section(file, ".strtab", &strtab);
+    if (!has_strings) {
+        // Stripped files still export their dynamic symbols
+        shdr = _sy_section(file, ".dynsym", &symtab);
+        has_strings = shdr && _sy_section(file, ".dynstr", &strtab);
+    }
+    if (!has_strings) {
+        return;
+    }
+
+    const Elf64_Sym* syms = (const Elf64_Sym*)symtab.data;
+    size_t nsyms = symtab.size / sizeof(Elf64_Sym);
+    image->symbols = malloc(nsyms * sizeof(elfSymbol));
+    if (!image->symbols) {
+        return;
+    }
+
+    for (size_t i = 0; i < nsyms; i++) {
+        if (ELF64_ST_TYPE(syms[i].st_info) != STT_FUNC || syms[i].st_shndx == SHN_UNDEF || !syms[i].st_value) {
+            continue;
+        }
+        const char* name = _sy_string(&strtab, syms[i].st_name);
+        if (!name || !name[0]) {
+            continue;
+        }
+        image->symbols[image->nsymbols++] = (elfSymbol){syms[i].st_value, syms[i].st_size, name};
+    }
+
+    qsort(image->symbols, image->nsymbols, sizeof(elfSymbol), _compare_symbols);
+}
+
+
+static void _sy_read_lines(elfImage* image, const elfFile* file) {
+    dwarfSections dwarf = {0};
+    if (!_sy_section(file, ".debug_line", &dwarf.line)) {
+        return;
+    }
+    _sy_section(file, ".debug_line_str", &dwarf.line_str);
+    _sy_section(file, ".debug_str", &dwarf.str);
+
+    // File 0 is the unknown file rows point to when their file number is out of range
+    lineTable table = {0};
+    _sy_add_file(&table, NULL, NULL);
+    const uint8_t* p = dwarf.line.data;
+    const uint8_t* end = dwarf.line.data + dwarf.line.size;
+
+    while (p + 4 <= end) {
+        uint64_t unit_length = _read_uint(&p, end, 4);
+        if (unit_length == 0xffffffff) {
+            unit_length = _read_uint(&p, end, 8);
+            // 64 bit units are read through the same path, flagged by the length field
+            if (unit_length > (uint64_t)(end - p) || !_sy_read_unit(&dwarf, p - 12, p + unit_length, &table)) {
+                break;
+            }
+        } else if (unit_length > (uint64_t)(end - p) || !_sy_read_unit(&dwarf, p - 4, p + unit_length, &table)) {
+            break;
+        }
+        p += unit_length;
+    }
+
+    qsort(table.rows, table.nrows, sizeof(lineRow), _compare_rows);
+
+    image->rows = table.rows;
+    image->nrows = table.nrows;
+    image->files = table.files;
+    image->nfiles = table.nfiles;
+}
+
+
+static bool _sy_read_unit(const dwarfSections* dwarf, const uint8_t* p, const uint8_t* end, lineTable* table) {
+    const int offset_size = _read_uint(&p, end, 4) == 0xffffffff? 8 : 4;
+    if (offset_size == 8) {
+        p += 8;
+    }
+
+    const uint16_t version = _read_uint(&p, end, 2);
+    if (version < 2 || version > 5) {
+        // Unknown layouts can't be skipped into, the unit length is still good
+        return true;
+    }
+    if (version >= 5) {
+        p += 2;  // address_size, segment_selector_size
+    }
+
+    const uint64_t header_length = _read_uint(&p, end, offset_size);
+    const uint8_t* program = p + header_length;
+    if (program > end) {
+        return false;
+    }
+
+    const uint8_t min_instruction_length = _read_uint(&p, end, 1);
+    if (version >= 4) {
+        p++;  // maximum_operations_per_instruction, always 1 outside of VLIW targets
+    }
+    p++;  // default_is_stmt
+    const int8_t line_base = (int8_t)_read_uint(&p, end, 1);
+    const uint8_t line_range = _read_uint(&p, end, 1);
+    const uint8_t opcode_base = _read_uint(&p, end, 1);
+    const uint8_t* opcode_lengths = p;
+    p += opcode_base? opcode_base - 1 : 0;
+    if (!line_range || p > program) {
+        return true;
+    }
+
+    // File numbers are 1 based before DWARF 5, directory 0 is the compilation directory
+    const size_t first_file = table->nfiles;
+    lineDirectories directories = {.length = 0};
+    if (version >= 5) {
+        p = _sy_read_entries(dwarf, p, program, offset_size, &directories, NULL);
+        p = p? _sy_read_entries(dwarf, p, program, offset_size, &directories, table) : NULL;
+        if (!p) {
+            table->nfiles = first_file;
+            return true;
+        }
+    } else {
+        directories.names[directories.length++] = NULL;
+        while (p < program && *p) {
+            const char* directory = (const char*)p;
+            p += strnlen(directory, program - p) + 1;
+            if (directories.length < SY_MAX_DIRECTORIES) {
+                directories.names[directories.length++] = directory;
+            }
+        }
+        p++;
+        _sy_add_file(table, NULL, NULL);
+        while (p < program && *p) {
+            const char* name = (const char*)p;
+            p += strnlen(name, program - p) + 1;
+            uint64_t directory = _read_uleb(&p, program);
+            _read_uleb(&p, program);  // modification time
+            _read_uleb(&p, program);  // length
+            _sy_add_file(table, directory < directories.length? directories.names[directory] : NULL, name);
+        }
+    }
+
+    // Line number program, only the rows matter, columns and flags are skipped
+    const size_t nfiles = table->nfiles - first_file;
+    uint64_t address = 0;
+    uint64_t file = version >= 5? 0 : 1;
+    int64_t line = 1;
+    p = program;
+
+    while (p < end) {
+        uint8_t opcode = *p++;
+        if (opcode >= opcode_base) {
+            uint8_t adjusted = opcode - opcode_base;
+            address += (adjusted / line_range) * min_instruction_length;
+            line += line_base + adjusted % line_range;
+            _sy_add_row(table, address, file < nfiles? first_file + file : 0, line);
+            continue;
+        }
+
+        switch (opcode) {
+            case 0: {
+                uint64_t length = _read_uleb(&p, end);
+                const uint8_t* next = p + length;
+                if (!length || next > end) {
+                    return false;
+                }
+                uint8_t extended = *p++;
+                if (extended == DW_LNE_end_sequence) {
+                    _sy_add_row(table, address, 0, 0);
+                    address = 0;
+                    file = version >= 5? 0 : 1;
+                    line = 1;
+                } else if (extended == DW_LNE_set_address) {
+                    address = _read_uint(&p, next, length - 1 < 8? length - 1 : 8);
+                }
+                p = next;
+                break;
+            }
+            case DW_LNS_copy:
+                _sy_add_row(table, address, file < nfiles? first_file + file : 0, line);
+                break;
+            case DW_LNS_advance_pc:
+                address += _read_uleb(&p, end) * min_instruction_length;
+                break;
+            case DW_LNS_advance_line:
+                line += _read_sleb(&p, end);
+                break;
+            case DW_LNS_set_file:
+                file = _read_uleb(&p, end);
+                break;
+            case DW_LNS_const_add_pc:
+                address += ((255 - opcode_base) / line_range) * min_instruction_length;
+                break;
+            case DW_LNS_fixed_advance_pc:
+                address += _read_uint(&p, end, 2);
+                break;
+            default:
+                // Any other standard opcode, its operand count is in the header
+                for (int i = 0; i < opcode_lengths[opcode - 1]; i++) {
+                    _read_uleb(&p, end);
+                }
+                break;
+        }
+    }
+
+    return true;
+}
+
+
+static const uint8_t* _sy_read_entries(const dwarfSections* dwarf, const uint8_t* p, const uint8_t* end, int offset_size,
+                                       lineDirectories* directories, lineTable* table) {
+    uint64_t types[SY_MAX_FORMATS], forms[SY_MAX_FORMATS];
+    uint8_t nformats = _read_uint(&p, end, 1);
+    if (nformats > SY_MAX_FORMATS) {
+        return NULL;
+    }
+    for (int i = 0; i < nformats; i++) {
+        types[i] = _read_uleb(&p, end);
+        forms[i] = _read_uleb(&p, end);
+    }
+
+    uint64_t count = _read_uleb(&p, end);
+    for (uint64_t i = 0; i < count; i++) {
+        const char* path = NULL;
+        uint64_t directory = 0;
+        for (int j = 0; j < nformats && p; j++) {
+            uint64_t value = 0;
+            const char* string = NULL;
+            p = _sy_read_form(dwarf, p, end, forms[j], offset_size, &value, &string);
+            if (types[j] == DW_LNCT_path) {
+                path = string;
+            } else if (types[j] == DW_LNCT_directory_index) {
+                directory = value;
+            }
+        }
+        if (!p) {
+            return NULL;
+        }
+
+        if (!table) {
+            if (directories->length < SY_MAX_DIRECTORIES) {
+                directories->names[directories->length++] = path;
+            }
+        } else {
+            _sy_add_file(table, directory < directories->length? directories->names[directory] : NULL, path);
+        }
+    }
+
+    return p;
+}
+
+
+static const uint8_t* _sy_read_form(const dwarfSections* dwarf, const uint8_t* p, const uint8_t* end, uint64_t form,
+                                    int offset_size, uint64_t* value, const char** string) {
+    switch (form) {
+        case DW_FORM_string:
+            *string = (const char*)p;
+            p += strnlen(*string, end - p) + 1;
+            break;
+        case DW_FORM_line_strp:
+            *string = _sy_string(&dwarf->line_str, _read_uint(&p, end, offset_size));
+            break;
+        case DW_FORM_strp:
+            *string = _sy_string(&dwarf->str, _read_uint(&p, end, offset_size));
+            break;
+        case DW_FORM_udata:
+            *value = _read_uleb(&p, end);
+            break;
+        case DW_FORM_data1:
+            *value = _read_uint(&p, end, 1);
+            break;
+        case DW_FORM_data2:
+            *value = _read_uint(&p, end, 2);
+            break;
+        case DW_FORM_data4:
+            *value = _read_uint(&p, end, 4);
+            break;
+        case DW_FORM_data8:
+            *value = _read_uint(&p, end, 8);
+            break;
+        case DW_FORM_data16:
+            p += 16;
+            break;
+        case DW_FORM_block:
+            p += _read_uleb(&p, end);
+            break;
+        default:
+            // Forms that need other sections, e.g. string indexes, are not supported
+            return NULL;
+    }
+
+    return p <= end? p : NULL;
+}
+
+
+static bool _sy_add_row(lineTable* table, uint64_t address, uint32_t file, uint32_t line) {
+    if (table->nrows == table->rows_capacity) {
+        size_t capacity = table->rows_capacity? table->rows_capacity * 2 : 4096;
+        lineRow* rows = realloc(table->rows, capacity * sizeof(lineRow));
+        if (!rows) {
+            return false;
+        }
+        table->rows = rows;
+        table->rows_capacity = capacity;
+    }
+
+    table->rows[table->nrows++] = (lineRow){address, file, line};
+
+    return true;
+}
+
+
+static bool _sy_add_file(lineTable* table, const char* directory, const char* name) {
+    if (table->nfiles == table->files_capacity) {
+        size_t capacity = table->files_capacity? table->files_capacity * 2 : 256;
+        lineFile* files = realloc(table->files, capacity * sizeof(lineFile));
+        if (!files) {
+            return false;
+        }
+        table->files = files;
+        table->files_capacity = capacity;
+    }
+
+    table->files[table->nfiles++] = (lineFile){directory, name};
+
+    return true;
+}
+
+
+static bool _sy_file_vaddr(const elfImage* image, uint64_t offset, uint64_t* vaddr) {
+    for (uint32_t i = 0; i < image->nphdrs; i++) {
+        const Elf64_Phdr* phdr = &image->phdrs[i];
+        if (phdr->p_type == PT_LOAD && offset >= phdr->p_offset && offset < phdr->p_offset + phdr->p_filesz) {
+            *vaddr = offset - phdr->p_offset + phdr->p_vaddr;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+static const char* _sy_string(const elfSection* section, uint64_t offset) {
+    if (!section->data || offset >= section->size) {
+        return NULL;
+    }
+
+    return (const char*)section->data + offset;
+}
+
+
+static uint64_t _read_uleb(const uint8_t** p, const uint8_t* end) {
+    uint64_t value = 0;
+    int shift = 0;
+    while (*p < end) {
+        uint8_t byte = *(*p)++;
+        if (shift < 64) {
+            value |= (uint64_t)(byte & 0x7f) << shift;
+        }
+        shift += 7;
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+
+    return value;
+}
+
+
+static int64_t _read_sleb(const uint8_t** p, const uint8_t* end) {
+    int64_t value = 0;
+    int shift = 0;
+    uint8_t byte = 0;
+    while (*p < end) {
+        byte = *(*p)++;
+        if (shift < 64) {
+            value |= (int64_t)(byte & 0x7f) << shift;
+        }
+        shift += 7;
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+    if (shift < 64 && (byte & 0x40)) {
+        value |= -((int64_t)1 << shift);
+    }
+
+    return value;
+}
+
+
+static uint64_t _read_uint(const uint8_t** p, const uint8_t* end, int size) {
+    // Truncated fields read as 0 and move past the end, callers check against it
+    uint64_t value = 0;
+    if (*p + size <= end) {
+        memcpy(&value, *p, size);
+    }
+    *p += size;
+
+    return value;
+}
+
+
+static int _compare_symbols(const void* a, const void* b) {
+    const elfSymbol* symbol_a = a;
+    const elfSymbol* symbol_b = b;
+
+    return (symbol_a->address > symbol_b->address) - (symbol_a->address < symbol_b->address);
+}
+
+
+static int _compare_rows(const void* a, const void* b) {
+    const lineRow* row_a = a;
+    const lineRow* row_b = b;
+
+    if (row_a->address != row_b->address) {
+        return (row_a->address > row_b->address) - (row_a->address < row_b->address);
+    }
+    // A sequence starting where another ends must win the lookup, ends sort first
+    return (row_a->line != 0) - (row_b->line != 0);
+}
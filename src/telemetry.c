@@ -0,0 +1,273 @@
+/*
+ * Copyright (C) 2024 Alejandro Cadarso
+ *
+ * This file is part of Memtrace.
+ *
+ * Memtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Memtrace.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * File: telemetry.c
+ * Author: Alejandro Cadarso
+ * Date: 17-10-2026
+ *
+ * This file implements the live heap telemetry of memtrace. Samples are
+ * built from the call-site counters alone, which are plain atomics in
+ * shared memory: no table or site lock is ever taken, so sampling can't
+ * hold up the traced process. Rates are the difference with the previous
+ * sample, which is kept privately by memtrace.
+ *
+ * Heap diffs work the same way: each diff closes an epoch by copying the
+ * live bytes and blocks of every site, and reports the growth against the
+ * copy taken at the end of the previous epoch. The allocation table is
+ * never walked nor copied.
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "telemetry.h"
+
+struct telemetry {
+    siteTable* st;
+    FILE* out;
+    uint32_t top;
+    uint64_t start_ns;
+    uint64_t last_ns;
+    uint64_t last_allocs;
+    // Allocations per site at the previous sample, indexed by site id
+    uint64_t* last_site_allocs;
+    // Live bytes and blocks per site at the end of the previous diff epoch
+    int64_t* epoch_bytes;
+    int64_t* epoch_blocks;
+    uint32_t epoch;
+    uint64_t epoch_ns;
+    // Sites the arrays above have room for
+    uint32_t capacity;
+    // Scratch space for ranking the sites of a sample
+    siteId* ranked;
+    int64_t* deltas;
+};
+
+// Site deltas being sorted, qsort takes no context
+static const int64_t* sorting_deltas;
+
+static bool _tm_reserve(telemetry* tm, uint32_t length);
+static void* _tm_grow(void* array, size_t element_size, uint32_t old_length, uint32_t new_length);
+static int _tm_compare_deltas(const void* a, const void* b);
+static int _tm_compare_magnitudes(const void* a, const void* b);
+
+
+/************************************************************************************************************
+ *                                          PUBLIC FUNCTIONS                                                *
+ ***********************************************************************************************************/
+
+
+telemetry* tm_create(siteTable* st, uint32_t top, FILE* out, uint64_t start_ns) {
+    telemetry* tm = calloc(1, sizeof(telemetry));
+    if (!tm) {
+        return NULL;
+    }
+
+    tm->st = st;
+    tm->out = out;
+    tm->top = top;
+    tm->start_ns = tm->last_ns = tm->epoch_ns = start_ns;
+
+    return tm;
+}
+
+
+void tm_destroy(telemetry* tm) {
+    if (!tm) { return; }
+
+    free(tm->last_site_allocs);
+    free(tm->epoch_bytes);
+    free(tm->epoch_blocks);
+    free(tm->ranked);
+    free(tm->deltas);
+    free(tm);
+}
+
+
+void tm_sample(telemetry* tm, uint64_t now_ns) {
+    const uint32_t length = st_length(tm->st);
+    if (!_tm_reserve(tm, length)) {
+        return;
+    }
+
+    uint64_t allocs = 0;
+    uint64_t frees = 0;
+    uint64_t live_bytes = 0;
+    uint32_t active = 0;
+
+    for (siteId id = 0; id < length; id++) {
+        const siteCounters* counters = st_counters(tm->st, id);
+        uint64_t site_allocs = __atomic_load_n(&counters->allocs, __ATOMIC_RELAXED);
+        uint64_t site_frees = __atomic_load_n(&counters->frees, __ATOMIC_RELAXED);
+        uint64_t site_live_bytes = __atomic_load_n(&counters->live_bytes, __ATOMIC_RELAXED);
+
+        allocs += site_allocs;
+        frees += site_frees;
+        live_bytes += site_live_bytes;
+
+        if (site_allocs > tm->last_site_allocs[id]) {
+            tm->deltas[id] = site_allocs - tm->last_site_allocs[id];
+            tm->ranked[active++] = id;
+        }
+        tm->last_site_allocs[id] = site_allocs;
+    }
+
+    const double elapsed = (now_ns - tm->start_ns) / 1e9;
+    const double interval = (now_ns - tm->last_ns) / 1e9;
+    const double rate = interval > 0? (allocs - tm->last_allocs) / interval : 0;
+
+    // Counters are read one by one while the target runs, frees may be ahead of allocs
+    fprintf(tm->out, "[memtrace %9.3fs] live %lu bytes in %ld blocks, %.0f allocs/s",
+            elapsed, live_bytes, allocs > frees? (long)(allocs - frees) : 0L, rate);
+
+    sorting_deltas = tm->deltas;
+    qsort(tm->ranked, active, sizeof(siteId), _tm_compare_deltas);
+
+    char frame[2 * MM_MAX_PATH];
+    for (uint32_t i = 0; i < active && i < tm->top; i++) {
+        const callSite* site = st_get(tm->st, tm->ranked[i]);
+        if (site && site->depth) {
+            st_format_frame(tm->st, site, 0, frame, sizeof(frame));
+        } else {
+            strcpy(frame, "<unknown call site>");
+        }
+        fprintf(tm->out, "%s %.0f/s %s", i? "," : ", top:", interval > 0? tm->deltas[tm->ranked[i]] / interval : 0, frame);
+    }
+    fputc('\n', tm->out);
+    fflush(tm->out);
+
+    tm->last_ns = now_ns;
+    tm->last_allocs = allocs;
+}
+
+
+void tm_diff(telemetry* tm, uint64_t now_ns) {
+    const uint32_t length = st_length(tm->st);
+    if (!_tm_reserve(tm, length)) {
+        return;
+    }
+
+    int64_t growth_bytes = 0;
+    int64_t growth_blocks = 0;
+    uint32_t changed = 0;
+
+    for (siteId id = 0; id < length; id++) {
+        const siteCounters* counters = st_counters(tm->st, id);
+        int64_t live_bytes = __atomic_load_n(&counters->live_bytes, __ATOMIC_RELAXED);
+        int64_t live_blocks = __atomic_load_n(&counters->allocs, __ATOMIC_RELAXED) -
+                              __atomic_load_n(&counters->frees, __ATOMIC_RELAXED);
+
+        int64_t delta = live_bytes - tm->epoch_bytes[id];
+        growth_bytes += delta;
+        growth_blocks += live_blocks - tm->epoch_blocks[id];
+        if (delta) {
+            tm->deltas[id] = delta;
+            tm->ranked[changed++] = id;
+        }
+
+        tm->epoch_bytes[id] = live_bytes;
+        tm->epoch_blocks[id] = live_blocks;
+    }
+
+    tm->epoch++;
+    fprintf(tm->out, "\n[memtrace %9.3fs] heap diff %u over the last %.3fs: %+ld bytes live (%+ld blocks) in %u sites\n",
+            (now_ns - tm->start_ns) / 1e9, tm->epoch, (now_ns - tm->epoch_ns) / 1e9, growth_bytes, growth_blocks, changed);
+    tm->epoch_ns = now_ns;
+
+    // Biggest changes first, shrinking sites can matter as much as growing ones
+    sorting_deltas = tm->deltas;
+    qsort(tm->ranked, changed, sizeof(siteId), _tm_compare_magnitudes);
+
+    for (uint32_t i = 0; i < changed && i < tm->top; i++) {
+        fprintf(tm->out, "\n#%u: %+ld bytes live\n", i + 1, tm->deltas[tm->ranked[i]]);
+        st_print_frames(tm->st, tm->ranked[i], tm->out);
+    }
+    fputc('\n', tm->out);
+    fflush(tm->out);
+}
+
+
+/************************************************************************************************************
+ *                                          PRIVATE FUNCTIONS                                               *
+ ***********************************************************************************************************/
+
+
+static bool _tm_reserve(telemetry* tm, uint32_t length) {
+    // Sites are append only, grow the private copies when new ones show up
+    if (length <= tm->capacity) {
+        return true;
+    }
+
+    uint32_t capacity = tm->capacity? tm->capacity : 1024;
+    while (capacity < length) {
+        capacity *= 2;
+    }
+
+    void* arrays[] = {
+        _tm_grow(tm->last_site_allocs, sizeof(uint64_t), tm->capacity, capacity),
+        _tm_grow(tm->epoch_bytes, sizeof(int64_t), tm->capacity, capacity),
+        _tm_grow(tm->epoch_blocks, sizeof(int64_t), tm->capacity, capacity),
+        _tm_grow(tm->ranked, sizeof(siteId), tm->capacity, capacity),
+        _tm_grow(tm->deltas, sizeof(int64_t), tm->capacity, capacity)
+    };
+    // Arrays that did grow are kept, the next sample tries again for the rest
+    tm->last_site_allocs = arrays[0]? arrays[0] : tm->last_site_allocs;
+    tm->epoch_bytes = arrays[1]? arrays[1] : tm->epoch_bytes;
+    tm->epoch_blocks = arrays[2]? arrays[2] : tm->epoch_blocks;
+    tm->ranked = arrays[3]? arrays[3] : tm->ranked;
+    tm->deltas = arrays[4]? arrays[4] : tm->deltas;
+
+    for (size_t i = 0; i < sizeof(arrays) / sizeof(arrays[0]); i++) {
+        if (!arrays[i]) {
+            fputs("Telemetry allocation failure\n", stderr);
+            return false;
+        }
+    }
+
+    tm->capacity = capacity;
+
+    return true;
+}
+
+
+static void* _tm_grow(void* array, size_t element_size, uint32_t old_length, uint32_t new_length) {
+    char* grown = realloc(array, new_length * element_size);
+    if (grown) {
+        memset(grown + old_length * element_size, 0, (new_length - old_length) * element_size);
+    }
+
+    return grown;
+}
+
+
+static int _tm_compare_deltas(const void* a, const void* b) {
+    const int64_t delta_a = sorting_deltas[*(const siteId*)a];
+    const int64_t delta_b = sorting_deltas[*(const siteId*)b];
+
+    return (delta_a < delta_b) - (delta_a > delta_b);
+}
+
+
+static int _tm_compare_magnitudes(const void* a, const void* b) {
+    const int64_t delta_a = llabs(sorting_deltas[*(const siteId*)a]);
+    const int64_t delta_b = llabs(sorting_deltas[*(const siteId*)b]);
+
+    return (delta_a < delta_b) - (delta_a > delta_b);
+}
@@ -0,0 +1,642 @@
+/*
+ * Copyright (C) 2024 Alejandro Cadarso
+ *
+ * This file is part of Memtrace.
+ *
+ * Memtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Memtrace.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * File: trace.c
+ * Author: Alejandro Cadarso
+ * Date: 17-10-2026
+ *
+ * This file implements allocation traces. The file is a header page
+ * followed by fixed size chunks, each thread of the traced process claims
+ * a chunk with a single atomic add and appends its events to it with no
+ * other synchronization, growing the file one chunk at a time. Events are
+ * a kind byte followed by varints: the timestamp and the address as zigzag
+ * deltas from the previous event of the chunk, and for allocations the
+ * block size and call site id. Most events take 6 to 10 bytes.
+ *
+ * Chunks publish their length after every event, so a trace is readable
+ * up to the last event even when the traced process dies. Once it exits
+ * memtrace appends the frames of every call site and the module map.
+ *
+ * Replaying decodes chunk ranges on separate threads, each thread sorting
+ * its events by timestamp, and merges the sorted runs. Events of one
+ * block always come in order: allocations are stamped after the block is
+ * returned and frees before it is released.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "trace.h"
+#include "sampling.h"
+
+#define TR_MAGIC "MEMTRACE"
+#define TR_VERSION 1
+
+// Address space reserved for the trace file, the file itself grows a chunk at a time
+#define TR_MAX_BYTES (1UL << 40)
+#define TR_HEADER_SIZE 4096UL
+#define TR_CHUNK_SIZE (64UL * 1024)
+// Kind byte and four varints
+#define TR_MAX_EVENT 48
+
+#define TR_MAX_THREADS 16
+
+// Kept out of the way of the low descriptors the traced program may expect
+#define TR_FD_MIN 512
+
+#define TR_FD_ENV "MEMTRACE_TRACE_FD"
+
+typedef struct traceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t chunk_size;
+    uint64_t sample_interval;
+    // Chunks claimed by the traced process, some may be claimed past the end of a full file
+    uint64_t chunks;
+    uint64_t dropped;
+    // Set once the file could not grow, every later event is dropped
+    uint32_t full;
+    double ticks_per_ns;
+    uint64_t duration_ns;
+    // Written by tr_finish, a trace without sites is still being recorded
+    uint64_t sites_offset;
+    uint64_t nsites;
+    uint64_t modules_offset;
+} traceHeader;
+
+/**
+ * Only the owning thread writes a chunk, used and events are published
+ * with release stores after every event
+ */
+typedef struct traceChunk {
+    uint32_t used;
+    uint32_t tid;
+    uint64_t events;
+    uint8_t data[];
+} traceChunk;
+
+// Site frames as stored after the chunks, depth frames follow each of them
+typedef struct traceSite {
+    uint32_t depth;
+    uint32_t reserved;
+} traceSite;
+
+struct trace {
+    int fd;
+    char* base;
+    size_t size;
+    bool writable;
+};
+
+// Chunk range decoded and sorted by one tr_sorted_events thread
+typedef struct decodeWorker {
+    const trace* tr;
+    uint64_t first_chunk;
+    uint64_t end_chunk;
+    traceEvent* events;
+    size_t nevents;
+    pthread_t thread;
+    bool started;
+} decodeWorker;
+
+#define TR_HEADER(tr) \
+    ((traceHeader*)(tr)->base)
+#define TR_CHUNK(tr, index) \
+    ((traceChunk*)((tr)->base + TR_HEADER_SIZE + (index) * TR_CHUNK_SIZE))
+
+// Producer state, the chunk the calling thread appends to
+static __thread traceChunk* thread_chunk __attribute__((tls_model("initial-exec")));
+static __thread uint64_t thread_address __attribute__((tls_model("initial-exec")));
+static __thread uint64_t thread_timestamp __attribute__((tls_model("initial-exec")));
+
+static void _tr_push(trace* tr, uint8_t kind, size_t address, uint64_t timestamp, uint64_t block_size, siteId site_id);
+static traceChunk* _tr_claim(trace* tr);
+static void _tr_forget_chunk(void);
+static uint64_t _tr_readable_chunks(const trace* tr);
+static void* _tr_decode(void* arg);
+static void _tr_apply(const traceEvent* event, hashTable* ht, siteTable* st, const siteId* site_ids, uint64_t nsites,
+                      uint64_t sample_interval);
+static size_t _put_varint(uint8_t* buffer, uint64_t value);
+static uint64_t _get_varint(const uint8_t** p, const uint8_t* end);
+static int _tr_compare_events(const void* a, const void* b);
+
+
+/************************************************************************************************************
+ *                                          PUBLIC FUNCTIONS                                                *
+ ***********************************************************************************************************/
+
+
+trace* tr_create(const char* path, uint64_t sample_interval) {
+    trace* tr = calloc(1, sizeof(trace));
+    if (!tr) {
+        return NULL;
+    }
+
+    tr->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (tr->fd >= 0) {
+        int high_fd = fcntl(tr->fd, F_DUPFD, TR_FD_MIN);
+        if (high_fd >= 0) {
+            close(tr->fd);
+            tr->fd = high_fd;
+        }
+    }
+
+    tr->size = TR_MAX_BYTES;
+    tr->base = tr->fd >= 0 && ftruncate(tr->fd, TR_HEADER_SIZE) == 0?
+               mmap(NULL, TR_MAX_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, tr->fd, 0) : MAP_FAILED;
+    if (tr->base == MAP_FAILED) {
+        if (tr->fd >= 0) {
+            close(tr->fd);
+        }
+        free(tr);
+        return NULL;
+    }
+    tr->writable = true;
+
+    traceHeader* header = TR_HEADER(tr);
+    memcpy(header->magic, TR_MAGIC, sizeof(header->magic));
+    header->version = TR_VERSION;
+    header->chunk_size = TR_CHUNK_SIZE;
+    header->sample_interval = sample_interval;
+
+    // The descriptor is inherited through exec, its number through the environment
+    char fd_str[16];
+    sprintf(fd_str, "%d", tr->fd);
+    setenv(TR_FD_ENV, fd_str, 1);
+
+    return tr;
+}
+
+
+trace* tr_load() {
+    static trace loaded;
+
+    char* fd_str = getenv(TR_FD_ENV);
+    if (!fd_str) {
+        return NULL;
+    }
+
+    // Called from within the interposer bootstrap, nothing here may allocate
+    loaded.fd = atoi(fd_str);
+    loaded.size = TR_MAX_BYTES;
+    loaded.base = mmap(NULL, TR_MAX_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, loaded.fd, 0);
+    if (loaded.base == MAP_FAILED || memcmp(TR_HEADER(&loaded)->magic, TR_MAGIC, sizeof(TR_HEADER(&loaded)->magic)) != 0) {
+        return NULL;
+    }
+    loaded.writable = true;
+
+    // A forked child must claim its own chunks
+    pthread_atfork(NULL, NULL, _tr_forget_chunk);
+
+    return &loaded;
+}
+
+
+void tr_push_alloc(trace* tr, size_t address, allocInfo info) {
+    _tr_push(tr, TR_EVENT_ALLOC, address, info.timestamp, info.block_size, info.site_id);
+}
+
+
+void tr_push_free(trace* tr, size_t address, uint64_t timestamp) {
+    _tr_push(tr, TR_EVENT_FREE, address, timestamp, 0, 0);
+}
+
+
+bool tr_finish(trace* tr, siteTable* st, double ticks_per_ns, uint64_t duration_ns) {
+    traceHeader* header = TR_HEADER(tr);
+    const uint64_t chunks = _tr_readable_chunks(tr);
+    off_t offset = TR_HEADER_SIZE + chunks * TR_CHUNK_SIZE;
+    bool written = true;
+
+    header->sites_offset = offset;
+    header->nsites = st_length(st);
+    for (siteId id = 0; id < header->nsites && written; id++) {
+        const callSite* site = st_get(st, id);
+        traceSite record = {.depth = site? site->depth : 0};
+        written = pwrite(tr->fd, &record, sizeof(record), offset) == sizeof(record);
+        offset += sizeof(record);
+        if (site && written) {
+            size_t length = site->depth * sizeof(void*);
+            written = pwrite(tr->fd, st_frames(st, site), length, offset) == (ssize_t)length;
+            offset += length;
+        }
+    }
+
+    const moduleMap* modules = st_modules(st);
+    size_t modules_length = offsetof(moduleMap, modules) + modules->length * sizeof(moduleInfo);
+    header->modules_offset = offset;
+    written = written && pwrite(tr->fd, modules, modules_length, offset) == (ssize_t)modules_length;
+    offset += modules_length;
+
+    header->ticks_per_ns = ticks_per_ns;
+    header->duration_ns = duration_ns;
+    header->chunks = chunks;
+
+    return written && ftruncate(tr->fd, offset) == 0;
+}
+
+
+trace* tr_open(const char* path) {
+    trace* tr = calloc(1, sizeof(trace));
+    if (!tr) {
+        return NULL;
+    }
+
+    struct stat st;
+    tr->fd = open(path, O_RDONLY);
+    if (tr->fd < 0 || fstat(tr->fd, &st) != 0 || (size_t)st.st_size < TR_HEADER_SIZE) {
+        tr_destroy(tr);
+        return NULL;
+    }
+
+    // Read in place, events are only ever decoded straight from the mapping
+    tr->size = st.st_size;
+    tr->base = mmap(NULL, tr->size, PROT_READ, MAP_PRIVATE, tr->fd, 0);
+    if (tr->base == MAP_FAILED) {
+        tr->base = NULL;
+        tr_destroy(tr);
+        return NULL;
+    }
+
+    const traceHeader* header = TR_HEADER(tr);
+    if (memcmp(header->magic, TR_MAGIC, sizeof(header->magic)) != 0 || header->version != TR_VERSION ||
+        header->chunk_size != TR_CHUNK_SIZE || !header->sites_offset ||
+        header->sites_offset > tr->size || header->modules_offset + offsetof(moduleMap, modules) > tr->size ||
+        TR_HEADER_SIZE + header->chunks * TR_CHUNK_SIZE > header->sites_offset) {
+        tr_destroy(tr);
+        return NULL;
+    }
+
+    const moduleMap* modules = (const moduleMap*)(tr->base + header->modules_offset);
+    if (modules->length > MM_MAX_MODULES ||
+        header->modules_offset + offsetof(moduleMap, modules) + modules->length * sizeof(moduleInfo) > tr->size) {
+        tr_destroy(tr);
+        return NULL;
+    }
+
+    return tr;
+}
+
+
+traceEvent* tr_sorted_events(trace* tr, int nthreads, size_t* nevents) {
+    const uint64_t nchunks = TR_HEADER(tr)->chunks;
+
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    if (nthreads > TR_MAX_THREADS) {
+        nthreads = TR_MAX_THREADS;
+    }
+    if ((uint64_t)nthreads > nchunks) {
+        nthreads = nchunks? nchunks : 1;
+    }
+
+    decodeWorker workers[TR_MAX_THREADS] = {0};
+    size_t total = 0;
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].tr = tr;
+        workers[i].first_chunk = nchunks * i / nthreads;
+        workers[i].end_chunk = nchunks * (i + 1) / nthreads;
+        for (uint64_t chunk = workers[i].first_chunk; chunk < workers[i].end_chunk; chunk++) {
+            total += TR_CHUNK(tr, chunk)->events;
+        }
+    }
+
+    // Every worker fills and sorts its own run of one shared array
+    traceEvent* events = malloc((total? total : 1) * sizeof(traceEvent));
+    traceEvent* merged = malloc((total? total : 1) * sizeof(traceEvent));
+    if (!events || !merged) {
+        free(events);
+        free(merged);
+        return NULL;
+    }
+
+    size_t run_start = 0;
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].events = &events[run_start];
+        for (uint64_t chunk = workers[i].first_chunk; chunk < workers[i].end_chunk; chunk++) {
+            run_start += TR_CHUNK(tr, chunk)->events;
+        }
+    }
+    for (int i = 1; i < nthreads; i++) {
+        workers[i].started = pthread_create(&workers[i].thread, NULL, _tr_decode, &workers[i]) == 0;
+        if (!workers[i].started) {
+            _tr_decode(&workers[i]);
+        }
+    }
+    _tr_decode(&workers[0]);
+    for (int i = 1; i < nthreads; i++) {
+        if (workers[i].started) {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+
+    // Merge the sorted runs, few enough that picking the earliest head is a short scan
+    size_t heads[TR_MAX_THREADS] = {0};
+    size_t nmerged = 0;
+    for (;;) {
+        int earliest = -1;
+        for (int i = 0; i < nthreads; i++) {
+            if (heads[i] < workers[i].nevents &&
+                (earliest < 0 || workers[i].events[heads[i]].timestamp < workers[earliest].events[heads[earliest]].timestamp)) {
+                earliest = i;
+            }
+        }
+        if (earliest < 0) {
+            break;
+        }
+        merged[nmerged++] = workers[earliest].events[heads[earliest]++];
+    }
+    free(events);
+
+    *nevents = nmerged;
+    return merged;
+}
+
+
+bool tr_replay(trace* tr, hashTable* ht, siteTable* st, int nthreads) {
+    const traceHeader* header = TR_HEADER(tr);
+
+    // Sites are interned in their recorded order, the ids they get may still differ
+    siteId* site_ids = calloc(header->nsites? header->nsites : 1, sizeof(siteId));
+    if (!site_ids) {
+        return false;
+    }
+    st_load_modules(st, (const moduleMap*)(tr->base + header->modules_offset));
+    const char* p = tr->base + header->sites_offset;
+    const char* sites_end = tr->base + header->modules_offset;
+    for (uint64_t id = 0; id < header->nsites && p + sizeof(traceSite) <= sites_end; id++) {
+        const traceSite* record = (const traceSite*)p;
+        p += sizeof(traceSite);
+        if (record->depth > ST_MAX_DEPTH || p + record->depth * sizeof(void*) > sites_end) {
+            break;
+        }
+        site_ids[id] = st_intern(st, (void* const*)p, record->depth);
+        p += record->depth * sizeof(void*);
+    }
+
+    size_t nevents;
+    traceEvent* events = tr_sorted_events(tr, nthreads, &nevents);
+    if (!events) {
+        free(site_ids);
+        return false;
+    }
+
+    for (size_t i = 0; i < nevents; i++) {
+        _tr_apply(&events[i], ht, st, site_ids, header->nsites, header->sample_interval);
+    }
+
+    free(events);
+    free(site_ids);
+
+    return true;
+}
+
+
+uint64_t tr_sample_interval(trace* tr) {
+    return TR_HEADER(tr)->sample_interval;
+}
+
+
+double tr_ticks_per_ns(trace* tr) {
+    return TR_HEADER(tr)->ticks_per_ns;
+}
+
+
+uint64_t tr_duration_ns(trace* tr) {
+    return TR_HEADER(tr)->duration_ns;
+}
+
+
+uint64_t tr_events(trace* tr) {
+    uint64_t events = 0;
+    const uint64_t chunks = _tr_readable_chunks(tr);
+    for (uint64_t chunk = 0; chunk < chunks; chunk++) {
+        events += __atomic_load_n(&TR_CHUNK(tr, chunk)->events, __ATOMIC_ACQUIRE);
+    }
+
+    return events;
+}
+
+
+uint64_t tr_dropped(trace* tr) {
+    return __atomic_load_n(&TR_HEADER(tr)->dropped, __ATOMIC_RELAXED);
+}
+
+
+void tr_destroy(trace* tr) {
+    if (!tr) { return; }
+
+    if (tr->base) {
+        munmap(tr->base, tr->size);
+    }
+    if (tr->fd >= 0) {
+        close(tr->fd);
+    }
+    if (tr->writable) {
+        unsetenv(TR_FD_ENV);
+    }
+    free(tr);
+}
+
+
+/************************************************************************************************************
+ *                                          PRIVATE FUNCTIONS                                               *
+ ***********************************************************************************************************/
+
+
+static void _tr_push(trace* tr, uint8_t kind, size_t address, uint64_t timestamp, uint64_t block_size, siteId site_id) {
+    traceChunk* chunk = thread_chunk;
+    if (!chunk || chunk->used + TR_MAX_EVENT > TR_CHUNK_SIZE - sizeof(traceChunk)) {
+        chunk = __atomic_load_n(&TR_HEADER(tr)->full, __ATOMIC_RELAXED)? NULL : _tr_claim(tr);
+        if (!chunk) {
+            __atomic_fetch_add(&TR_HEADER(tr)->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    // Zigzag deltas, addresses and timestamps of a thread tend to be close to the previous ones
+    uint8_t* buffer = &chunk->data[chunk->used];
+    int64_t address_delta = (int64_t)(address - thread_address);
+    int64_t timestamp_delta = (int64_t)(timestamp - thread_timestamp);
+    size_t length = 0;
+
+    buffer[length++] = kind;
+    length += _put_varint(&buffer[length], (uint64_t)(timestamp_delta << 1) ^ (uint64_t)(timestamp_delta >> 63));
+    length += _put_varint(&buffer[length], (uint64_t)(address_delta << 1) ^ (uint64_t)(address_delta >> 63));
+    if (kind == TR_EVENT_ALLOC) {
+        length += _put_varint(&buffer[length], block_size);
+        length += _put_varint(&buffer[length], site_id);
+    }
+
+    thread_address = address;
+    thread_timestamp = timestamp;
+    __atomic_store_n(&chunk->events, chunk->events + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&chunk->used, chunk->used + length, __ATOMIC_RELEASE);
+}
+
+
+static traceChunk* _tr_claim(trace* tr) {
+    traceHeader* header = TR_HEADER(tr);
+    uint64_t index = __atomic_fetch_add(&header->chunks, 1, __ATOMIC_RELAXED);
+    off_t offset = TR_HEADER_SIZE + index * TR_CHUNK_SIZE;
+
+    // Growing the file first means a full disk drops events instead of faulting on the mapping
+    if (offset + TR_CHUNK_SIZE > TR_MAX_BYTES || posix_fallocate(tr->fd, offset, TR_CHUNK_SIZE) != 0) {
+        __atomic_store_n(&header->full, 1, __ATOMIC_RELAXED);
+        thread_chunk = NULL;
+        return NULL;
+    }
+
+    traceChunk* chunk = TR_CHUNK(tr, index);
+    chunk->tid = gettid();
+    thread_chunk = chunk;
+    thread_address = 0;
+    thread_timestamp = 0;
+
+    return chunk;
+}
+
+
+static void _tr_forget_chunk(void) {
+    thread_chunk = NULL;
+}
+
+
+static uint64_t _tr_readable_chunks(const trace* tr) {
+    // Chunks claimed once the file could not grow were never written
+    const uint64_t chunks = __atomic_load_n(&TR_HEADER(tr)->chunks, __ATOMIC_ACQUIRE);
+    struct stat st;
+    if (fstat(tr->fd, &st) != 0 || (uint64_t)st.st_size < TR_HEADER_SIZE) {
+        return 0;
+    }
+
+    const uint64_t allocated = (st.st_size - TR_HEADER_SIZE) / TR_CHUNK_SIZE;
+    return chunks < allocated? chunks : allocated;
+}
+
+
+static void* _tr_decode(void* arg) {
+    decodeWorker* worker = arg;
+
+    for (uint64_t index = worker->first_chunk; index < worker->end_chunk; index++) {
+        const traceChunk* chunk = TR_CHUNK(worker->tr, index);
+        const uint8_t* p = chunk->data;
+        const uint8_t* end = chunk->data + (chunk->used < TR_CHUNK_SIZE - sizeof(traceChunk)? chunk->used : 0);
+        uint64_t address = 0;
+        uint64_t timestamp = 0;
+
+        for (uint64_t i = 0; i < chunk->events && p < end; i++) {
+            traceEvent* event = &worker->events[worker->nevents++];
+            event->kind = *p++;
+            event->tid = chunk->tid;
+
+            uint64_t zigzag = _get_varint(&p, end);
+            timestamp += (uint64_t)((int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1));
+            zigzag = _get_varint(&p, end);
+            address += (uint64_t)((int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1));
+
+            event->timestamp = timestamp;
+            event->address = address;
+            event->block_size = 0;
+            event->site_id = 0;
+            if (event->kind == TR_EVENT_ALLOC) {
+                event->block_size = _get_varint(&p, end);
+                event->site_id = _get_varint(&p, end);
+            }
+        }
+    }
+
+    qsort(worker->events, worker->nevents, sizeof(traceEvent), _tr_compare_events);
+
+    return NULL;
+}
+
+
+static void _tr_apply(const traceEvent* event, hashTable* ht, siteTable* st, const siteId* site_ids, uint64_t nsites,
+                      uint64_t sample_interval) {
+    if (event->kind == TR_EVENT_FREE) {
+        // Frees of blocks allocated before recording started, or not sampled, match nothing
+        allocInfo removed;
+        if (ht_remove(ht, event->address, &removed)) {
+            st_count_free(st, removed.site_id, sp_scale(1, removed.block_size, sample_interval),
+                          sp_scale(removed.block_size, removed.block_size, sample_interval),
+                          event->timestamp - removed.timestamp);
+        }
+        return;
+    }
+
+    allocInfo info = {
+        .block_size = event->block_size,
+        .site_id = event->site_id < nsites? site_ids[event->site_id] : ST_UNKNOWN_SITE,
+        .timestamp = event->timestamp
+    };
+
+    if (!ht_insert(ht, event->address, info)) {
+        fputs("HashTable insertion failure\n", stderr);
+        return;
+    }
+
+    st_count_alloc(st, info.site_id, sp_scale(1, info.block_size, sample_interval),
+                   sp_scale(info.block_size, info.block_size, sample_interval));
+}
+
+
+static size_t _put_varint(uint8_t* buffer, uint64_t value) {
+    size_t length = 0;
+    while (value >= 0x80) {
+        buffer[length++] = (uint8_t)value | 0x80;
+        value >>= 7;
+    }
+    buffer[length++] = (uint8_t)value;
+
+    return length;
+}
+
+
+static uint64_t _get_varint(const uint8_t** p, const uint8_t* end) {
+    uint64_t value = 0;
+    int shift = 0;
+    while (*p < end) {
+        uint8_t byte = *(*p)++;
+        if (shift < 64) {
+            value |= (uint64_t)(byte & 0x7f) << shift;
+        }
+        shift += 7;
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+
+    return value;
+}
+
+
+static int _tr_compare_events(const void* a, const void* b) {
+    const traceEvent* event_a = a;
+    const traceEvent* event_b = b;
+
+    return (event_a->timestamp > event_b->timestamp) - (event_a->timestamp < event_b->timestamp);
+}
@@ -0,0 +1,756 @@
+/*
+ * Copyright (C) 2024 Alejandro Cadarso
+ *
+ * This file is part of Memtrace.
+ *
+ * Memtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Memtrace.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * File: unwind.c
+ * Author: Alejandro Cadarso
+ * Date: 17-10-2026
+ *
+ * This file implements the stack unwinders used by the interposer. The
+ * frame pointer walker follows the saved frame pointer chain and only
+ * works for code built with -fno-omit-frame-pointer, but costs a couple of
+ * loads per frame. The frame pointer walker falls back to the DWARF
+ * unwinder whenever the chain is broken before the first frame of interest.
+ *
+ * On x86_64 the DWARF unwinder walks the stack itself. The first time a
+ * return address is seen its FDE is looked up with _Unwind_Find_FDE and
+ * the call frame program is run up to it, which leaves the rules to
+ * recover the CFA, rbp and the return address. Those rules go in a per-PC
+ * cache, so later walks through the same code cost a cache probe and two
+ * loads per frame. Rules the cache can't express (expressions, signal
+ * frames, CFA based on another register) make the whole capture go through
+ * glibc backtrace() instead, as does every other architecture. backtrace()
+ * is warmed up at init so libgcc is not loaded from within an intercepted
+ * call.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "unwind.h"
+#include "modmap.h"
+
+// Frames of the unwinder itself between uw_capture's caller and the walk
+#define UW_FP_INTERNAL_FRAMES 1
+#define UW_DWARF_INTERNAL_FRAMES 2
+
+#define UW_MAX_BUFFER 128
+
+static unwindMode unwind_mode = UW_DWARF;
+static int unwind_depth = UW_DEFAULT_DEPTH;
+
+/**
+ * Top of the current thread's stack, bounds the frame pointer walk so a
+ * corrupt chain can never make it read unmapped memory. Looked up once per thread
+ */
+static __thread uintptr_t stack_top __attribute__((tls_model("initial-exec")));
+
+#if defined(__x86_64__)
+#define UW_CACHED_DWARF
+#endif
+
+#ifdef UW_CACHED_DWARF
+// Frames of the unwinder itself between uw_capture's caller and the walk
+#define UW_CACHED_INTERNAL_FRAMES 1
+
+// Slots of the per-PC rule cache, as a power of two
+#define UW_CACHE_BITS 14
+
+// Nesting of DW_CFA_remember_state the interpreter keeps track of
+#define UW_MAX_REMEMBERED 8
+
+// x86_64 DWARF register numbers
+#define UW_REG_RBP 6
+#define UW_REG_RSP 7
+#define UW_REG_RA 16
+
+// Slot being written, no return address is ever 1
+#define UW_SLOT_BUSY 1
+
+typedef enum ruleKind {
+    UW_RULE_FRAME = 1,
+    // No FDE or an undefined return address, the walk ends here like it does in libgcc
+    UW_RULE_END,
+    // Needs the full unwinder, the capture goes through backtrace()
+    UW_RULE_UNSUPPORTED
+} ruleKind;
+
+/**
+ * How to step out of a frame, CFA = cfa_reg + cfa_offset, the return
+ * address is at CFA - 8 and rbp at CFA + rbp_offset, or unchanged when 0.
+ * Exactly 8 bytes so a slot can be read with one load
+ */
+typedef union unwindRule {
+    struct {
+        int32_t cfa_offset;
+        int16_t rbp_offset;
+        uint8_t cfa_reg;
+        uint8_t kind;
+    };
+    uint64_t word;
+} unwindRule;
+
+/**
+ * pc doubles as the slot's sequence, a writer claims the slot by swapping
+ * in UW_SLOT_BUSY and publishes it by storing the pc last. A reader that
+ * sees the same pc before and after loading the rule got that pc's rule
+ */
+typedef struct cacheSlot {
+    uintptr_t pc;
+    uint64_t rule;
+} cacheSlot;
+
+static cacheSlot unwind_cache[1 << UW_CACHE_BITS];
+
+// Call frame state while running the instructions of a CIE and FDE
+typedef struct frameState {
+    uint64_t cfa_reg;
+    int64_t cfa_offset;
+    int64_t rbp_offset;
+    int64_t ra_offset;
+    bool rbp_saved;
+    bool ra_saved;
+    bool ra_undefined;
+} frameState;
+
+struct dwarfBases {
+    void* tbase;
+    void* dbase;
+    void* func;
+};
+
+// Exported by libgcc_s, resolved at init, NULL leaves every capture to backtrace()
+static const void* (*find_fde)(void* pc, struct dwarfBases* bases);
+
+#define UW_PC_HASH(pc) \
+    (((uint64_t)(pc) * 0x9E3779B97F4A7C15ULL) >> (64 - UW_CACHE_BITS))
+#endif
+
+
+static int _uw_capture_fp(void** frames, int depth, int skip) __attribute__((noinline));
+static int _uw_capture_dwarf(void** frames, int depth, int skip) __attribute__((noinline));
+static uintptr_t _uw_stack_top(uintptr_t sp);
+#ifdef UW_CACHED_DWARF
+static int _uw_capture_cached(void** frames, int depth, int skip) __attribute__((noinline));
+static unwindRule _uw_rule(uintptr_t pc);
+static unwindRule _uw_find_rule(uintptr_t pc);
+static bool _uw_run_cfa(const uint8_t* insn, const uint8_t* end, uintptr_t* loc, uintptr_t target,
+                        uint64_t code_align, int64_t data_align, const frameState* initial, frameState* state);
+static const uint8_t* _uw_skip_encoded(const uint8_t* p, uint8_t encoding);
+static uint64_t _uw_uleb(const uint8_t** p);
+static int64_t _uw_sleb(const uint8_t** p);
+#endif
+
+
+/************************************************************************************************************
+ *                                          PUBLIC FUNCTIONS                                                *
+ ***********************************************************************************************************/
+
+
+void uw_init(int max_depth) {
+    char* mode_str = getenv("MEMTRACE_UNWIND");
+    if (mode_str && !uw_parse_mode(mode_str, &unwind_mode)) {
+        unwind_mode = UW_DWARF;
+    }
+
+    char* depth_str = getenv("MEMTRACE_DEPTH");
+    unwind_depth = depth_str? atoi(depth_str) : UW_DEFAULT_DEPTH;
+    if (unwind_depth < 1) {
+        unwind_depth = 1;
+    }
+    if (unwind_depth > max_depth) {
+        unwind_depth = max_depth;
+    }
+
+    // The first backtrace() loads libgcc, do it now rather than on the hot path
+    void* warm_up[2];
+    backtrace(warm_up, 2);
+
+#ifdef UW_CACHED_DWARF
+    void* libgcc = dlopen("libgcc_s.so.1", RTLD_NOW | RTLD_NOLOAD);
+    find_fde = libgcc? dlsym(libgcc, "_Unwind_Find_FDE") : dlsym(RTLD_DEFAULT, "_Unwind_Find_FDE");
+#endif
+}
+
+
+bool uw_parse_mode(const char* name, unwindMode* mode) {
+    if (strcmp(name, "dwarf") == 0) {
+        *mode = UW_DWARF;
+        return true;
+    }
+    if (strcmp(name, "fp") == 0) {
+        *mode = UW_FRAME_POINTER;
+        return true;
+    }
+
+    return false;
+}
+
+
+__attribute__((noinline)) int uw_capture(void** frames, int skip) {
+    if (unwind_mode == UW_FRAME_POINTER) {
+        int nframes = _uw_capture_fp(frames, unwind_depth, skip);
+        if (nframes > 0) {
+            return nframes;
+        }
+    }
+
+#ifdef UW_CACHED_DWARF
+    if (find_fde) {
+        int nframes = _uw_capture_cached(frames, unwind_depth, skip);
+        if (nframes >= 0) {
+            return nframes;
+        }
+    }
+#endif
+
+    return _uw_capture_dwarf(frames, unwind_depth, skip);
+}
+
+
+#if defined(UW_TEST) && defined(UW_CACHED_DWARF)
+__attribute__((noinline)) int uw_capture_cached(void** frames, int skip) {
+    return find_fde? _uw_capture_cached(frames, unwind_depth, skip) : -1;
+}
+#endif
+
+
+/************************************************************************************************************
+ *                                          PRIVATE FUNCTIONS                                               *
+ ***********************************************************************************************************/
+
+
+static int _uw_capture_fp(void** frames, int depth, int skip) {
+    uintptr_t* fp = __builtin_frame_address(0);
+    const uintptr_t top = _uw_stack_top((uintptr_t)fp);
+    // Without the stack bounds nothing can be walked safely, the DWARF unwinder takes over
+    if (top == 1) {
+        return 0;
+    }
+
+    skip += UW_FP_INTERNAL_FRAMES;
+
+    int nframes = 0;
+    while (nframes < depth) {
+        if (((uintptr_t)fp & (sizeof(uintptr_t) - 1)) || (uintptr_t)(fp + 2) > top) {
+            break;
+        }
+
+        uintptr_t* next_fp = (uintptr_t*)fp[0];
+        uintptr_t return_address = fp[1];
+        if (!return_address) {
+            break;
+        }
+
+        if (skip) {
+            skip--;
+        } else {
+            frames[nframes++] = (void*)return_address;
+        }
+
+        // Frames must move towards the top of the stack
+        if (next_fp <= fp) {
+            break;
+        }
+        fp = next_fp;
+    }
+
+    // Not even the frames to skip were found, the chain is not usable
+    return skip? 0 : nframes;
+}
+
+
+static int _uw_capture_dwarf(void** frames, int depth, int skip) {
+    void* buffer[UW_MAX_BUFFER];
+
+    skip += UW_DWARF_INTERNAL_FRAMES;
+    if (depth + skip > UW_MAX_BUFFER) {
+        depth = UW_MAX_BUFFER - skip;
+    }
+
+    int nptrs = backtrace(buffer, depth + skip);
+    if (nptrs <= skip) {
+        return 0;
+    }
+
+    memcpy(frames, &buffer[skip], (nptrs - skip) * sizeof(void*));
+
+    return nptrs - skip;
+}
+
+
+// Top of the calling thread's stack, 1 if it can't be found so every walk stops right away
+static uintptr_t _uw_stack_top(uintptr_t sp) {
+    if (!stack_top) {
+        uintptr_t stack_start, stack_end;
+        stack_top = mm_mapping_of(sp, &stack_start, &stack_end)? stack_end : 1;
+    }
+
+    return stack_top;
+}
+
+
+#ifdef UW_CACHED_DWARF
+/**
+ * Returns the number of frames captured, or -1 if a frame needs the full
+ * unwinder. The walk starts from this function's own frame, which always
+ * has a frame pointer since the interposer is built with one
+ */
+static int _uw_capture_cached(void** frames, int depth, int skip) {
+    uintptr_t* fp = __builtin_frame_address(0);
+    const uintptr_t top = _uw_stack_top((uintptr_t)fp);
+    if (top == 1) {
+        return -1;
+    }
+
+    uintptr_t sp = (uintptr_t)(fp + 2);
+    uintptr_t rbp = fp[0];
+    uintptr_t pc = fp[1];
+
+    skip += UW_CACHED_INTERNAL_FRAMES;
+
+    int nframes = 0;
+    while (nframes < depth && pc && sp < top) {
+        if (skip) {
+            skip--;
+        } else {
+            frames[nframes++] = (void*)pc;
+        }
+
+        const unwindRule rule = _uw_rule(pc);
+        if (rule.kind == UW_RULE_END) {
+            break;
+        }
+        if (rule.kind != UW_RULE_FRAME) {
+            return -1;
+        }
+
+        const uintptr_t cfa = (rule.cfa_reg == UW_REG_RSP? sp : rbp) + rule.cfa_offset;
+        // Frames must move towards the top of the stack, a corrupt one ends the walk
+        if (cfa <= sp || cfa > top || (rule.rbp_offset && cfa + rule.rbp_offset < sp)) {
+            break;
+        }
+
+        pc = *(uintptr_t*)(cfa - sizeof(uintptr_t));
+        if (rule.rbp_offset) {
+            rbp = *(uintptr_t*)(cfa + rule.rbp_offset);
+        }
+        sp = cfa;
+    }
+
+    // Not even the frames to skip were found, let backtrace() have a go
+    return skip? -1 : nframes;
+}
+
+
+static unwindRule _uw_rule(uintptr_t pc) {
+    cacheSlot* slot = &unwind_cache[UW_PC_HASH(pc)];
+
+    const uintptr_t seen = __atomic_load_n(&slot->pc, __ATOMIC_ACQUIRE);
+    if (seen == pc) {
+        unwindRule rule = { .word = __atomic_load_n(&slot->rule, __ATOMIC_RELAXED) };
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->pc, __ATOMIC_RELAXED) == pc) {
+            return rule;
+        }
+    }
+
+    const unwindRule rule = _uw_find_rule(pc);
+
+    // Another thread filling the slot wins, the rule is simply not cached this time
+    uintptr_t expected = seen;
+    if (seen != UW_SLOT_BUSY &&
+        __atomic_compare_exchange_n(&slot->pc, &expected, UW_SLOT_BUSY, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&slot->rule, rule.word, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->pc, pc, __ATOMIC_RELEASE);
+    }
+
+    return rule;
+}
+
+
+/**
+ * Runs the call frame program of the FDE covering the return address pc
+ * up to the call. Only the rules of the CFA, rbp and the return address are
+ * kept, the others are not needed to find the next frame
+ */
+static unwindRule _uw_find_rule(uintptr_t pc) {
+    const unwindRule end = { .kind = UW_RULE_END };
+    const unwindRule unsupported = { .kind = UW_RULE_UNSUPPORTED };
+
+    // Return addresses point past the call, which may be the last instruction of the function
+    const uintptr_t target = pc - 1;
+
+    struct dwarfBases bases;
+    const uint8_t* fde = find_fde((void*)target, &bases);
+    if (!fde) {
+        return end;
+    }
+
+    uint32_t fde_length;
+    int32_t cie_delta;
+    memcpy(&fde_length, fde, sizeof(fde_length));
+    memcpy(&cie_delta, fde + 4, sizeof(cie_delta));
+    if (fde_length == UINT32_MAX) {
+        return unsupported;
+    }
+
+    const uint8_t* cie = fde + 4 - cie_delta;
+    uint32_t cie_length;
+    memcpy(&cie_length, cie, sizeof(cie_length));
+    if (cie_length == UINT32_MAX) {
+        return unsupported;
+    }
+
+    const uint8_t* p = cie + 8;
+    const uint8_t version = *p++;
+    const char* augmentation = (const char*)p;
+    p += strlen(augmentation) + 1;
+
+    const uint64_t code_align = _uw_uleb(&p);
+    const int64_t data_align = _uw_sleb(&p);
+    const uint64_t ra_reg = version == 1? *p++ : _uw_uleb(&p);
+    if (ra_reg != UW_REG_RA) {
+        return unsupported;
+    }
+
+    uint8_t fde_encoding = 0;
+    const bool has_augmentation_data = augmentation[0] == 'z';
+    if (has_augmentation_data) {
+        const uint64_t length = _uw_uleb(&p);
+        const uint8_t* data = p;
+        for (const char* c = augmentation + 1; *c; c++) {
+            if (*c == 'R') {
+                fde_encoding = *data++;
+            } else if (*c == 'P') {
+                const uint8_t encoding = *data++;
+                if (!(data = _uw_skip_encoded(data, encoding))) {
+                    return unsupported;
+                }
+            } else if (*c == 'L') {
+                data++;
+            } else if (*c == 'S') {
+                // Signal frames restore every register from the kernel's context
+                return unsupported;
+            }
+        }
+        p += length;
+    } else if (augmentation[0]) {
+        return unsupported;
+    }
+
+    frameState initial = { 0 };
+    uintptr_t loc = (uintptr_t)bases.func;
+    if (!_uw_run_cfa(p, cie + 4 + cie_length, &loc, UINTPTR_MAX, code_align, data_align, NULL, &initial)) {
+        return unsupported;
+    }
+
+    // pc_begin and pc_range, the start of the function was already given by find_fde
+    p = fde + 8;
+    if (!(p = _uw_skip_encoded(p, fde_encoding)) || !(p = _uw_skip_encoded(p, fde_encoding & 0x0f))) {
+        return unsupported;
+    }
+    if (has_augmentation_data) {
+        const uint64_t length = _uw_uleb(&p);
+        p += length;
+    }
+
+    frameState state = initial;
+    loc = (uintptr_t)bases.func;
+    if (!_uw_run_cfa(p, fde + 4 + fde_length, &loc, target, code_align, data_align, &initial, &state)) {
+        return unsupported;
+    }
+
+    if (state.ra_undefined) {
+        return end;
+    }
+    if (!state.ra_saved || state.ra_offset != -(int64_t)sizeof(uintptr_t) ||
+        (state.cfa_reg != UW_REG_RSP && state.cfa_reg != UW_REG_RBP) ||
+        state.cfa_offset < INT32_MIN || state.cfa_offset > INT32_MAX ||
+        (state.rbp_saved && (state.rbp_offset < INT16_MIN || state.rbp_offset >= 0))) {
+        return unsupported;
+    }
+
+    unwindRule rule = {
+        .cfa_offset = state.cfa_offset,
+        .rbp_offset = state.rbp_saved? state.rbp_offset : 0,
+        .cfa_reg = state.cfa_reg,
+        .kind = UW_RULE_FRAME
+    };
+
+    return rule;
+}
+
+
+/**
+ * Interprets call frame instructions until the location passes target,
+ * false on anything the cached rules can't represent. initial holds the
+ * state after the CIE, for DW_CFA_restore, NULL while running the CIE itself
+ */
+static bool _uw_run_cfa(const uint8_t* insn, const uint8_t* end, uintptr_t* loc, uintptr_t target,
+                        uint64_t code_align, int64_t data_align, const frameState* initial, frameState* state) {
+    frameState remembered[UW_MAX_REMEMBERED];
+    int nremembered = 0;
+
+    while (insn < end) {
+        const uint8_t opcode = *insn++;
+        uint64_t reg = UINT64_MAX;
+        int64_t offset = 0;
+        bool saved = false;
+        bool restored = false;
+        uint64_t delta = 0;
+
+        switch (opcode & 0xc0) {
+            case 0x40:          // DW_CFA_advance_loc
+                delta = opcode & 0x3f;
+                break;
+            case 0x80:          // DW_CFA_offset
+                reg = opcode & 0x3f;
+                offset = (int64_t)_uw_uleb(&insn) * data_align;
+                saved = true;
+                break;
+            case 0xc0:          // DW_CFA_restore
+                reg = opcode & 0x3f;
+                restored = true;
+                break;
+            default:
+                switch (opcode) {
+                    case 0x00:  // DW_CFA_nop
+                        break;
+                    case 0x2e:  // DW_CFA_GNU_args_size
+                        _uw_uleb(&insn);
+                        break;
+                    case 0x02:  // DW_CFA_advance_loc1
+                        delta = insn[0];
+                        insn += 1;
+                        break;
+                    case 0x03: {// DW_CFA_advance_loc2
+                        uint16_t value;
+                        memcpy(&value, insn, sizeof(value));
+                        delta = value;
+                        insn += 2;
+                        break;
+                    }
+                    case 0x04: {// DW_CFA_advance_loc4
+                        uint32_t value;
+                        memcpy(&value, insn, sizeof(value));
+                        delta = value;
+                        insn += 4;
+                        break;
+                    }
+                    case 0x05:  // DW_CFA_offset_extended
+                        reg = _uw_uleb(&insn);
+                        offset = (int64_t)_uw_uleb(&insn) * data_align;
+                        saved = true;
+                        break;
+                    case 0x11:  // DW_CFA_offset_extended_sf
+                        reg = _uw_uleb(&insn);
+                        offset = _uw_sleb(&insn) * data_align;
+                        saved = true;
+                        break;
+                    case 0x2f:  // DW_CFA_GNU_negative_offset_extended
+                        reg = _uw_uleb(&insn);
+                        offset = -(int64_t)_uw_uleb(&insn) * data_align;
+                        saved = true;
+                        break;
+                    case 0x06:  // DW_CFA_restore_extended
+                        reg = _uw_uleb(&insn);
+                        restored = true;
+                        break;
+                    case 0x07:  // DW_CFA_undefined
+                        reg = _uw_uleb(&insn);
+                        if (reg == UW_REG_RA) {
+                            state->ra_undefined = true;
+                        } else if (reg == UW_REG_RBP) {
+                            return false;
+                        }
+                        reg = UINT64_MAX;
+                        break;
+                    case 0x08:  // DW_CFA_same_value
+                        reg = _uw_uleb(&insn);
+                        if (reg == UW_REG_RBP) {
+                            state->rbp_saved = false;
+                        } else if (reg == UW_REG_RA) {
+                            return false;
+                        }
+                        reg = UINT64_MAX;
+                        break;
+                    case 0x09:  // DW_CFA_register
+                    case 0x14:  // DW_CFA_val_offset
+                    case 0x15:  // DW_CFA_val_offset_sf
+                        reg = _uw_uleb(&insn);
+                        if (reg == UW_REG_RBP || reg == UW_REG_RA) {
+                            return false;
+                        }
+                        if (opcode == 0x15) { _uw_sleb(&insn); } else { _uw_uleb(&insn); }
+                        reg = UINT64_MAX;
+                        break;
+                    case 0x10:  // DW_CFA_expression
+                    case 0x16: {// DW_CFA_val_expression
+                        reg = _uw_uleb(&insn);
+                        if (reg == UW_REG_RBP || reg == UW_REG_RA) {
+                            return false;
+                        }
+                        const uint64_t length = _uw_uleb(&insn);
+                        insn += length;
+                        reg = UINT64_MAX;
+                        break;
+                    }
+                    case 0x0a:  // DW_CFA_remember_state
+                        if (nremembered == UW_MAX_REMEMBERED) {
+                            return false;
+                        }
+                        remembered[nremembered++] = *state;
+                        break;
+                    case 0x0b:  // DW_CFA_restore_state
+                        if (!nremembered) {
+                            return false;
+                        }
+                        *state = remembered[--nremembered];
+                        break;
+                    case 0x0c:  // DW_CFA_def_cfa
+                        state->cfa_reg = _uw_uleb(&insn);
+                        state->cfa_offset = _uw_uleb(&insn);
+                        break;
+                    case 0x12:  // DW_CFA_def_cfa_sf
+                        state->cfa_reg = _uw_uleb(&insn);
+                        state->cfa_offset = _uw_sleb(&insn) * data_align;
+                        break;
+                    case 0x0d:  // DW_CFA_def_cfa_register
+                        state->cfa_reg = _uw_uleb(&insn);
+                        break;
+                    case 0x0e:  // DW_CFA_def_cfa_offset
+                        state->cfa_offset = _uw_uleb(&insn);
+                        break;
+                    case 0x13:  // DW_CFA_def_cfa_offset_sf
+                        state->cfa_offset = _uw_sleb(&insn) * data_align;
+                        break;
+                    default:
+                        // DW_CFA_set_loc, DW_CFA_def_cfa_expression and anything unknown
+                        return false;
+                }
+        }
+
+        if (delta) {
+            *loc += delta * code_align;
+            if (*loc > target) {
+                break;
+            }
+        }
+
+        if (restored) {
+            if (!initial) {
+                return false;
+            }
+            if (reg == UW_REG_RBP) {
+                state->rbp_saved = initial->rbp_saved;
+                state->rbp_offset = initial->rbp_offset;
+            } else if (reg == UW_REG_RA) {
+                state->ra_saved = initial->ra_saved;
+                state->ra_offset = initial->ra_offset;
+                state->ra_undefined = initial->ra_undefined;
+            }
+        } else if (saved) {
+            if (reg == UW_REG_RBP) {
+                state->rbp_saved = true;
+                state->rbp_offset = offset;
+            } else if (reg == UW_REG_RA) {
+                state->ra_saved = true;
+                state->ra_offset = offset;
+                state->ra_undefined = false;
+            }
+        }
+    }
+
+    return insn <= end;
+}
+
+
+// Skips a pointer encoded with a DW_EH_PE_* encoding, NULL if its size can't be known
+static const uint8_t* _uw_skip_encoded(const uint8_t* p, uint8_t encoding) {
+    // DW_EH_PE_omit
+    if (encoding == 0xff) {
+        return p;
+    }
+
+    // DW_EH_PE_aligned depends on where the pointer lives
+    if ((encoding & 0x70) == 0x50) {
+        return NULL;
+    }
+
+    switch (encoding & 0x0f) {
+        case 0x00:              // DW_EH_PE_absptr
+        case 0x04:              // DW_EH_PE_udata8
+        case 0x0c:              // DW_EH_PE_sdata8
+            return p + 8;
+        case 0x02:              // DW_EH_PE_udata2
+        case 0x0a:              // DW_EH_PE_sdata2
+            return p + 2;
+        case 0x03:              // DW_EH_PE_udata4
+        case 0x0b:              // DW_EH_PE_sdata4
+            return p + 4;
+        case 0x01:              // DW_EH_PE_uleb128
+            _uw_uleb(&p);
+            return p;
+        case 0x09:              // DW_EH_PE_sleb128
+            _uw_sleb(&p);
+            return p;
+        default:
+            return NULL;
+    }
+}
+
+
+static uint64_t _uw_uleb(const uint8_t** p) {
+    uint64_t value = 0;
+    unsigned shift = 0;
+    uint8_t byte;
+    do {
+        byte = *(*p)++;
+        if (shift < 64) {
+            value |= (uint64_t)(byte & 0x7f) << shift;
+        }
+        shift += 7;
+    } while (byte & 0x80);
+
+    return value;
+}
+
+
+static int64_t _uw_sleb(const uint8_t** p) {
+    int64_t value = 0;
+    unsigned shift = 0;
+    uint8_t byte;
+    do {
+        byte = *(*p)++;
+        if (shift < 64) {
+            value |= (int64_t)(byte & 0x7f) << shift;
+        }
+        shift += 7;
+    } while (byte & 0x80);
+
+    if (shift < 64 && (byte & 0x40)) {
+        value |= -((int64_t)1 << shift);
+    }
+
+    return value;
+}
+#endif
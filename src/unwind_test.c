@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2024 Alejandro Cadarso
+ *
+ * This file is part of Memtrace.
+ *
+ * Memtrace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Memtrace.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * File: unwind_test.c
+ * Author: Alejandro Cadarso
+ * Date: 17-10-2026
+ *
+ * This file contains test cases for the cached DWARF unwinder. Call
+ * chains built without frame pointers, with variable sized frames and
+ * through libc callbacks, are walked by the cache and by glibc
+ * backtrace(), both must find the same return addresses. Walking each
+ * chain twice checks the frames are also right once their rules are
+ * cached.
+ *
+ */
+
+#include <alloca.h>
+#include <assert.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "unwind.h"
+
+#define NUM_THREADS 4
+#define MAX_DEPTH 64
+#define MAX_CHAIN 20
+#define NUM_SORTED 32
+
+#ifdef __x86_64__
+
+static void check_frames(void) __attribute__((noinline));
+static int chain(int depth, unsigned salt) __attribute__((noinline, optimize("O2", "omit-frame-pointer")));
+static int flat(int depth, unsigned salt) __attribute__((noinline, optimize("O2", "omit-frame-pointer")));
+static int compare(const void* a, const void* b) __attribute__((optimize("O2", "omit-frame-pointer")));
+
+static void check_frames(void) {
+    void* cached[MAX_DEPTH];
+    void* expected[MAX_DEPTH];
+
+    for (int pass = 0; pass < 2; pass++) {
+        int ncached = uw_capture_cached(cached, 0);
+        int nexpected = backtrace(expected, MAX_DEPTH);
+
+        // Both start in this function, from different calls
+        assert(ncached > 1 && ncached == nexpected);
+        for (int i = 1; i < ncached; i++) {
+            assert(cached[i] == expected[i]);
+        }
+    }
+}
+
+// Variable sized frames, the CFA follows rbp
+static int chain(int depth, unsigned salt) {
+    if (!depth) {
+        check_frames();
+        return 1;
+    }
+
+    char* scratch = alloca(16 + (depth * 37 + salt) % 512);
+    memset(scratch, depth, 16);
+
+    return flat(depth - 1, salt * 3 + 1) + scratch[salt & 15];
+}
+
+// No frame pointer, the CFA follows rsp and rbp is just another register
+static int flat(int depth, unsigned salt) {
+    volatile unsigned scratch[8];
+    scratch[salt & 7] = salt;
+
+    if (!depth) {
+        check_frames();
+        return scratch[salt & 7];
+    }
+
+    return chain(depth - 1, salt + depth) + scratch[salt & 7];
+}
+
+// Called back from qsort, libc frames are walked too
+static int compare(const void* a, const void* b) {
+    static __thread int calls;
+    if (calls++ % 8 == 0) {
+        chain(3, calls);
+    }
+
+    return *(const int*)a - *(const int*)b;
+}
+
+static void* walk_chains(void* arg) {
+    for (int i = 0; i < 200; i++) {
+        chain(i % MAX_CHAIN, i + (unsigned)(size_t)arg);
+    }
+
+    int values[NUM_SORTED];
+    for (int i = 0; i < NUM_SORTED; i++) {
+        values[i] = (i * 7919) % NUM_SORTED;
+    }
+    qsort(values, NUM_SORTED, sizeof(int), compare);
+
+    return NULL;
+}
+
+int main(void) {
+    setenv("MEMTRACE_DEPTH", "64", 1);
+    uw_init(MAX_DEPTH);
+
+    // Fails when libgcc can't be found, every capture would go through backtrace()
+    void* frames[MAX_DEPTH];
+    assert(uw_capture_cached(frames, 0) > 0);
+
+    walk_chains(NULL);
+
+    pthread_t threads[NUM_THREADS];
+    for (size_t t = 0; t < NUM_THREADS; t++) {
+        assert(pthread_create(&threads[t], NULL, walk_chains, (void*)t) == 0);
+    }
+    for (int t = 0; t < NUM_THREADS; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    return 0;
+}
+
+#else
+
+// The cached unwinder is x86_64 only, elsewhere everything goes through backtrace()
+int main(void) {
+    return 0;
+}
+
+#endif